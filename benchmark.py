@@ -13,6 +13,8 @@ LANGUAGES = [
 
 BENCHMARKS = [
     "fib",
+    "method_call",
+    "bound_method",
 ]
 
 times = {}
@@ -49,5 +51,6 @@ def run_benchmark(benchmark):
     times = {}
 
 
-run_benchmark("fib")
+for benchmark in BENCHMARKS:
+    run_benchmark(benchmark)
 
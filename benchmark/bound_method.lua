@@ -0,0 +1,20 @@
+local Button = {}
+Button.__index = Button
+
+function Button.new()
+  return setmetatable({ clicks = 0 }, Button)
+end
+
+function Button:click() self.clicks = self.clicks + 1 end
+
+local function fire(handler) handler() end
+
+local start = os.clock()
+
+local button = Button.new()
+for i = 1, 2000000 do
+  fire(function() button:click() end)
+end
+
+print(button.clicks)
+print("Time:", os.clock() - start)
@@ -0,0 +1,23 @@
+import time
+
+
+class Button:
+    def __init__(self):
+        self.clicks = 0
+
+    def click(self):
+        self.clicks += 1
+
+
+def fire(handler):
+    handler()
+
+
+start = time.time()
+
+button = Button()
+for i in range(2000000):
+    fire(button.click)
+
+print(button.clicks)
+print("Time:", time.time() - start)
@@ -0,0 +1,25 @@
+local Timer = {}
+Timer.__index = Timer
+
+function Timer.new(time)
+  return setmetatable({ totalTime = time, timeLeft = 0 }, Timer)
+end
+
+function Timer:start() self.timeLeft = self.totalTime end
+function Timer:step(delta) self.timeLeft = self.timeLeft - delta end
+function Timer:isOver() return self.timeLeft < 0 end
+
+local start = os.clock()
+
+local timer = Timer.new(100)
+local restarts = 0
+for i = 1, 2000000 do
+  timer:step(1)
+  if timer:isOver() then
+    timer:start()
+    restarts = restarts + 1
+  end
+end
+
+print(restarts)
+print("Time:", os.clock() - start)
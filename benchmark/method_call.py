@@ -0,0 +1,30 @@
+import time
+
+
+class Timer:
+    def __init__(self, time):
+        self.totalTime = time
+        self.timeLeft = 0
+
+    def start(self):
+        self.timeLeft = self.totalTime
+
+    def step(self, delta):
+        self.timeLeft -= delta
+
+    def isOver(self):
+        return self.timeLeft < 0
+
+
+start = time.time()
+
+timer = Timer(100)
+restarts = 0
+for i in range(2000000):
+    timer.step(1)
+    if timer.isOver():
+        timer.start()
+        restarts += 1
+
+print(restarts)
+print("Time:", time.time() - start)
@@ -13,6 +13,33 @@
 
 #define NAN_BOXING
 
+// Threaded dispatch through a table of label addresses. Needs the GCC
+// labels-as-values extension; build with -DNO_COMPUTED_GOTO to fall back
+// to the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Let the optimizer rewrite local arithmetic, moves and compare-and-branch
+// into register-form instructions that address frame slots directly.
+// Build with -DNO_REGISTER_BYTECODE to keep the plain stack encoding.
+#if !defined(NO_REGISTER_BYTECODE)
+#define REGISTER_BYTECODE
+#endif
+
+// Run the passes in ir.c over each finished function before the
+// optimizer. Build with -DNO_IR_PASSES for a plain single-pass compile,
+// which is quicker to start up for the REPL and during development.
+#if !defined(NO_IR_PASSES)
+#define IR_PASSES
+#endif
+
+// Baseline JIT, off by default. Build with -DJIT to compile hot functions
+// to machine code, see jit.h.
+#if defined(JIT) && !(defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING))
+#error "The JIT needs x86-64 Linux and NaN boxing."
+#endif
+
 #define UNUSED __attribute__((unused))
 #define FALLTHROUGH __attribute__((fallthrough))
 
@@ -11,6 +11,10 @@
 #include "tokenizer.h"
 #include "object.h"
 #include "memory.h"
+#include "ir.h"
+#include "optimizer.h"
+#include "table.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -112,6 +116,53 @@ static void emitBytes(struct Parser* parser, u8 byte1, u8 byte2) {
   emitByte(parser, byte2);
 }
 
+static void emitShort(struct Parser* parser, u16 value) {
+  emitBytes(parser, (value >> 8) & 0xff, value & 0xff);
+}
+
+// Globals take a 16 bit slot, every other variable a single byte.
+static void markShared(struct Compiler* compiler, u8 setter, s32 arg);
+
+static void emitVariable(struct Parser* parser, u8 op, s32 arg) {
+  markShared(parser->compiler, op, arg);
+  emitByte(parser, op);
+  if (op == BC_GET_GLOBAL || op == BC_SET_GLOBAL) {
+    emitShort(parser, (u16)arg);
+  } else {
+    emitByte(parser, (u8)arg);
+  }
+}
+
+// Returns the value on top of the stack. When that value comes straight
+// from a call, the call is in tail position and can reuse the frame.
+static void emitValueReturn(struct Parser* parser) {
+  struct Function* function = currentFunction(parser);
+  s32 lastCall = parser->compiler->lastCall;
+  if (lastCall != -1) {
+    u8* op = &function->bc[lastCall];
+    s32 length = function->bcCount - lastCall;
+    if (*op == BC_CALL && length == 2) {
+      *op = BC_TAIL_CALL;
+    } else if (*op == BC_CALL_STATIC && length == 5) {
+      *op = BC_TAIL_CALL_STATIC;
+    } else if (*op == BC_INVOKE && length == 5) {
+      *op = BC_TAIL_INVOKE;
+    }
+  }
+  emitByte(parser, BC_RETURN);
+}
+
+static void emitCache(struct Parser* parser) {
+  struct Function* function = currentFunction(parser);
+  if (function->cacheCount == UINT16_MAX) {
+    error(parser, "Too many property accesses in one function.");
+    emitBytes(parser, 0, 0);
+    return;
+  }
+
+  emitShort(parser, function->cacheCount++);
+}
+
 static s32 emitJump(struct Parser* parser, u8 byte) {
   emitByte(parser, byte);
   emitByte(parser, 0xff);
@@ -119,6 +170,14 @@ static s32 emitJump(struct Parser* parser, u8 byte) {
   return currentFunction(parser)->bcCount - 2;
 }
 
+// A jump that also names a slot, which comes before the jump operand.
+static s32 emitSlotJump(struct Parser* parser, u8 byte, u8 slot) {
+  emitBytes(parser, byte, slot);
+  emitByte(parser, 0xff);
+  emitByte(parser, 0xff);
+  return currentFunction(parser)->bcCount - 2;
+}
+
 static void patchJump(struct Parser* parser, s32 offset) {
   s32 jump = currentFunction(parser)->bcCount - offset - 2;
   if (jump >= UINT16_MAX) {
@@ -127,6 +186,7 @@ static void patchJump(struct Parser* parser, s32 offset) {
 
   currentFunction(parser)->bc[offset] = (jump >> 8) & 0xff;
   currentFunction(parser)->bc[offset + 1] = jump & 0xff;
+  parser->compiler->lastJumpTarget = currentFunction(parser)->bcCount;
 }
 
 static void emitLoop(struct Parser* parser, s32 loopStart) {
@@ -147,6 +207,13 @@ static void emitReturn(struct Parser* parser) {
 }
 
 static u8 makeConstant(struct Parser* parser, Value value) {
+  struct ValueArray* constants = &currentFunction(parser)->constants;
+  for (s32 i = 0; i < constants->count && i <= UINT8_MAX; i++) {
+    if (sameConstant(constants->values[i], value)) {
+      return (u8)i;
+    }
+  }
+
   s32 constant = addFunctionConstant(parser->H, currentFunction(parser), value);
   if (constant > UINT8_MAX) {
     error(parser, "Too many constants in the global scope or functions.");
@@ -157,7 +224,60 @@ static u8 makeConstant(struct Parser* parser, Value value) {
 }
 
 static void emitConstant(struct Parser* parser, Value value) {
+  struct Function* function = currentFunction(parser);
+  s32 constantCount = function->constants.count;
+  parser->compiler->lastLiteral = function->bcCount;
   emitBytes(parser, BC_CONSTANT, makeConstant(parser, value));
+  parser->compiler->lastLiteralAdded = function->constants.count > constantCount;
+}
+
+static void emitLiteral(struct Parser* parser, Value value) {
+  u8 op;
+  if (IS_NIL(value)) {
+    op = BC_NIL;
+  } else if (IS_BOOL(value)) {
+    op = AS_BOOL(value) ? BC_TRUE : BC_FALSE;
+  } else {
+    emitConstant(parser, value);
+    return;
+  }
+
+  parser->compiler->lastLiteral = currentFunction(parser)->bcCount;
+  parser->compiler->lastLiteralAdded = false;
+  emitByte(parser, op);
+}
+
+// Returns where the literal that was compiled last starts, and its value,
+// if that literal is the last code so far and no jump lands after it.
+// Otherwise returns -1.
+static s32 lastLiteral(struct Parser* parser, Value* value) {
+  struct Compiler* compiler = parser->compiler;
+  struct Function* function = currentFunction(parser);
+  s32 offset = compiler->lastLiteral;
+  if (offset == -1 || compiler->lastJumpTarget == function->bcCount) {
+    return -1;
+  }
+
+  switch (function->bc[offset]) {
+    case BC_CONSTANT:
+      *value = function->constants.values[function->bc[offset + 1]];
+      return offset + 2 == function->bcCount ? offset : -1;
+    case BC_NIL:   *value = NEW_NIL; break;
+    case BC_TRUE:  *value = NEW_TRUE; break;
+    case BC_FALSE: *value = NEW_FALSE; break;
+    default:       return -1;
+  }
+  return offset + 1 == function->bcCount ? offset : -1;
+}
+
+// Takes back the constant of a folded literal if it added one, which is
+// then the last in the pool.
+static void dropLiteral(struct Parser* parser, s32 offset, bool added) {
+  struct Function* function = currentFunction(parser);
+  if (added && function->bc[offset] == BC_CONSTANT
+      && function->bc[offset + 1] == function->constants.count - 1) {
+    function->constants.count--;
+  }
 }
 
 static void initCompiler(struct Parser* parser,
@@ -173,6 +293,16 @@ static void initCompiler(struct Parser* parser,
   compiler->scopeDepth = 0;
   compiler->function = newFunction(parser->H);
   compiler->loop = NULL;
+  compiler->lastCall = -1;
+  compiler->lastStatic = -1;
+  compiler->lastJumpTarget = -1;
+  compiler->lastLiteral = -1;
+  compiler->lastLiteralAdded = false;
+  compiler->captureCount = 0;
+  compiler->known = NEW_NIL;
+  compiler->knownEnd = -1;
+  compiler->knownIsGlobal = false;
+  compiler->inlineSiteCount = 0;
   parser->compiler = compiler;
 
   if (type != FUNCTION_TYPE_SCRIPT) {
@@ -189,6 +319,8 @@ static void initCompiler(struct Parser* parser,
       &parser->compiler->locals[parser->compiler->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->isShared = false;
+  local->isDefined = true;
   if (type != FUNCTION_TYPE_FUNCTION) {
     local->name.start = "self";
     local->name.length = 4;
@@ -198,10 +330,36 @@ static void initCompiler(struct Parser* parser,
   }
 }
 
+// Captures of locals from fromLocal up whose scope is over. The ones
+// that were never shared copy the value into the closure instead.
+static void resolveCaptures(struct Parser* parser, s32 fromLocal) {
+  struct Compiler* compiler = parser->compiler;
+  s32 kept = 0;
+  for (s32 i = 0; i < compiler->captureCount; i++) {
+    struct CaptureSite site = compiler->captures[i];
+    if (site.local < fromLocal) {
+      compiler->captures[kept++] = site;
+    } else if (!compiler->locals[site.local].isShared) {
+      compiler->function->bc[site.offset] = CAPTURE_VALUE;
+    }
+  }
+  compiler->captureCount = kept;
+}
+
 static struct Function* endCompiler(struct Parser* parser) {
   emitReturn(parser);
+  resolveCaptures(parser, 0);
   struct Function* function = parser->compiler->function;
 
+  if (!parser->hadError) {
+#ifdef IR_PASSES
+    runIrPasses(parser->H, function,
+        parser->compiler->inlineSites, parser->compiler->inlineSiteCount);
+#endif
+    optimizeFunction(parser->H, function);
+  }
+  initInlineCaches(parser->H, function);
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser->hadError) {
     disassembleFunction(
@@ -283,6 +441,7 @@ static void beginScope(struct Parser* parser) {
 static void endScope(struct Parser* parser) {
   parser->compiler->scopeDepth--;
   s32 discarded = discardLocals(parser, parser->compiler->scopeDepth);
+  resolveCaptures(parser, parser->compiler->localCount - discarded);
   parser->compiler->localCount -= discarded;
 }
 
@@ -303,19 +462,48 @@ static void markInitialized(struct Parser* parser, bool isGlobal) {
       = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(struct Parser* parser, u8 global, bool isGlobal) {
+static void defineVariable(struct Parser* parser, u16 global, bool isGlobal) {
   if (!isGlobal) {
     markInitialized(parser, isGlobal);
+    parser->compiler->locals[parser->compiler->localCount - 1].isDefined = true;
     return;
   }
 
-  emitBytes(parser, BC_DEFINE_GLOBAL, global);
+  emitByte(parser, BC_DEFINE_GLOBAL);
+  emitShort(parser, global);
 }
 
 static u8 identifierConstant(struct Parser* parser, struct Token* name) {
   return makeConstant(parser, NEW_OBJ(copyString(parser->H, name->start, name->length)));
 }
 
+static u16 globalVariable(struct Parser* parser, struct Token* name) {
+  struct String* string = copyString(parser->H, name->start, name->length);
+  s32 slot = globalSlot(parser->H, string);
+  if (slot > UINT16_MAX) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+
+  return (u16)slot;
+}
+
+static s32 resolveField(struct StructCompiler* structCompiler, struct Token* name) {
+  for (s32 i = 0; i < structCompiler->fieldCount; i++) {
+    if (identifiersEqual(name, &structCompiler->fields[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void addField(struct StructCompiler* structCompiler, struct Token name) {
+  if (resolveField(structCompiler, &name) == -1
+      && structCompiler->fieldCount < U8_COUNT) {
+    structCompiler->fields[structCompiler->fieldCount++] = name;
+  }
+}
+
 static s32 resolveLocal(
     struct Parser* parser, struct Compiler* compiler, struct Token* name) {
   for (s32 i = compiler->localCount - 1; i >= 0; i--) {
@@ -351,6 +539,21 @@ static s32 addUpvalue(struct Parser* parser, struct Compiler* compiler, u8 index
   return compiler->function->upvalueCount++;
 }
 
+// Assigning a variable after its declaration means every closure that
+// captures it has to see the new value, so it can't be copied into them.
+static void markShared(struct Compiler* compiler, u8 setter, s32 arg) {
+  if (setter == BC_SET_LOCAL) {
+    compiler->locals[arg].isShared = true;
+  } else if (setter == BC_SET_UPVALUE) {
+    struct CompilerUpvalue* upvalue = &compiler->upvalues[arg];
+    if (upvalue->isLocal) {
+      compiler->enclosing->locals[upvalue->index].isShared = true;
+    } else {
+      markShared(compiler->enclosing, BC_SET_UPVALUE, upvalue->index);
+    }
+  }
+}
+
 static s32 resolveUpvalue(struct Parser* parser, struct Compiler* compiler, struct Token* name) {
   if (compiler->enclosing == NULL) {
     return -1;
@@ -370,6 +573,105 @@ static s32 resolveUpvalue(struct Parser* parser, struct Compiler* compiler, stru
   return -1;
 }
 
+// Whether a local other than one of top-level code's shadows name.
+static bool isShadowed(struct Parser* parser, struct Token* name) {
+  for (struct Compiler* compiler = parser->compiler;
+      compiler != NULL;
+      compiler = compiler->enclosing) {
+    for (s32 i = compiler->localCount - 1; i >= 0; i--) {
+      if (identifiersEqual(name, &compiler->locals[i].name)
+          && (compiler->enclosing != NULL || compiler->locals[i].depth > 0)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The enum declared in top-level code that name refers to, or NULL when
+// it's something else or a local shadows it.
+static struct Enum* resolveEnum(struct Parser* parser, struct Token* name) {
+  if (isShadowed(parser, name)) {
+    return NULL;
+  }
+
+  Value enoom;
+  struct String* string = copyString(parser->H, name->start, name->length);
+  if (!tableGet(&parser->enums, string, &enoom)) {
+    return NULL;
+  }
+  return AS_ENUM(enoom);
+}
+
+// Whether name refers to a struct declared in top-level code.
+static bool isKnownStruct(struct Parser* parser, struct Token* name) {
+  if (parser->structs.count == 0 || isShadowed(parser, name)) {
+    return false;
+  }
+
+  Value strooct;
+  struct String* string = copyString(parser->H, name->start, name->length);
+  return tableGet(&parser->structs, string, &strooct);
+}
+
+// Notes that the code so far ends in a read of the top-level function or
+// struct name refers to, if it is one, for a call straight on it. A global
+// one may have been assigned by code compiled before its declaration.
+static void noteKnown(struct Parser* parser, struct Token* name, bool isGlobal) {
+  if ((parser->functions.count == 0 && parser->structs.count == 0)
+      || isShadowed(parser, name)) {
+    return;
+  }
+
+  Value known;
+  struct String* string = copyString(parser->H, name->start, name->length);
+  if (tableGet(&parser->functions, string, &known)
+      || tableGet(&parser->structs, string, &known)) {
+    parser->compiler->known = known;
+    parser->compiler->knownEnd = currentFunction(parser)->bcCount;
+    parser->compiler->knownIsGlobal = isGlobal;
+  }
+}
+
+// The known value the code so far ends in a read of, or nil.
+static Value lastKnown(struct Parser* parser) {
+  struct Compiler* compiler = parser->compiler;
+  s32 end = currentFunction(parser)->bcCount;
+  if (compiler->knownEnd != end || compiler->lastJumpTarget == end) {
+    return NEW_NIL;
+  }
+  return compiler->known;
+}
+
+// The closure the function compiled last evaluates to, when it is the
+// same one every time.
+static struct Closure* sharedClosure(struct Parser* parser) {
+  struct Function* function = currentFunction(parser);
+  s32 offset = function->bcCount - 2;
+  if (offset < 0 || function->bc[offset] != BC_CONSTANT) {
+    return NULL;
+  }
+
+  Value value = function->constants.values[function->bc[offset + 1]];
+  return IS_CLOSURE(value) ? AS_CLOSURE(value) : NULL;
+}
+
+static bool isAssignment(enum TokenType type) {
+  switch (type) {
+    case TOKEN_EQUAL:
+    case TOKEN_PLUS_EQUAL:
+    case TOKEN_MINUS_EQUAL:
+    case TOKEN_STAR_EQUAL:
+    case TOKEN_SLASH_EQUAL:
+    case TOKEN_STAR_STAR_EQUAL:
+    case TOKEN_PERCENT_EQUAL:
+    case TOKEN_DOT_DOT_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
 static void addLocal(struct Parser* parser, struct Token name) {
   if (parser->compiler->localCount == U8_COUNT) {
     error(parser, "Too many local variables in function.");
@@ -382,11 +684,26 @@ static void addLocal(struct Parser* parser, struct Token name) {
   parser->compiler->localCount++;
   local->name = name;
   local->isCaptured = false;
+  local->isShared = false;
+  local->isDefined = false;
   local->depth = -1;
   local->depth = parser->compiler->scopeDepth;
 }
 
+// A new top-level declaration replaces whatever enum, struct or function
+// had its name.
+static void forgetDeclaration(struct Parser* parser, struct Token* name, bool isGlobal) {
+  struct Compiler* compiler = parser->compiler;
+  if (isGlobal || (compiler->enclosing == NULL && compiler->scopeDepth == 0)) {
+    struct String* string = copyString(parser->H, name->start, name->length);
+    tableDelete(&parser->enums, string);
+    tableDelete(&parser->structs, string);
+    tableDelete(&parser->functions, string);
+  }
+}
+
 static void declareVariable(struct Parser* parser, bool isGlobal) {
+  forgetDeclaration(parser, &parser->previous, isGlobal);
   if (isGlobal) {
     return;
   }
@@ -407,7 +724,7 @@ static void declareVariable(struct Parser* parser, bool isGlobal) {
   addLocal(parser, *name);
 }
 
-static u8 parseVariable(struct Parser* parser, bool isGlobal, const char* errorMessage) {
+static u16 parseVariable(struct Parser* parser, bool isGlobal, const char* errorMessage) {
   consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable(parser, isGlobal);
@@ -415,7 +732,7 @@ static u8 parseVariable(struct Parser* parser, bool isGlobal, const char* errorM
     return 0;
   }
 
-  return identifierConstant(parser, &parser->previous);
+  return globalVariable(parser, &parser->previous);
 }
 
 static void grouping(struct Parser* parser, UNUSED bool canAssign) {
@@ -425,7 +742,11 @@ static void grouping(struct Parser* parser, UNUSED bool canAssign) {
 
 static void number(struct Parser* parser, UNUSED bool canAssign) {
   f64 value = strtod(parser->previous.start, NULL);
-  emitConstant(parser, NEW_NUMBER(value));
+  if (value >= INT32_MIN && value <= INT32_MAX && value == (s32)value) {
+    emitConstant(parser, NEW_INT((s32)value));
+  } else {
+    emitConstant(parser, NEW_NUMBER(value));
+  }
 }
 
 static void string(struct Parser* parser, UNUSED bool canAssign) {
@@ -435,33 +756,19 @@ static void string(struct Parser* parser, UNUSED bool canAssign) {
           parser->H, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void namedVariable(struct Parser* parser, struct Token name, bool canAssign) {
-  u8 getter, setter;
-  s32 arg = resolveLocal(parser, parser->compiler, &name);
-
-  if (arg != -1) {
-    getter = BC_GET_LOCAL;
-    setter = BC_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
-    getter = BC_GET_UPVALUE;
-    setter = BC_SET_UPVALUE;
-  } else {
-    arg = identifierConstant(parser, &name);
-    getter = BC_GET_GLOBAL;
-    setter = BC_SET_GLOBAL;
-  }
-
+static void variableAccess(
+    struct Parser* parser, u8 getter, u8 setter, s32 arg, bool canAssign) {
 #define COMPOUND_ASSIGNMENT(operator) \
     do { \
-      emitBytes(parser, getter, (u8)arg); \
+      emitVariable(parser, getter, arg); \
       expression(parser); \
       emitByte(parser, operator); \
-      emitBytes(parser, setter, (u8)arg); \
+      emitVariable(parser, setter, arg); \
     } while (false)
 
   if (canAssign && match(parser, TOKEN_EQUAL)) {
     expression(parser);
-    emitBytes(parser, setter, (u8)arg);
+    emitVariable(parser, setter, arg);
   } else if (canAssign && match(parser, TOKEN_PLUS_EQUAL)) {
     COMPOUND_ASSIGNMENT(BC_ADD);
   } else if (canAssign && match(parser, TOKEN_MINUS_EQUAL)) {
@@ -477,14 +784,64 @@ static void namedVariable(struct Parser* parser, struct Token name, bool canAssi
   } else if (canAssign && match(parser, TOKEN_DOT_DOT_EQUAL)) {
     COMPOUND_ASSIGNMENT(BC_CONCAT);
   } else {
-    emitBytes(parser, getter, (u8)arg);
+    emitVariable(parser, getter, arg);
   }
 #undef COMPOUND_ASSIGNMENT
 }
 
+// Returns the instruction that reads the variable.
+static u8 namedVariable(struct Parser* parser, struct Token name, bool canAssign) {
+  // Code compiled since the declaration relies on the enum's values, and
+  // on the static methods of the struct.
+  if (canAssign && isAssignment(parser->current.type)) {
+    if (resolveEnum(parser, &name) != NULL) {
+      error(parser, "Can't assign to an enum.");
+    } else if (isKnownStruct(parser, &name)) {
+      error(parser, "Can't assign to a struct.");
+    }
+  }
+
+  u8 getter, setter;
+  s32 arg = resolveLocal(parser, parser->compiler, &name);
+
+  if (arg != -1) {
+    getter = BC_GET_LOCAL;
+    setter = BC_SET_LOCAL;
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
+    getter = BC_GET_UPVALUE;
+    setter = BC_SET_UPVALUE;
+  } else {
+    arg = globalVariable(parser, &name);
+    getter = BC_GET_GLOBAL;
+    setter = BC_SET_GLOBAL;
+  }
+
+  variableAccess(parser, getter, setter, arg, canAssign);
+  return getter;
+}
+
+// Enum values are fixed when the enum is declared, so Enum:Value compiles
+// to the value itself instead of a lookup.
+static void enumValue(struct Parser* parser, struct Enum* enoom) {
+  consume(parser, TOKEN_COLON, "Expected ':' after enum.");
+  consume(parser, TOKEN_IDENTIFIER, "Expected enum value name.");
+
+  Value value;
+  struct String* name = copyString(
+      parser->H, parser->previous.start, parser->previous.length);
+  if (!tableGet(&enoom->values, name, &value)) {
+    error(parser, "Enum value does not exist.");
+    return;
+  }
+  emitConstant(parser, value);
+}
+
 static void variable(struct Parser* parser, UNUSED bool canAssign) {
   struct Token name = parser->previous;
-  if (match(parser, TOKEN_LBRACE)) { // Struct initalization
+  struct Enum* enoom;
+  if (check(parser, TOKEN_COLON) && (enoom = resolveEnum(parser, &name)) != NULL) {
+    enumValue(parser, enoom);
+  } else if (match(parser, TOKEN_LBRACE)) { // Struct initalization
     namedVariable(parser, name, canAssign);
     emitByte(parser, BC_INSTANCE);
 
@@ -506,52 +863,82 @@ static void variable(struct Parser* parser, UNUSED bool canAssign) {
 
     consume(parser, TOKEN_RBRACE, "Unterminated struct initializer.");
   } else { // Variable reference
-    namedVariable(parser, name, canAssign);
-  }
-}
-
-static void self(struct Parser* parser, UNUSED bool canAssign) {
-  if (parser->structCompiler == NULL) {
-    error(parser, "Can only use 'self' inside struct methods.");
-    return;
+    bool assigns = canAssign && isAssignment(parser->current.type);
+    u8 getter = namedVariable(parser, name, canAssign);
+    if (!assigns) {
+      noteKnown(parser, &name, getter == BC_GET_GLOBAL);
+    }
   }
-
-  variable(parser, false);
 }
 
+// Operations on literals are worked out here, and their result compiled
+// as a literal in place of the operands.
 static void unary(struct Parser* parser, UNUSED bool canAssign) {
   enum TokenType op = parser->previous.type; 
+  s32 operandStart = currentFunction(parser)->bcCount;
 
   parsePrecedence(parser, PREC_UNARY);
 
+  u8 instruction;
   switch (op) {
-    case TOKEN_MINUS: emitByte(parser, BC_NEGATE); break;
-    case TOKEN_BANG:  emitByte(parser, BC_NOT); break;
+    case TOKEN_MINUS: instruction = BC_NEGATE; break;
+    case TOKEN_BANG:  instruction = BC_NOT; break;
     default: return;
   }
+
+  Value operand = NEW_NIL, result;
+  bool added = parser->compiler->lastLiteralAdded;
+  if (lastLiteral(parser, &operand) == operandStart
+      && foldUnary(instruction, operand, &result)) {
+    dropLiteral(parser, operandStart, added);
+    currentFunction(parser)->bcCount = operandStart;
+    emitLiteral(parser, result);
+    return;
+  }
+  emitByte(parser, instruction);
 }
 
 static void binary(struct Parser* parser, UNUSED bool canAssign) {
   enum TokenType op = parser->previous.type;
   struct ParseRule* rule = getRule(op);
+
+  Value left = NEW_NIL, right = NEW_NIL, result;
+  s32 leftStart = lastLiteral(parser, &left);
+  bool leftAdded = parser->compiler->lastLiteralAdded;
+  s32 rightStart = currentFunction(parser)->bcCount;
   parsePrecedence(parser, (enum Precedence)(rule->precedence + 1));
 
+  u8 instruction;
   switch (op) {
-    case TOKEN_PLUS:          emitByte(parser, BC_ADD); break;
-    case TOKEN_MINUS:         emitByte(parser, BC_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(parser, BC_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(parser, BC_DIVIDE); break;
-    case TOKEN_PERCENT:       emitByte(parser, BC_MODULO); break;
-    case TOKEN_DOT_DOT:       emitByte(parser, BC_CONCAT); break;
-    case TOKEN_STAR_STAR:     emitByte(parser, BC_POW); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(parser, BC_EQUAL); break;
-    case TOKEN_BANG_EQUAL:    emitByte(parser, BC_NOT_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(parser, BC_GREATER); break;
-    case TOKEN_LESS:          emitByte(parser, BC_LESSER); break;
-    case TOKEN_GREATER_EQUAL: emitByte(parser, BC_GREATER_EQUAL); break;
-    case TOKEN_LESS_EQUAL:    emitByte(parser, BC_LESSER_EQUAL); break;
+    case TOKEN_PLUS:          instruction = BC_ADD; break;
+    case TOKEN_MINUS:         instruction = BC_SUBTRACT; break;
+    case TOKEN_STAR:          instruction = BC_MULTIPLY; break;
+    case TOKEN_SLASH:         instruction = BC_DIVIDE; break;
+    case TOKEN_PERCENT:       instruction = BC_MODULO; break;
+    case TOKEN_DOT_DOT:       instruction = BC_CONCAT; break;
+    case TOKEN_STAR_STAR:     instruction = BC_POW; break;
+    case TOKEN_EQUAL_EQUAL:   instruction = BC_EQUAL; break;
+    case TOKEN_BANG_EQUAL:    instruction = BC_NOT_EQUAL; break;
+    case TOKEN_GREATER:       instruction = BC_GREATER; break;
+    case TOKEN_LESS:          instruction = BC_LESSER; break;
+    case TOKEN_GREATER_EQUAL: instruction = BC_GREATER_EQUAL; break;
+    case TOKEN_LESS_EQUAL:    instruction = BC_LESSER_EQUAL; break;
     default: return;
   }
+
+  bool rightAdded = parser->compiler->lastLiteralAdded;
+  if (leftStart != -1 && lastLiteral(parser, &right) == rightStart
+      && foldBinary(parser->H, instruction, left, right, &result)) {
+    // The result can be a new string, kept by the pool from here on.
+    push(parser->H, result);
+    dropLiteral(parser, rightStart, rightAdded);
+    dropLiteral(parser, leftStart, leftAdded);
+    currentFunction(parser)->bcCount = leftStart;
+    emitLiteral(parser, result);
+    pop(parser->H);
+    return;
+  }
+  emitByte(parser, instruction);
 }
 
 static u8 argumentList(struct Parser* parser) {
@@ -570,8 +957,37 @@ static u8 argumentList(struct Parser* parser) {
 }
 
 static void call(struct Parser* parser, UNUSED bool canAssign) {
+  // A static method of a top-level struct is called without being looked
+  // up on its own first. Static methods never change, so it makes no
+  // difference that the lookup now comes after the arguments.
+  struct Compiler* compiler = parser->compiler;
+  struct Function* function = currentFunction(parser);
+  Value callee = lastKnown(parser);
+  s32 receiverEnd = -1;
+  u8 name = 0;
+  if (compiler->lastStatic != -1 && compiler->lastStatic + 2 == function->bcCount
+      && compiler->lastJumpTarget != function->bcCount) {
+    receiverEnd = compiler->lastStatic;
+    name = function->bc[receiverEnd + 1];
+    function->bcCount = receiverEnd;
+  }
+
   u8 argCount = argumentList(parser);
-  emitBytes(parser, BC_CALL, argCount);
+  compiler->lastCall = function->bcCount;
+  if (IS_CLOSURE(callee) && compiler->inlineSiteCount < U8_COUNT) {
+    struct InlineSite* site = &compiler->inlineSites[compiler->inlineSiteCount++];
+    site->offset = function->bcCount;
+    site->receiverEnd = receiverEnd;
+    site->callee = AS_CLOSURE(callee);
+  }
+
+  if (receiverEnd != -1) {
+    emitBytes(parser, BC_CALL_STATIC, name);
+    emitByte(parser, argCount);
+    emitCache(parser);
+  } else {
+    emitBytes(parser, BC_CALL, argCount);
+  }
 }
 
 static void ternery(struct Parser* parser, UNUSED bool canAssign) {
@@ -595,25 +1011,30 @@ static void ternery(struct Parser* parser, UNUSED bool canAssign) {
   patchJump(parser, elseJump);
 }
 
-static void dot(struct Parser* parser, bool canAssign) {
-  consume(parser, TOKEN_IDENTIFIER, "Expected property name.");
+// Compiles an access to the property named by the previous token.
+static void property(struct Parser* parser, bool canAssign) {
   u8 name = identifierConstant(parser, &parser->previous);
 
 #define COMPOUND_ASSIGNMENT(operator) \
     do { \
       emitBytes(parser, BC_PUSH_PROPERTY, name); \
+      emitCache(parser); \
       expression(parser); \
       emitByte(parser, operator); \
       emitBytes(parser, BC_SET_PROPERTY, name); \
+      emitCache(parser); \
     } while (false)
 
   if (canAssign && match(parser, TOKEN_EQUAL)) {
     expression(parser);
     emitBytes(parser, BC_SET_PROPERTY, name);
+    emitCache(parser);
   } else if (match(parser, TOKEN_LPAREN)) {
     u8 argCount = argumentList(parser);
+    parser->compiler->lastCall = currentFunction(parser)->bcCount;
     emitBytes(parser, BC_INVOKE, name);
     emitByte(parser, argCount);
+    emitCache(parser);
   } else if (canAssign && match(parser, TOKEN_PLUS_EQUAL)) {
     COMPOUND_ASSIGNMENT(BC_ADD);
   } else if (canAssign && match(parser, TOKEN_MINUS_EQUAL)) {
@@ -630,10 +1051,43 @@ static void dot(struct Parser* parser, bool canAssign) {
     COMPOUND_ASSIGNMENT(BC_CONCAT);
   } else {
     emitBytes(parser, BC_GET_PROPERTY, name);
+    emitCache(parser);
   }
 #undef COMPOUND_ASSIGNMENT
 }
 
+static void dot(struct Parser* parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expected property name.");
+  property(parser, canAssign);
+}
+
+static void self(struct Parser* parser, bool canAssign) {
+  if (parser->structCompiler == NULL) {
+    error(parser, "Can only use 'self' inside struct methods.");
+    return;
+  }
+
+  // In a method, self is local 0 and always an instance of the struct
+  // being compiled, so its fields declared so far can be read by slot.
+  // Functions nested in the method see self as an upvalue instead.
+  if (parser->compiler->type == FUNCTION_TYPE_METHOD
+      && match(parser, TOKEN_DOT)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expected property name.");
+    s32 field = resolveField(parser->structCompiler, &parser->previous);
+    if (field != -1 && !check(parser, TOKEN_LPAREN)) {
+      variableAccess(
+          parser, BC_GET_SELF_FIELD, BC_SET_SELF_FIELD, field, canAssign);
+      return;
+    }
+
+    emitBytes(parser, BC_GET_LOCAL, 0);
+    property(parser, canAssign);
+    return;
+  }
+
+  variable(parser, false);
+}
+
 static void subscript(struct Parser* parser, bool canAssign) {
   expression(parser);
   consume(parser, TOKEN_RBRACKET, "Unterminated subscript operator.");
@@ -647,9 +1101,25 @@ static void subscript(struct Parser* parser, bool canAssign) {
 }
 
 static void staticDot(struct Parser* parser, UNUSED bool canAssign) {
+  Value strooct = lastKnown(parser);
   consume(parser, TOKEN_IDENTIFIER, "Expected static method name.");
   u8 name = identifierConstant(parser, &parser->previous);
+  struct Function* function = currentFunction(parser);
+  s32 offset = function->bcCount;
   emitBytes(parser, BC_GET_STATIC, name);
+
+  // Only a method the struct is known to have is looked up after the
+  // arguments, so no error can come after their side effects. That needs
+  // the name to still hold the struct, which a global one might not.
+  Value method;
+  if (IS_STRUCT(strooct) && tableGet(&AS_STRUCT(strooct)->staticMethods,
+      AS_STRING(function->constants.values[name]), &method)) {
+    if (!parser->compiler->knownIsGlobal) {
+      parser->compiler->lastStatic = offset;
+    }
+    parser->compiler->known = method;
+    parser->compiler->knownEnd = function->bcCount;
+  }
 }
 
 static void function(struct Parser* parser, enum FunctionType type, bool isLambda) {
@@ -675,7 +1145,7 @@ static void function(struct Parser* parser, enum FunctionType type, bool isLambd
     block(parser);
   } else if (match(parser, TOKEN_RIGHT_ARROW)) {
     expression(parser);
-    emitByte(parser, BC_RETURN);
+    emitValueReturn(parser);
     if (!isLambda) {
       consume(parser, TOKEN_SEMICOLON, "Expected ';' after expression.");
     }
@@ -684,11 +1154,37 @@ static void function(struct Parser* parser, enum FunctionType type, bool isLambd
   }
 
   struct Function* function = endCompiler(parser);
+  if (function->upvalueCount == 0) {
+    // Nothing to capture, so every evaluation can share one closure that
+    // lives as long as the enclosing function's constants.
+    push(parser->H, NEW_OBJ(function));
+    struct Closure* closure = newClosure(parser->H, function);
+    pop(parser->H);
+    emitConstant(parser, NEW_OBJ(closure));
+    return;
+  }
+
   emitBytes(parser, BC_CLOSURE, makeConstant(parser, NEW_OBJ(function)));
 
   for (s32 i = 0; i < function->upvalueCount; i++) {
-    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(parser, compiler.upvalues[i].index);
+    if (!compiler.upvalues[i].isLocal) {
+      emitByte(parser, CAPTURE_UPVALUE);
+      emitByte(parser, compiler.upvalues[i].index);
+      continue;
+    }
+
+    // Boxed for now, the enclosing scope decides when it ends.
+    u8 index = compiler.upvalues[i].index;
+    struct Compiler* current = parser->compiler;
+    if (!current->locals[index].isDefined || current->captureCount == U8_COUNT) {
+      current->locals[index].isShared = true;
+    } else {
+      struct CaptureSite* site = &current->captures[current->captureCount++];
+      site->local = index;
+      site->offset = currentFunction(parser)->bcCount;
+    }
+    emitByte(parser, CAPTURE_LOCAL);
+    emitByte(parser, index);
   }
 }
 
@@ -698,9 +1194,9 @@ static void lambda(struct Parser* parser, UNUSED bool canAssign) {
 
 static void literal(struct Parser* parser, UNUSED bool canAssign) {
   switch (parser->previous.type) {
-    case TOKEN_FALSE: emitByte(parser, BC_FALSE); break;
-    case TOKEN_TRUE: emitByte(parser, BC_TRUE); break;
-    case TOKEN_NIL: emitByte(parser, BC_NIL); break;
+    case TOKEN_FALSE: emitLiteral(parser, NEW_FALSE); break;
+    case TOKEN_TRUE: emitLiteral(parser, NEW_TRUE); break;
+    case TOKEN_NIL: emitLiteral(parser, NEW_NIL); break;
     default: return;
   }
 }
@@ -852,6 +1348,16 @@ static void method(struct Parser* parser, bool isStatic) {
       ? FUNCTION_TYPE_FUNCTION
       : FUNCTION_TYPE_METHOD;
   function(parser, type, false);
+
+  // The compiler's copy gets every static method, with nil for those
+  // that aren't the same closure every time.
+  struct Closure* closure = sharedClosure(parser);
+  if (isStatic) {
+    struct Function* function = currentFunction(parser);
+    tableSet(parser->H, &parser->structCompiler->strooct->staticMethods,
+        AS_STRING(function->constants.values[constant]),
+        closure != NULL ? NEW_OBJ(closure) : NEW_NIL);
+  }
   emitBytes(parser, isStatic ? BC_STATIC_METHOD : BC_METHOD, constant);
 }
 
@@ -859,15 +1365,21 @@ static void functionDeclaration(struct Parser* parser, bool isGlobal) {
   if (parser->compiler->scopeDepth > 0) {
     error(parser, "Can only define functions in top level code.");
   }
-  u8 global = parseVariable(parser, isGlobal, "Expected function name.");
+  u16 global = parseVariable(parser, isGlobal, "Expected function name.");
   markInitialized(parser, isGlobal);
   function(parser, FUNCTION_TYPE_FUNCTION, false);
+
+  struct Closure* closure = sharedClosure(parser);
+  if (closure != NULL) {
+    tableSet(parser->H, &parser->functions,
+        closure->function->name, NEW_OBJ(closure));
+  }
   defineVariable(parser, global, isGlobal);
 }
 
 static void arrayDestructAssignment(struct Parser* parser) {
   u8 setters[UINT8_MAX];
-  u8 variables[UINT8_MAX];
+  s32 variables[UINT8_MAX];
   u8 variableCount = 0;
   do {
     if (variableCount == UINT8_MAX) {
@@ -886,7 +1398,7 @@ static void arrayDestructAssignment(struct Parser* parser) {
     } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
       setter = BC_SET_UPVALUE;
     } else {
-      arg = identifierConstant(parser, &name);
+      arg = globalVariable(parser, &name);
       setter = BC_SET_GLOBAL;
     }
 
@@ -902,7 +1414,7 @@ static void arrayDestructAssignment(struct Parser* parser) {
 
   for (u8 i = 0; i < variableCount; i++) {
     emitBytes(parser, BC_DESTRUCT_ARRAY, i);
-    emitBytes(parser, setters[i], variables[i]);
+    emitVariable(parser, setters[i], variables[i]);
     emitByte(parser, BC_POP);
   }
 
@@ -912,7 +1424,7 @@ static void arrayDestructAssignment(struct Parser* parser) {
 
 static void varDeclaration(struct Parser* parser, bool isGlobal) {
   if (match(parser, TOKEN_LBRACKET)) {
-    u8 variables[UINT8_MAX];
+    u16 variables[UINT8_MAX];
     struct Token tokens[UINT8_MAX];
     u8 variableCount = 0;
     // parse [x, y]
@@ -923,8 +1435,7 @@ static void varDeclaration(struct Parser* parser, bool isGlobal) {
       }
 
       struct Token identifier = parser->current;
-      u8 nameConstant = parseVariable(parser, isGlobal, "Expected identifier.");
-      variables[variableCount] = nameConstant;
+      variables[variableCount] = parseVariable(parser, isGlobal, "Expected identifier.");
       tokens[variableCount] = identifier;
       variableCount++;
 
@@ -947,12 +1458,13 @@ static void varDeclaration(struct Parser* parser, bool isGlobal) {
         u8 local = resolveLocal(parser, parser->compiler, &tokens[i]);
         emitBytes(parser, BC_SET_LOCAL, local);
         emitByte(parser, BC_POP);
+        parser->compiler->locals[local].isDefined = true;
       }
     }
 
     emitByte(parser, BC_POP);
   } else {
-    u8 global = parseVariable(parser, isGlobal, "Expected identifier.");
+    u16 global = parseVariable(parser, isGlobal, "Expected identifier.");
 
     if (match(parser, TOKEN_EQUAL)) {
       expression(parser);
@@ -977,15 +1489,26 @@ static void structDeclaration(struct Parser* parser, bool isGlobal) {
 
   struct StructCompiler structCompiler;
   structCompiler.enclosing = parser->structCompiler;
+  structCompiler.fieldCount = 0;
   parser->structCompiler = &structCompiler;
 
   consume(parser, TOKEN_IDENTIFIER, "Expected struct identifier.");
   struct Token structName = parser->previous;
   u8 nameConstant = identifierConstant(parser, &parser->previous);
+  u16 global = isGlobal ? globalVariable(parser, &structName) : 0;
   declareVariable(parser, isGlobal);
 
   emitBytes(parser, BC_STRUCT, nameConstant);
-  defineVariable(parser, nameConstant, isGlobal);
+  defineVariable(parser, global, isGlobal);
+
+  // The compiler's copy, which only gets the static methods.
+  struct Function* function = currentFunction(parser);
+  structCompiler.strooct = newStruct(
+      parser->H, AS_STRING(function->constants.values[nameConstant]));
+  push(parser->H, NEW_OBJ(structCompiler.strooct));
+  tableSet(parser->H, &parser->structs,
+      structCompiler.strooct->name, NEW_OBJ(structCompiler.strooct));
+  pop(parser->H);
 
   namedVariable(parser, structName, false);
 
@@ -1005,6 +1528,7 @@ static void structDeclaration(struct Parser* parser, bool isGlobal) {
       }
 
       emitBytes(parser, BC_STRUCT_FIELD, identifierConstant(parser, &name));
+      addField(&structCompiler, name);
 
       consume(parser, TOKEN_SEMICOLON, "Expected ';' after field.");
     } else if (match(parser, TOKEN_FUNC)) {
@@ -1035,15 +1559,23 @@ void enumDeclaration(struct Parser* parser, bool isGlobal) {
   consume(parser, TOKEN_IDENTIFIER, "Expected enum identifier.");
   struct Token enumName = parser->previous;
   u8 nameConstant = identifierConstant(parser, &parser->previous);
+  u16 global = isGlobal ? globalVariable(parser, &enumName) : 0;
   declareVariable(parser, isGlobal);
 
   emitBytes(parser, BC_ENUM, nameConstant);
-  defineVariable(parser, nameConstant, isGlobal);
+  defineVariable(parser, global, isGlobal);
 
   namedVariable(parser, enumName, false);
 
   consume(parser, TOKEN_LBRACE, "Expected '{'.");
 
+  // The compiler's copy, filled in alongside the runtime one.
+  struct Function* function = currentFunction(parser);
+  struct Enum* enoom = newEnum(parser->H, AS_STRING(function->constants.values[nameConstant]));
+  push(parser->H, NEW_OBJ(enoom));
+  tableSet(parser->H, &parser->enums, enoom->name, NEW_OBJ(enoom));
+  pop(parser->H);
+
   u8 enumValue = 0;
   if (!check(parser, TOKEN_RBRACE)) {
     do {
@@ -1052,8 +1584,11 @@ void enumDeclaration(struct Parser* parser, bool isGlobal) {
       }
 
       consume(parser, TOKEN_IDENTIFIER, "Expected enum value.");
+      u8 valueName = identifierConstant(parser, &parser->previous);
+      tableSet(parser->H, &enoom->values,
+          AS_STRING(function->constants.values[valueName]), NEW_INT(enumValue));
       emitByte(parser, BC_ENUM_VALUE);
-      emitByte(parser, identifierConstant(parser, &parser->previous));
+      emitByte(parser, valueName);
       emitByte(parser, enumValue++);
 
       if (!match(parser, TOKEN_COMMA) && !check(parser, TOKEN_RBRACE)) {
@@ -1108,6 +1643,128 @@ static void ifStatement(struct Parser* parser) {
   patchJump(parser, elseJump);
 }
 
+// The value of a case label, if it's an integer the compiler knows: a
+// number literal, possibly negated, or the value of a known enum.
+static bool constantLabel(
+    struct Parser* parser, struct Token* tokens, s32 count, s32* value) {
+  if (count == 3
+      && tokens[0].type == TOKEN_IDENTIFIER
+      && tokens[1].type == TOKEN_COLON
+      && tokens[2].type == TOKEN_IDENTIFIER) {
+    struct Enum* enoom = resolveEnum(parser, &tokens[0]);
+    Value ordinal;
+    if (enoom == NULL || !tableGet(&enoom->values,
+        copyString(parser->H, tokens[2].start, tokens[2].length), &ordinal)) {
+      return false;
+    }
+    *value = AS_INT(ordinal);
+    return true;
+  }
+
+  bool negate = count == 2 && tokens[0].type == TOKEN_MINUS;
+  if (count != (negate ? 2 : 1) || tokens[count - 1].type != TOKEN_NUMBER) {
+    return false;
+  }
+  f64 number = strtod(tokens[count - 1].start, NULL);
+  if (negate) {
+    number = -number;
+  }
+  if (number < INT16_MIN || number > INT16_MAX || number != (s32)number) {
+    return false;
+  }
+  *value = (s32)number;
+  return true;
+}
+
+// Reads ahead over the cases of a match statement, without compiling
+// anything, and returns how many of the first ones have constant labels.
+// Their values go in labels. An else at the level of the cases ends the
+// scan early, it could belong to an if in a case body.
+static s32 constantLabels(struct Parser* parser, s32* labels) {
+  struct Tokenizer tokenizer = *parser->tokenizer;
+  struct Token token = parser->current;
+  s32 count = 0;
+
+  while (token.type == TOKEN_CASE && count < UINT8_MAX) {
+    struct Token label[3];
+    s32 length = 0;
+    token = nextToken(&tokenizer);
+    while (token.type != TOKEN_RIGHT_ARROW && token.type != TOKEN_EOF && length < 3) {
+      label[length++] = token;
+      token = nextToken(&tokenizer);
+    }
+    if (token.type != TOKEN_RIGHT_ARROW
+        || !constantLabel(parser, label, length, &labels[count])) {
+      break;
+    }
+    count++;
+
+    s32 depth = 0;
+    do {
+      token = nextToken(&tokenizer);
+      switch (token.type) {
+        case TOKEN_LPAREN:
+        case TOKEN_LBRACE:
+        case TOKEN_LBRACKET:
+          depth++;
+          break;
+        case TOKEN_RPAREN:
+        case TOKEN_RBRACE:
+        case TOKEN_RBRACKET:
+          depth--;
+          break;
+        default:
+          break;
+      }
+    } while (token.type != TOKEN_EOF && depth >= 0
+        && (depth > 0 || (token.type != TOKEN_CASE && token.type != TOKEN_ELSE)));
+  }
+
+  return count;
+}
+
+static s32 emitSwitch(struct Parser* parser, s32 low, s32 size) {
+  emitByte(parser, BC_SWITCH);
+  emitShort(parser, (u16)(s16)low);
+  emitByte(parser, (u8)size);
+  s32 table = currentFunction(parser)->bcCount;
+  for (s32 entry = 0; entry <= size; entry++) {
+    emitShort(parser, 0xffff);
+  }
+  return table;
+}
+
+// Points an entry of a BC_SWITCH table at the current offset. Entries
+// start out unpatched, and only the first case for a label gets it.
+static void patchSwitch(struct Parser* parser, s32 table, s32 entry) {
+  struct Function* function = currentFunction(parser);
+  if (function->bc[table + entry * 2] != 0xff
+      || function->bc[table + entry * 2 + 1] != 0xff) {
+    return;
+  }
+
+  s32 jump = function->bcCount - (table + entry * 2 + 2);
+  if (jump >= UINT16_MAX) {
+    error(parser, "Too much code to jump over. Why?");
+  }
+
+  function->bc[table + entry * 2] = (jump >> 8) & 0xff;
+  function->bc[table + entry * 2 + 1] = jump & 0xff;
+  parser->compiler->lastJumpTarget = function->bcCount;
+}
+
+// Labels in the table's range without a case of their own go where any
+// other value does.
+static void patchSwitchDefault(struct Parser* parser, s32 table, s32 size) {
+  for (s32 entry = 0; entry <= size; entry++) {
+    patchSwitch(parser, table, entry);
+  }
+}
+
+// Compiles each case to a test of the subject against its label, in
+// order. When the first cases all have constant labels that fit in a
+// small table, BC_SWITCH jumps straight to the right one of those, and
+// only the rest are tested one by one.
 void matchStatement(struct Parser* parser) {
   consume(parser, TOKEN_LPAREN, "Expected '('.");
   expression(parser);
@@ -1118,8 +1775,39 @@ void matchStatement(struct Parser* parser) {
 
   consume(parser, TOKEN_LBRACE, "Expected '{'");
 
+  s32 labels[UINT8_MAX];
+  s32 labelCount = constantLabels(parser, labels);
+  s32 low = INT16_MAX;
+  s32 high = INT16_MIN;
+  for (s32 i = 0; i < labelCount; i++) {
+    low = labels[i] < low ? labels[i] : low;
+    high = labels[i] > high ? labels[i] : high;
+  }
+
+  // Worth it from two labels on, as long as most of the table is used.
+  s32 size = high - low + 1;
+  if (labelCount < 2 || size > UINT8_MAX || size > labelCount * 4) {
+    labelCount = 0;
+  }
+  s32 table = labelCount > 0 ? emitSwitch(parser, low, size) : -1;
+
   if (match(parser, TOKEN_CASE)) {
     do {
+      if (caseCount < labelCount) {
+        // Read ahead already.
+        while (!check(parser, TOKEN_RIGHT_ARROW) && !check(parser, TOKEN_EOF)) {
+          advance(parser);
+        }
+        patchSwitch(parser, table, labels[caseCount] - low);
+        consume(parser, TOKEN_RIGHT_ARROW, "Expected '=>' after case expression.");
+        statement(parser);
+        caseEnds[caseCount++] = emitJump(parser, BC_JUMP);
+        continue;
+      }
+
+      if (table != -1) {
+        patchSwitchDefault(parser, table, size);
+      }
       expression(parser);
 
       s32 inequalityJump = emitJump(parser, BC_INEQUALITY_JUMP);
@@ -1137,6 +1825,10 @@ void matchStatement(struct Parser* parser) {
     } while (match(parser, TOKEN_CASE));
   }
 
+  if (table != -1) {
+    patchSwitchDefault(parser, table, size);
+  }
+
   if (match(parser, TOKEN_ELSE)) {
     consume(parser, TOKEN_RIGHT_ARROW, "Expected '=>' after 'else'.");
     statement(parser);
@@ -1232,6 +1924,102 @@ static void whileStatement(struct Parser* parser) {
   endLoop(parser, &loop);
 }
 
+// The part of a for loop from its label on. loopOp starts each iteration
+// and leaves the loop, enterBody is a jump over it into the first one.
+//
+// The loop's own locals stay hidden. Each iteration copies the one in
+// variable into a fresh local of its own, so closures made in different
+// iterations never share it and assigning it doesn't upset the loop.
+static void forLoopBody(
+    struct Parser* parser, u8 loopOp, u8 slot, s32 enterBody,
+    struct Token name, u8 variable) {
+  struct Loop loop;
+  beginLoop(parser, &loop);
+  if (match(parser, TOKEN_COLON)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expected loop label.");
+    loop.isNamed = true;
+    loop.name = parser->previous;
+  }
+
+  s32 loopExit = emitSlotJump(parser, loopOp, slot);
+  if (enterBody != -1) {
+    patchJump(parser, enterBody);
+  }
+
+  loop.bodyStart = currentFunction(parser)->bcCount;
+  beginScope(parser);
+  emitBytes(parser, BC_GET_LOCAL, variable);
+  addLocal(parser, name);
+  defineVariable(parser, 0, false);
+  statement(parser);
+  endScope(parser);
+  emitLoop(parser, loop.start);
+
+  patchJump(parser, loopExit);
+  endLoop(parser, &loop);
+}
+
+// Each form of for loop keeps its state in three consecutive locals, with
+// names no identifier can match.
+static u8 addForLocals(struct Parser* parser, struct Token name) {
+  struct Token hidden = name;
+  hidden.length = 0;
+  for (s32 i = 0; i < 3; i++) {
+    addLocal(parser, hidden);
+    defineVariable(parser, 0, false);
+  }
+  return (u8)(parser->compiler->localCount - 3);
+}
+
+// for (i in start..limit[, step]) counts i from start up to and including
+// limit, or down to it for a negative step. BC_FOR_LOOP steps and tests
+// the counter, limit and step in one go.
+//
+// for (x in collection) goes through the elements of an array or the
+// characters of a string. BC_FOR_IN_LOOP keeps the collection and the
+// index next to x, and reads the element straight out of the collection.
+static void forStatement(struct Parser* parser) {
+  beginScope(parser);
+
+  consume(parser, TOKEN_LPAREN, "Expected '(' after 'for'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expected loop variable name.");
+  struct Token name = parser->previous;
+  consume(parser, TOKEN_IDENTIFIER, "Expected 'in' after loop variable.");
+  if (parser->previous.length != 2 || memcmp(parser->previous.start, "in", 2) != 0) {
+    error(parser, "Expected 'in' after loop variable.");
+  }
+
+  // '..' binds like '+', so a range start or a collection can't contain a
+  // bare sum.
+  parsePrecedence(parser, PREC_FACTOR);
+  if (!match(parser, TOKEN_DOT_DOT)) {
+    consume(parser, TOKEN_RPAREN, "Expected ')' after collection.");
+    emitConstant(parser, NEW_INT(-1));
+    emitByte(parser, BC_NIL);
+    u8 collection = addForLocals(parser, name);
+
+    emitBytes(parser, BC_FOR_IN_PREP, collection);
+    forLoopBody(parser, BC_FOR_IN_LOOP, collection, -1, name, collection + 2);
+    endScope(parser);
+    return;
+  }
+
+  expression(parser);
+  if (match(parser, TOKEN_COMMA)) {
+    expression(parser);
+  } else {
+    emitConstant(parser, NEW_INT(1));
+  }
+  consume(parser, TOKEN_RPAREN, "Expected ')' after range.");
+  u8 counter = addForLocals(parser, name);
+
+  s32 prepExit = emitSlotJump(parser, BC_FOR_PREP, counter);
+  forLoopBody(parser, BC_FOR_LOOP, counter, emitJump(parser, BC_JUMP), name, counter);
+  patchJump(parser, prepExit);
+
+  endScope(parser);
+}
+
 static void loopStatement(struct Parser* parser) {
   struct Loop loop;
   beginLoop(parser, &loop);
@@ -1255,7 +2043,7 @@ static void returnStatement(struct Parser* parser) {
 
   expression(parser);
   consume(parser, TOKEN_SEMICOLON, "Expected ';' after return value.");
-  emitByte(parser, BC_RETURN);
+  emitValueReturn(parser);
 }
 
 static void synchronize(struct Parser* parser) {
@@ -1315,6 +2103,8 @@ static void statement(struct Parser* parser) {
     matchStatement(parser);
   } else if (match(parser, TOKEN_WHILE)) {
     whileStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
   } else if (match(parser, TOKEN_LOOP)) {
     loopStatement(parser);
   } else if (match(parser, TOKEN_LBRACE)) {
@@ -1341,6 +2131,9 @@ struct Function* compile(struct State* H, struct Parser* parser, const char* sou
   parser->tokenizer = NULL;
   parser->hadError = false;
   parser->panicMode = false;
+  initTable(&parser->enums);
+  initTable(&parser->structs);
+  initTable(&parser->functions);
 
   struct Tokenizer tokenizer;
   initTokenizer(H, &tokenizer, source);
@@ -1356,6 +2149,9 @@ struct Function* compile(struct State* H, struct Parser* parser, const char* sou
   }
 
   struct Function* function = endCompiler(parser);
+  freeTable(H, &parser->enums);
+  freeTable(H, &parser->structs);
+  freeTable(H, &parser->functions);
   return parser->hadError ? NULL : function;
 }
 
@@ -1364,9 +2160,19 @@ void markCompilerRoots(struct State* H, struct Parser* parser) {
     return;
   }
 
+  if (parser->compiler != NULL) {
+    markTable(H, &parser->enums);
+    markTable(H, &parser->structs);
+    markTable(H, &parser->functions);
+  }
+
   struct Compiler* compiler = parser->compiler;
   while (compiler != NULL) {
     markObject(H, (struct Obj*)compiler->function);
+    markValue(H, compiler->known);
+    for (s32 i = 0; i < compiler->inlineSiteCount; i++) {
+      markObject(H, (struct Obj*)compiler->inlineSites[i].callee);
+    }
     compiler = compiler->enclosing;
   }
 }
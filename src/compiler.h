@@ -3,6 +3,7 @@
 
 #include "tokenizer.h"
 #include "object.h"
+#include "ir.h"
 
 struct Loop {
   s32 start;
@@ -19,6 +20,17 @@ struct Local {
   struct Token name;
   s32 depth;
   bool isCaptured;
+  // Whether closures must share the variable through an Upvalue box: it
+  // is assigned after its declaration, or captured before it has a value.
+  bool isShared;
+  bool isDefined;
+};
+
+// Where a closure captures one of this function's locals, so the capture
+// can be turned into a copy once the local's scope ends unassigned.
+struct CaptureSite {
+  u8 local;
+  s32 offset;
 };
 
 struct CompilerUpvalue {
@@ -44,6 +56,26 @@ struct Compiler {
   s32 localCount;
   struct CompilerUpvalue upvalues[U8_COUNT];
   s32 scopeDepth;
+  // Offset of the latest BC_CALL, BC_CALL_STATIC or BC_INVOKE, to spot
+  // tail calls.
+  s32 lastCall;
+  // Offset of the latest BC_GET_STATIC on a top-level struct, to spot
+  // calls on it.
+  s32 lastStatic;
+  s32 lastJumpTarget; // Where the latest forward jump lands.
+  // Offset of the latest literal, to fold operations on literals, and
+  // whether its value was new to the constant pool.
+  s32 lastLiteral;
+  bool lastLiteralAdded;
+  struct CaptureSite captures[U8_COUNT];
+  s32 captureCount;
+  // The top-level function or struct the code so far ends in a read of,
+  // and where that read ends, or -1. Also whether it was read as a global.
+  Value known;
+  s32 knownEnd;
+  bool knownIsGlobal;
+  struct InlineSite inlineSites[U8_COUNT];
+  s32 inlineSiteCount;
 };
 
 struct StructField {
@@ -52,6 +84,10 @@ struct StructField {
 
 struct StructCompiler {
   struct StructCompiler* enclosing;
+  struct Struct* strooct; // The compiler's copy, for its static methods.
+  // Field names in slot order, for compiling self.field to a slot access.
+  struct Token fields[U8_COUNT];
+  s32 fieldCount;
 };
 
 struct Parser {
@@ -61,6 +97,13 @@ struct Parser {
   struct Compiler* compiler;
   struct StructCompiler* structCompiler;
   struct Tokenizer* tokenizer;
+  // Enums declared in top-level code so far, by name. The compiler builds
+  // its own copy of each, so their values are known at compile time.
+  struct Table enums;
+  // Likewise for structs, with their static methods, and for top-level
+  // functions that are always the same closure.
+  struct Table structs;
+  struct Table functions;
   bool hadError;
   bool panicMode;
 };
@@ -31,6 +31,35 @@ static int jumpInstruction(const char* name, s32 sign, struct Function* function
   return offset + 3;
 }
 
+static s32 forInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 slot = function->bc[offset + 1];
+  u16 jump = (u16)((function->bc[offset + 2] << 8) | function->bc[offset + 3]);
+  printf("%-16s %4d %4d -> %4d\n", name, slot, offset, offset + 4 + jump);
+  return offset + 4;
+}
+
+static s32 switchInstruction(const char* name, struct Function* function, s32 offset) {
+  s16 low = (s16)((function->bc[offset + 1] << 8) | function->bc[offset + 2]);
+  s32 count = function->bc[offset + 3];
+  printf("%-16s %4d\n", name, offset);
+  for (s32 entry = 0; entry <= count; entry++) {
+    s32 operand = offset + 4 + entry * 2;
+    u16 jump = (u16)((function->bc[operand] << 8) | function->bc[operand + 1]);
+    if (entry == count) {
+      printf("%16s else -> %4d\n", "", operand + 2 + jump);
+    } else {
+      printf("%16s %4d -> %4d\n", "", low + entry, operand + 2 + jump);
+    }
+  }
+  return offset + 4 + (count + 1) * 2;
+}
+
+static s32 globalInstruction(const char* name, struct Function* function, s32 offset) {
+  u16 slot = (u16)((function->bc[offset + 1] << 8) | function->bc[offset + 2]);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
 static s32 constantInstruction(const char* name, struct Function* function, s32 offset) {
   u8 constant = function->bc[offset + 1];
   printf("%-16s %4d '", name, constant);
@@ -39,21 +68,77 @@ static s32 constantInstruction(const char* name, struct Function* function, s32
   return offset + 2;
 }
 
+static u16 readCache(struct Function* function, s32 offset) {
+  return (u16)((function->bc[offset] << 8) | function->bc[offset + 1]);
+}
+
+static s32 propertyInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 constant = function->bc[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(function->constants.values[constant]);
+  printf("' cache %d\n", readCache(function, offset + 2));
+  return offset + 4;
+}
+
 static s32 invokeInstruction(const char* name, struct Function* function, s32 offset) {
   u8 constant = function->bc[offset + 1];
   u8 argCount = function->bc[offset + 2];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(function->constants.values[constant]);
+  printf("' cache %d\n", readCache(function, offset + 3));
+  return offset + 5;
+}
+
+static s32 localsInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 a = function->bc[offset + 1];
+  u8 b = function->bc[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static s32 localConstantInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 slot = function->bc[offset + 1];
+  u8 constant = function->bc[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(function->constants.values[constant]);
   printf("'\n");
   return offset + 3;
 }
 
+static s32 registersInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 dest = function->bc[offset + 1];
+  u8 a = function->bc[offset + 2];
+  u8 b = function->bc[offset + 3];
+  printf("%-16s %4d %4d %4d\n", name, dest, a, b);
+  return offset + 4;
+}
+
+static s32 registerConstantInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 dest = function->bc[offset + 1];
+  u8 slot = function->bc[offset + 2];
+  u8 constant = function->bc[offset + 3];
+  printf("%-16s %4d %4d %4d '", name, dest, slot, constant);
+  printValue(function->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static s32 registerJumpInstruction(const char* name, struct Function* function, s32 offset) {
+  u8 a = function->bc[offset + 1];
+  u8 b = function->bc[offset + 2];
+  u16 jump = (u16)(function->bc[offset + 3] << 8);
+  jump |= function->bc[offset + 4];
+  printf("%-16s %4d %4d %4d -> %4d\n", name, a, b, offset, offset + 5 + jump);
+  return offset + 5;
+}
+
 s32 disassembleInstruction(struct Function* function, s32 offset) {
   printf("%04d ", offset);
-  if (offset > 0 && function->lines[offset] == function->lines[offset - 1]) {
+  s32 line = outermostLine(function, function->lines[offset]);
+  if (offset > 0 && line == outermostLine(function, function->lines[offset - 1])) {
     printf("   | ");
   } else {
-    printf("%4d ", function->lines[offset]);
+    printf("%4d ", line);
   }
 
   u8 instruction = function->bc[offset];
@@ -75,11 +160,11 @@ s32 disassembleInstruction(struct Function* function, s32 offset) {
     case BC_SET_SUBSCRIPT:
       return simpleInstruction("OP_SET_SUBSCRIPT", offset);
     case BC_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", function, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", function, offset);
     case BC_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", function, offset);
+      return globalInstruction("OP_GET_GLOBAL", function, offset);
     case BC_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", function, offset);
+      return globalInstruction("OP_SET_GLOBAL", function, offset);
     case BC_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", function, offset);
     case BC_SET_UPVALUE:
@@ -93,15 +178,19 @@ s32 disassembleInstruction(struct Function* function, s32 offset) {
     case BC_GET_STATIC:
       return constantInstruction("OP_GET_STATIC_METHOD", function, offset);
     case BC_PUSH_PROPERTY:
-      return constantInstruction("OP_PUSH_PROPERTY", function, offset);
+      return propertyInstruction("OP_PUSH_PROPERTY", function, offset);
     case BC_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", function, offset);
+      return propertyInstruction("OP_GET_PROPERTY", function, offset);
     case BC_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", function, offset);
+      return propertyInstruction("OP_SET_PROPERTY", function, offset);
+    case BC_GET_SELF_FIELD:
+      return byteInstruction("OP_GET_SELF_FIELD", function, offset);
+    case BC_SET_SELF_FIELD:
+      return byteInstruction("OP_SET_SELF_FIELD", function, offset);
     case BC_DESTRUCT_ARRAY:
       return byteInstruction("OP_DESTRUCT_ARRAY", function, offset);
     case BC_STRUCT_FIELD:
-      return simpleInstruction("OP_SET_STRUCT_FIELD", offset);
+      return constantInstruction("OP_SET_STRUCT_FIELD", function, offset);
     case BC_EQUAL:
       return simpleInstruction("OP_EQUAL", offset);
     case BC_NOT_EQUAL:
@@ -136,10 +225,22 @@ s32 disassembleInstruction(struct Function* function, s32 offset) {
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, function, offset);
     case BC_INEQUALITY_JUMP:
       return jumpInstruction("OP_INEQUALITY_JUMP", 1, function, offset);
+    case BC_SWITCH:
+      return switchInstruction("OP_SWITCH", function, offset);
     case BC_LOOP:
       return jumpInstruction("OP_LOOP", -1, function, offset);
+    case BC_FOR_PREP:
+      return forInstruction("OP_FOR_PREP", function, offset);
+    case BC_FOR_LOOP:
+      return forInstruction("OP_FOR_LOOP", function, offset);
+    case BC_FOR_IN_PREP:
+      return byteInstruction("OP_FOR_IN_PREP", function, offset);
+    case BC_FOR_IN_LOOP:
+      return forInstruction("OP_FOR_IN_LOOP", function, offset);
     case BC_CALL:
       return byteInstruction("OP_CALL", function, offset);
+    case BC_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", function, offset);
     case BC_INSTANCE:
       return simpleInstruction("OP_INSTANCE", offset);
     case BC_CLOSURE: {
@@ -151,10 +252,11 @@ s32 disassembleInstruction(struct Function* function, s32 offset) {
       struct Function* inner = AS_FUNCTION(function->constants.values[constant]);
 
       for (int j = 0; j < inner->upvalueCount; j++) {
-        int isLocal = function->bc[offset++];
+        static const char* captures[] = {"upvalue", "local", "value"};
+        int capture = function->bc[offset++];
         int index = function->bc[offset++];
         printf("%04d      |                     %s %d\n",
-            offset - 2, isLocal ? "local" : "upvalue", index);
+            offset - 2, captures[capture], index);
       }
 
       return offset;
@@ -181,6 +283,114 @@ s32 disassembleInstruction(struct Function* function, s32 offset) {
       return constantInstruction("OP_STATIC_METHOD", function, offset);
     case BC_INVOKE:
       return invokeInstruction("OP_INVOKE", function, offset);
+    case BC_TAIL_INVOKE:
+      return invokeInstruction("OP_TAIL_INVOKE", function, offset);
+    case BC_CALL_STATIC:
+      return invokeInstruction("OP_CALL_STATIC", function, offset);
+    case BC_TAIL_CALL_STATIC:
+      return invokeInstruction("OP_TAIL_CALL_STATIC", function, offset);
+    case BC_JUMP_IF_NOT_CALLEE: {
+      u8 argCount = function->bc[offset + 1];
+      u8 constant = function->bc[offset + 2];
+      u16 jump = (u16)((function->bc[offset + 3] << 8) | function->bc[offset + 4]);
+      printf("%-16s (%d args) %4d '", "OP_JUMP_IF_NOT_CALLEE", argCount, constant);
+      printValue(function->constants.values[constant]);
+      printf("' %4d -> %4d\n", offset, offset + 5 + jump);
+      return offset + 5;
+    }
+    case BC_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, function, offset);
+    case BC_JUMP_IF_NOT_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, function, offset);
+    case BC_JUMP_IF_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_EQUAL", 1, function, offset);
+    case BC_JUMP_IF_NOT_GREATER:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, function, offset);
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, function, offset);
+    case BC_JUMP_IF_NOT_LESSER:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESSER", 1, function, offset);
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESSER_EQUAL", 1, function, offset);
+    case BC_ADD_LOCALS:
+      return localsInstruction("OP_ADD_LOCALS", function, offset);
+    case BC_SUBTRACT_LOCALS:
+      return localsInstruction("OP_SUBTRACT_LOCALS", function, offset);
+    case BC_ADD_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", function, offset);
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      return localConstantInstruction("OP_SUBTRACT_LOCAL_CONSTANT", function, offset);
+    case BC_INVOKE_LOCAL: {
+      u8 slot = function->bc[offset + 1];
+      u8 constant = function->bc[offset + 2];
+      u8 argCount = function->bc[offset + 3];
+      printf("%-16s (%d args) %4d %4d '", "OP_INVOKE_LOCAL", argCount, slot, constant);
+      printValue(function->constants.values[constant]);
+      printf("' cache %d\n", readCache(function, offset + 4));
+      return offset + 6;
+    }
+    case BC_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", function, offset);
+    case BC_MOVE:
+      return localsInstruction("OP_MOVE", function, offset);
+    case BC_LOAD_CONSTANT:
+      return localConstantInstruction("OP_LOAD_CONSTANT", function, offset);
+    case BC_ADD_RR:
+      return registersInstruction("OP_ADD_RR", function, offset);
+    case BC_SUBTRACT_RR:
+      return registersInstruction("OP_SUBTRACT_RR", function, offset);
+    case BC_MULTIPLY_RR:
+      return registersInstruction("OP_MULTIPLY_RR", function, offset);
+    case BC_DIVIDE_RR:
+      return registersInstruction("OP_DIVIDE_RR", function, offset);
+    case BC_ADD_RK:
+      return registerConstantInstruction("OP_ADD_RK", function, offset);
+    case BC_SUBTRACT_RK:
+      return registerConstantInstruction("OP_SUBTRACT_RK", function, offset);
+    case BC_MULTIPLY_RK:
+      return registerConstantInstruction("OP_MULTIPLY_RK", function, offset);
+    case BC_DIVIDE_RK:
+      return registerConstantInstruction("OP_DIVIDE_RK", function, offset);
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_RR", function, offset);
+    case BC_JUMP_IF_EQUAL_RR:
+      return registerJumpInstruction("OP_JUMP_IF_EQUAL_RR", function, offset);
+    case BC_JUMP_IF_NOT_GREATER_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_RR", function, offset);
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL_RR", function, offset);
+    case BC_JUMP_IF_NOT_LESSER_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_LESSER_RR", function, offset);
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_LESSER_EQUAL_RR", function, offset);
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_RK", function, offset);
+    case BC_JUMP_IF_EQUAL_RK:
+      return registerJumpInstruction("OP_JUMP_IF_EQUAL_RK", function, offset);
+    case BC_JUMP_IF_NOT_GREATER_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_RK", function, offset);
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL_RK", function, offset);
+    case BC_JUMP_IF_NOT_LESSER_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_LESSER_RK", function, offset);
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_LESSER_EQUAL_RK", function, offset);
+    case BC_EQUAL_NUM:
+      return simpleInstruction("OP_EQUAL_NUM", offset);
+    case BC_NOT_EQUAL_NUM:
+      return simpleInstruction("OP_NOT_EQUAL_NUM", offset);
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM", 1, function, offset);
+    case BC_JUMP_IF_EQUAL_NUM:
+      return jumpInstruction("OP_JUMP_IF_EQUAL_NUM", 1, function, offset);
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM_RR", function, offset);
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+      return registerJumpInstruction("OP_JUMP_IF_EQUAL_NUM_RR", function, offset);
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+      return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM_RK", function, offset);
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+      return registerJumpInstruction("OP_JUMP_IF_EQUAL_NUM_RK", function, offset);
     case BC_BREAK:
       return simpleInstruction("OP_BREAK", offset);
     default:
@@ -0,0 +1,1709 @@
+#include "ir.h"
+
+#include "memory.h"
+#include "opcodes.h"
+#include "optimizer.h"
+
+// Passes that look across a whole function, run over its finished
+// bytecode before the optimizer picks instructions.
+//
+// The bytecode is lifted into a list of instructions that each know the
+// stack depth they run at. Locals are stack slots, so inside a block any
+// value can be followed from the instruction making it to the ones using
+// it. Every value gets a number once and a slot is only ever a name for
+// one of them: SSA form, with nothing assumed about values coming into a
+// block.
+//
+// The passes only mark what should change. Lowering then writes the new
+// bytecode in one go, re-encoding jumps the way the optimizer does.
+
+#define MAX_HOISTS 8
+#define MAX_INLINE_LENGTH 32
+#define EXPR_WINDOW 64
+
+enum IrAction {
+  IR_KEEP,
+  IR_DROP,
+  IR_READ_SLOT,    // A GET_LOCAL of slot instead, numbered as in the lifted code.
+  IR_READ_HOISTED, // A GET_LOCAL of the slot a hoisted value sits in.
+};
+
+struct IrInstr {
+  s32 offset;
+  s32 depth;     // Stack depth before it runs, -1 when nothing reaches it.
+  bool isLeader; // Starts a block.
+  enum IrAction action;
+  s32 slot;
+  s32 hoist;     // The loop with hoisted values it belongs to, or -1.
+};
+
+// A loop with loads moved in front of it. The values stay in new slots
+// from base up until the loop is left, which moves every slot above up.
+struct IrHoist {
+  s32 start; // First instruction of the loop and of any code entering it.
+  s32 end;   // First instruction after it, where every way out lands.
+  s32 base;
+  s32 loads[MAX_HOISTS]; // The first of each load in the loop.
+  s32 loadCount;
+};
+
+struct SlotSet {
+  u64 bits[U8_COUNT / 64];
+};
+
+struct Ir {
+  struct State* H;
+  struct Function* function;
+  struct IrInstr* instrs;
+  s32 count;
+  s32* index; // Bytecode offset -> instruction, -1 inside one.
+  s32 maxDepth;
+  struct SlotSet captured; // Slots a closure takes, boxed or copied.
+
+  struct IrHoist* hoists;
+  s32 hoistCount;
+  s32 loopCount;
+};
+
+static bool hasSlot(struct SlotSet* set, s32 slot) {
+  return slot >= 0 && slot < U8_COUNT && ((set->bits[slot / 64] >> (slot % 64)) & 1);
+}
+
+static void addSlot(struct SlotSet* set, s32 slot) {
+  if (slot >= 0 && slot < U8_COUNT) {
+    set->bits[slot / 64] |= (u64)1 << (slot % 64);
+  }
+}
+
+static void removeSlot(struct SlotSet* set, s32 slot) {
+  if (slot >= 0 && slot < U8_COUNT) {
+    set->bits[slot / 64] &= ~((u64)1 << (slot % 64));
+  }
+}
+
+static void keepSlotsBelow(struct SlotSet* set, s32 limit) {
+  for (s32 slot = limit < 0 ? 0 : limit; slot < U8_COUNT; slot++) {
+    removeSlot(set, slot);
+  }
+}
+
+static void clearSlots(struct SlotSet* set) {
+  for (s32 i = 0; i < U8_COUNT / 64; i++) {
+    set->bits[i] = 0;
+  }
+}
+
+static void addSlots(struct SlotSet* set, struct SlotSet* other) {
+  for (s32 i = 0; i < U8_COUNT / 64; i++) {
+    set->bits[i] |= other->bits[i];
+  }
+}
+
+static bool sameSlots(struct SlotSet* a, struct SlotSet* b) {
+  for (s32 i = 0; i < U8_COUNT / 64; i++) {
+    if (a->bits[i] != b->bits[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static u8* codeAt(struct Ir* ir, s32 i) {
+  return &ir->function->bc[ir->instrs[i].offset];
+}
+
+// Fills targets with the instructions i can jump to and returns how many.
+static s32 jumpTargets(struct Ir* ir, s32 i, s32* targets) {
+  struct Function* function = ir->function;
+  s32 offset = ir->instrs[i].offset;
+  u8 op = function->bc[offset];
+  if (isJump(op)) {
+    targets[0] = ir->index[jumpTarget(function, offset)];
+    return 1;
+  }
+  if (op == BC_SWITCH) {
+    s32 count = switchEntryCount(function, offset);
+    for (s32 entry = 0; entry < count; entry++) {
+      targets[entry] = ir->index[switchTarget(function, offset, entry)];
+    }
+    return count;
+  }
+  return 0;
+}
+
+static bool endsBlock(u8 op) {
+  return isJump(op) || isUnconditional(op);
+}
+
+// Instructions whose first operand is a slot. The for loops use the two
+// slots after it as well.
+static bool hasSlotOperand(u8 op) {
+  switch (op) {
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+    case BC_FOR_PREP:
+    case BC_FOR_LOOP:
+    case BC_FOR_IN_PREP:
+    case BC_FOR_IN_LOOP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The global, upvalue or field a load or store is about.
+static s32 memoryOperand(u8* bc) {
+  switch (bc[0]) {
+    case BC_GET_GLOBAL:
+    case BC_SET_GLOBAL:
+    case BC_DEFINE_GLOBAL:
+      return (bc[1] << 8) | bc[2];
+    default:
+      return bc[1];
+  }
+}
+
+static bool isLoad(u8 op) {
+  return op == BC_GET_GLOBAL || op == BC_GET_UPVALUE || op == BC_GET_SELF_FIELD;
+}
+
+// The load reading back what a store writes, or BC_BREAK.
+static u8 loadFor(u8 op) {
+  switch (op) {
+    case BC_SET_GLOBAL:
+    case BC_DEFINE_GLOBAL:
+      return BC_GET_GLOBAL;
+    case BC_SET_UPVALUE:
+      return BC_GET_UPVALUE;
+    case BC_SET_SELF_FIELD:
+      return BC_GET_SELF_FIELD;
+    default:
+      return BC_BREAK;
+  }
+}
+
+// Whether an instruction leaves every global, upvalue and field as it is.
+// Calls can change any of them, and so can a store through some other
+// reference to self.
+static bool leavesMemory(u8 op) {
+  switch (op) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_POP:
+    case BC_ARRAY:
+    case BC_GET_SUBSCRIPT:
+    case BC_SET_SUBSCRIPT:
+    case BC_GET_GLOBAL:
+    case BC_GET_UPVALUE:
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+    case BC_GET_STATIC:
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+    case BC_GET_SELF_FIELD:
+    case BC_DESTRUCT_ARRAY:
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_CONCAT:
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+    case BC_NEGATE:
+    case BC_NOT:
+    case BC_JUMP:
+    case BC_JUMP_IF_FALSE:
+    case BC_INEQUALITY_JUMP:
+    case BC_SWITCH:
+    case BC_LOOP:
+    case BC_FOR_PREP:
+    case BC_FOR_LOOP:
+    case BC_FOR_IN_PREP:
+    case BC_FOR_IN_LOOP:
+    case BC_JUMP_IF_NOT_CALLEE:
+    case BC_INSTANCE:
+    case BC_CLOSURE:
+    case BC_CLOSE_UPVALUE:
+    case BC_RETURN:
+    case BC_ENUM_VALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Operations giving the same result whenever their operands are the same.
+static bool isPureBinary(u8 op) {
+  switch (op) {
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isCommutative(u8 op) {
+  return op == BC_ADD || op == BC_MULTIPLY || op == BC_EQUAL || op == BC_NOT_EQUAL;
+}
+
+// How many values off the top of the stack an instruction reads, at most.
+static s32 stackReads(struct Function* function, s32 offset) {
+  switch (function->bc[offset]) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_GET_GLOBAL:
+    case BC_GET_UPVALUE:
+    case BC_GET_LOCAL:
+    case BC_GET_SELF_FIELD:
+    case BC_CLOSURE:
+    case BC_ENUM:
+    case BC_STRUCT:
+    // These only throw the value away.
+    case BC_POP:
+    case BC_CLOSE_UPVALUE:
+      return 0;
+    case BC_JUMP_IF_NOT_CALLEE:
+      return function->bc[offset + 1] + 1;
+    default: {
+      s32 effect = stackEffect(function, offset);
+      return effect < 0 ? 1 - effect : 1;
+    }
+  }
+}
+
+static bool raiseDepth(struct Ir* ir, s32 i, s32 depth) {
+  if (depth <= ir->instrs[i].depth) {
+    return false;
+  }
+  ir->instrs[i].depth = depth;
+  return true;
+}
+
+static void computeDepths(struct Ir* ir) {
+  struct Function* function = ir->function;
+  s32 targets[U8_COUNT + 1];
+  ir->instrs[0].depth = function->arity + 1;
+  ir->maxDepth = function->arity + 2;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (s32 i = 0; i < ir->count; i++) {
+      s32 depth = ir->instrs[i].depth;
+      if (depth < 0) {
+        continue;
+      }
+
+      s32 after = depth + stackEffect(function, ir->instrs[i].offset);
+      if (after + 1 > ir->maxDepth) {
+        ir->maxDepth = after + 1;
+      }
+      if (depth + 1 > ir->maxDepth) {
+        ir->maxDepth = depth + 1;
+      }
+
+      s32 count = jumpTargets(ir, i, targets);
+      for (s32 t = 0; t < count; t++) {
+        changed |= raiseDepth(ir, targets[t], after);
+      }
+      if (!isUnconditional(codeAt(ir, i)[0]) && i + 1 < ir->count) {
+        changed |= raiseDepth(ir, i + 1, after);
+      }
+    }
+  }
+}
+
+static void liftFunction(struct Ir* ir) {
+  struct Function* function = ir->function;
+  s32 length = function->bcCount;
+
+  ir->count = 0;
+  for (s32 offset = 0; offset < length; offset += instructionLength(function, offset)) {
+    ir->count++;
+  }
+
+  ir->instrs = ALLOCATE(ir->H, struct IrInstr, ir->count);
+  ir->index = ALLOCATE(ir->H, s32, length + 1);
+  for (s32 offset = 0; offset <= length; offset++) {
+    ir->index[offset] = -1;
+  }
+
+  s32 i = 0;
+  for (s32 offset = 0; offset < length; offset += instructionLength(function, offset)) {
+    struct IrInstr* instr = &ir->instrs[i];
+    instr->offset = offset;
+    instr->depth = -1;
+    instr->isLeader = false;
+    instr->action = IR_KEEP;
+    instr->slot = 0;
+    instr->hoist = -1;
+    ir->index[offset] = i++;
+  }
+  ir->index[length] = ir->count;
+
+  computeDepths(ir);
+
+  s32 targets[U8_COUNT + 1];
+  clearSlots(&ir->captured);
+  ir->loopCount = 0;
+  ir->instrs[0].isLeader = true;
+  for (i = 0; i < ir->count; i++) {
+    u8* bc = codeAt(ir, i);
+    s32 count = jumpTargets(ir, i, targets);
+    for (s32 t = 0; t < count; t++) {
+      ir->instrs[targets[t]].isLeader = true;
+    }
+    if (endsBlock(bc[0]) && i + 1 < ir->count) {
+      ir->instrs[i + 1].isLeader = true;
+    }
+
+    if (bc[0] == BC_LOOP) {
+      ir->loopCount++;
+    } else if (bc[0] == BC_CLOSURE) {
+      struct Function* inner = AS_FUNCTION(function->constants.values[bc[1]]);
+      for (s32 k = 0; k < inner->upvalueCount; k++) {
+        if (bc[2 + k * 2] != CAPTURE_UPVALUE) {
+          addSlot(&ir->captured, bc[3 + k * 2]);
+        }
+      }
+    }
+  }
+}
+
+// Loop-invariant code motion --------------------------------------------
+
+// Grows the loop closed by the BC_LOOP at loop to take in every jump into
+// or out of it, so that it is entered at start and left to end. Fails if
+// the code doesn't nest that way.
+static bool findLoopRegion(struct Ir* ir, s32 loop, s32* start, s32* end) {
+  s32 targets[U8_COUNT + 1];
+  *start = ir->index[jumpTarget(ir->function, ir->instrs[loop].offset)];
+  *end = loop + 1;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (s32 i = 0; i < ir->count; i++) {
+      if (ir->instrs[i].depth < 0) {
+        continue;
+      }
+
+      bool inside = i >= *start && i < *end;
+      s32 count = jumpTargets(ir, i, targets);
+      for (s32 t = 0; t < count; t++) {
+        if (inside) {
+          if (targets[t] < *start) {
+            return false;
+          }
+          if (targets[t] > *end) {
+            *end = targets[t];
+            changed = true;
+          }
+        } else if (targets[t] > *start && targets[t] <= *end) {
+          if (i > *start) {
+            return false;
+          }
+          *start = i;
+          changed = true;
+        }
+      }
+    }
+
+    // A while loop leaves its condition on the stack when it is done, and
+    // pops it after the loop.
+    if (!changed && *end < ir->count
+        && ir->instrs[*end].depth > ir->instrs[*start].depth) {
+      (*end)++;
+      changed = true;
+    }
+  }
+
+  return *end < ir->count;
+}
+
+static bool isInvariant(struct Ir* ir, struct IrHoist* hoist, u8 load, s32 operand) {
+  for (s32 i = hoist->start; i < hoist->end; i++) {
+    if (ir->instrs[i].depth < 0) {
+      continue;
+    }
+
+    u8* bc = codeAt(ir, i);
+    u8 storeLoad = loadFor(bc[0]);
+    if (storeLoad == load && memoryOperand(bc) == operand) {
+      return false;
+    }
+    if (storeLoad == BC_BREAK && !leavesMemory(bc[0])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool isHoisted(struct Ir* ir, struct IrHoist* hoist, u8* bc) {
+  for (s32 k = 0; k < hoist->loadCount; k++) {
+    u8* load = codeAt(ir, hoist->loads[k]);
+    if (load[0] == bc[0] && memoryOperand(load) == memoryOperand(bc)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void addHoist(struct Ir* ir, struct IrHoist* hoist, s32 i) {
+  u8* bc = codeAt(ir, i);
+  if (hoist->loadCount < MAX_HOISTS
+      && !isHoisted(ir, hoist, bc)
+      && isInvariant(ir, hoist, bc[0], memoryOperand(bc))) {
+    hoist->loads[hoist->loadCount++] = i;
+  }
+}
+
+// Picks the loads worth moving in front of a loop. One that can fail may
+// only move if the loop runs it before anything else that can fail or
+// has an effect, so errors still come in the same order.
+static void findHoists(struct Ir* ir, struct IrHoist* hoist) {
+  hoist->loadCount = 0;
+  for (s32 i = hoist->start; i < hoist->end; i++) {
+    u8 op = codeAt(ir, i)[0];
+    if (op == BC_GET_SELF_FIELD || op == BC_GET_GLOBAL) {
+      s32 before = hoist->loadCount;
+      addHoist(ir, hoist, i);
+      if (hoist->loadCount == before && !isHoisted(ir, hoist, codeAt(ir, i))) {
+        break;
+      }
+    } else if (op != BC_CONSTANT && op != BC_NIL && op != BC_TRUE && op != BC_FALSE
+        && op != BC_GET_LOCAL && op != BC_GET_UPVALUE) {
+      break;
+    }
+  }
+
+  // Upvalue reads can't fail, so they move from anywhere in the loop.
+  for (s32 i = hoist->start; i < hoist->end; i++) {
+    if (ir->instrs[i].depth >= 0 && codeAt(ir, i)[0] == BC_GET_UPVALUE) {
+      addHoist(ir, hoist, i);
+    }
+  }
+}
+
+// Whether the slots in a loop can all move up by its hoisted values.
+static bool slotsFit(struct Ir* ir, struct IrHoist* hoist) {
+  if (hoist->base + hoist->loadCount > UINT8_MAX) {
+    return false;
+  }
+
+  for (s32 i = hoist->start; i < hoist->end; i++) {
+    u8* bc = codeAt(ir, i);
+    s32 highest = -1;
+    if (hasSlotOperand(bc[0])) {
+      highest = bc[1] + (bc[0] == BC_GET_LOCAL || bc[0] == BC_SET_LOCAL ? 0 : 2);
+    } else if (bc[0] == BC_CLOSURE) {
+      struct Function* inner = AS_FUNCTION(ir->function->constants.values[bc[1]]);
+      for (s32 k = 0; k < inner->upvalueCount; k++) {
+        if (bc[2 + k * 2] != CAPTURE_UPVALUE && bc[3 + k * 2] > highest) {
+          highest = bc[3 + k * 2];
+        }
+      }
+    }
+    if (highest >= hoist->base && highest + hoist->loadCount > UINT8_MAX) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool overlapsHoist(struct Ir* ir, s32 start, s32 end) {
+  for (s32 h = 0; h < ir->hoistCount; h++) {
+    if (start < ir->hoists[h].end && ir->hoists[h].start < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves loads of fields, globals and upvalues that a loop never changes
+// in front of it, into slots of their own. Inner loops come first, and a
+// loop around one that already hoisted is left alone.
+static void hoistInvariants(struct Ir* ir) {
+  ir->hoists = ALLOCATE(ir->H, struct IrHoist, ir->loopCount);
+  ir->hoistCount = 0;
+
+  for (s32 loop = 0; loop < ir->count; loop++) {
+    if (codeAt(ir, loop)[0] != BC_LOOP || ir->instrs[loop].depth < 0) {
+      continue;
+    }
+
+    struct IrHoist* hoist = &ir->hoists[ir->hoistCount];
+    if (!findLoopRegion(ir, loop, &hoist->start, &hoist->end)
+        || overlapsHoist(ir, hoist->start, hoist->end)) {
+      continue;
+    }
+
+    hoist->base = ir->instrs[hoist->start].depth;
+    if (hoist->base < 0 || ir->instrs[hoist->end].depth != hoist->base) {
+      continue;
+    }
+    bool nested = true;
+    for (s32 i = hoist->start; i < hoist->end; i++) {
+      s32 depth = ir->instrs[i].depth;
+      if (depth >= 0 && depth < hoist->base) {
+        nested = false;
+      }
+    }
+    if (!nested) {
+      continue;
+    }
+
+    findHoists(ir, hoist);
+    if (hoist->loadCount == 0 || !slotsFit(ir, hoist)) {
+      continue;
+    }
+
+    for (s32 i = hoist->start; i < hoist->end; i++) {
+      struct IrInstr* instr = &ir->instrs[i];
+      instr->hoist = ir->hoistCount;
+      u8* bc = codeAt(ir, i);
+      if (instr->depth < 0 || !isLoad(bc[0])) {
+        continue;
+      }
+      for (s32 k = 0; k < hoist->loadCount; k++) {
+        u8* load = codeAt(ir, hoist->loads[k]);
+        if (load[0] == bc[0] && memoryOperand(load) == memoryOperand(bc)) {
+          instr->action = IR_READ_HOISTED;
+          instr->slot = hoist->base + k;
+        }
+      }
+    }
+    ir->hoistCount++;
+  }
+}
+
+// Value numbering -------------------------------------------------------
+
+struct Expr {
+  u8 op;
+  s32 operand;
+  s32 left;
+  s32 right;
+  s32 value;
+};
+
+struct Numbering {
+  s32* values; // The value number in each slot.
+  s32* starts; // First instruction of the pure code that left each slot's value, or -1.
+  // The latest expressions seen in the block, oldest overwritten first.
+  struct Expr exprs[EXPR_WINDOW];
+  s32 nextExpr;
+  s32 nextValue;
+  s32 lastImpure; // The latest instruction that isn't part of a pure expression.
+};
+
+static void forgetExprs(struct Numbering* numbering) {
+  for (s32 i = 0; i < EXPR_WINDOW; i++) {
+    numbering->exprs[i].op = BC_BREAK;
+  }
+}
+
+static void forgetLoads(struct Numbering* numbering, u8 op, s32 operand) {
+  for (s32 i = 0; i < EXPR_WINDOW; i++) {
+    struct Expr* expr = &numbering->exprs[i];
+    if (isLoad(expr->op) && (op == BC_BREAK || (expr->op == op && expr->operand == operand))) {
+      expr->op = BC_BREAK;
+    }
+  }
+}
+
+static void addExpr(
+    struct Numbering* numbering, u8 op, s32 operand, s32 left, s32 right, s32 value) {
+  struct Expr* expr = &numbering->exprs[numbering->nextExpr];
+  numbering->nextExpr = (numbering->nextExpr + 1) % EXPR_WINDOW;
+  expr->op = op;
+  expr->operand = operand;
+  expr->left = left;
+  expr->right = right;
+  expr->value = value;
+}
+
+static s32 numberExpr(struct Numbering* numbering, u8 op, s32 operand, s32 left, s32 right) {
+  for (s32 i = 0; i < EXPR_WINDOW; i++) {
+    struct Expr* expr = &numbering->exprs[i];
+    if (expr->op == op && expr->operand == operand
+        && expr->left == left && expr->right == right) {
+      return expr->value;
+    }
+  }
+
+  s32 value = numbering->nextValue++;
+  addExpr(numbering, op, operand, left, right, value);
+  return value;
+}
+
+static void setSlot(struct Numbering* numbering, s32 slot, s32 value, s32 start) {
+  numbering->values[slot] = value;
+  numbering->starts[slot] = start;
+}
+
+// The lowest slot under limit that holds value, or -1.
+static s32 findSlot(struct Numbering* numbering, s32 value, s32 limit) {
+  for (s32 slot = 0; slot < limit && slot < U8_COUNT; slot++) {
+    if (numbering->values[slot] == value) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+// Replaces the pure code from start to i, which leaves value in slot base,
+// with a read of a lower slot holding the same value.
+static void reuseSlot(
+    struct Ir* ir, struct Numbering* numbering, s32 start, s32 i, s32 base, s32 value) {
+  if (start == -1 || start <= numbering->lastImpure) {
+    return;
+  }
+
+  s32 slot = findSlot(numbering, value, base);
+  if (slot == -1) {
+    return;
+  }
+
+  for (s32 j = start; j <= i; j++) {
+    ir->instrs[j].action = IR_DROP;
+  }
+  ir->instrs[start].action = IR_READ_SLOT;
+  ir->instrs[start].slot = slot;
+}
+
+static void numberInstruction(struct Ir* ir, struct Numbering* numbering, s32 i) {
+  struct IrInstr* instr = &ir->instrs[i];
+  u8* bc = codeAt(ir, i);
+  s32 depth = instr->depth;
+
+  if (instr->isLeader) {
+    for (s32 slot = 0; slot < depth; slot++) {
+      setSlot(numbering, slot, numbering->nextValue++, -1);
+    }
+    forgetExprs(numbering);
+    numbering->lastImpure = i - 1;
+  }
+
+  if (instr->action == IR_READ_HOISTED) {
+    setSlot(numbering, depth, numbering->nextValue++, -1);
+    numbering->lastImpure = i;
+    return;
+  }
+
+  switch (bc[0]) {
+    case BC_CONSTANT:
+      setSlot(numbering, depth, numberExpr(numbering, BC_CONSTANT, bc[1], -1, -1), i);
+      return;
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+      setSlot(numbering, depth, numberExpr(numbering, bc[0], 0, -1, -1), i);
+      return;
+    case BC_GET_LOCAL: {
+      // A copy reads the slot it was copied from.
+      s32 value = numbering->values[bc[1]];
+      s32 slot = findSlot(numbering, value, bc[1]);
+      if (slot != -1) {
+        instr->action = IR_READ_SLOT;
+        instr->slot = slot;
+      }
+      setSlot(numbering, depth, value, i);
+      return;
+    }
+    case BC_GET_GLOBAL:
+    case BC_GET_UPVALUE:
+    case BC_GET_SELF_FIELD: {
+      s32 value = numberExpr(numbering, bc[0], memoryOperand(bc), -1, -1);
+      reuseSlot(ir, numbering, i, i, depth, value);
+      setSlot(numbering, depth, value, i);
+      return;
+    }
+    case BC_SET_LOCAL:
+      setSlot(numbering, bc[1], numbering->values[depth - 1], -1);
+      numbering->lastImpure = i;
+      return;
+    case BC_SET_GLOBAL:
+    case BC_SET_UPVALUE:
+    case BC_SET_SELF_FIELD: {
+      // Reading it back gives what was stored.
+      u8 load = loadFor(bc[0]);
+      forgetLoads(numbering, load, memoryOperand(bc));
+      addExpr(numbering, load, memoryOperand(bc), -1, -1, numbering->values[depth - 1]);
+      numbering->lastImpure = i;
+      return;
+    }
+    case BC_POP:
+      numbering->lastImpure = i;
+      return;
+    case BC_NEGATE:
+    case BC_NOT: {
+      s32 base = depth - 1;
+      s32 value = numberExpr(numbering, bc[0], 0, numbering->values[base], -1);
+      s32 start = numbering->starts[base];
+      reuseSlot(ir, numbering, start, i, base, value);
+      setSlot(numbering, base, value, start);
+      return;
+    }
+    default:
+      break;
+  }
+
+  if (isPureBinary(bc[0])) {
+    s32 base = depth - 2;
+    s32 left = numbering->values[base];
+    s32 right = numbering->values[base + 1];
+    if (isCommutative(bc[0]) && right < left) {
+      left = right;
+      right = numbering->values[base];
+    }
+
+    s32 value = numberExpr(numbering, bc[0], 0, left, right);
+    s32 start = numbering->starts[base + 1] != -1 ? numbering->starts[base] : -1;
+    reuseSlot(ir, numbering, start, i, base, value);
+    setSlot(numbering, base, value, start);
+    return;
+  }
+
+  // Anything else leaves a value nothing is known about.
+  if (!leavesMemory(bc[0])) {
+    forgetLoads(numbering, BC_BREAK, 0);
+    for (s32 slot = 0; slot < depth; slot++) {
+      if (hasSlot(&ir->captured, slot)) {
+        setSlot(numbering, slot, numbering->nextValue++, -1);
+      }
+    }
+  }
+
+  s32 after = depth + stackEffect(ir->function, instr->offset);
+  for (s32 slot = after > 0 ? after - 1 : 0; slot < after; slot++) {
+    setSlot(numbering, slot, numbering->nextValue++, -1);
+  }
+  numbering->lastImpure = i;
+}
+
+// Common subexpression elimination and copy propagation. A value that is
+// worked out again while a slot still holds it is read from the slot.
+static void numberValues(struct Ir* ir) {
+  struct Numbering numbering;
+  numbering.values = ALLOCATE(ir->H, s32, ir->maxDepth);
+  numbering.starts = ALLOCATE(ir->H, s32, ir->maxDepth);
+  numbering.nextExpr = 0;
+  numbering.nextValue = 0;
+  numbering.lastImpure = -1;
+  forgetExprs(&numbering);
+
+  for (s32 i = 0; i < ir->count; i++) {
+    if (ir->instrs[i].depth >= 0) {
+      numberInstruction(ir, &numbering, i);
+    }
+  }
+
+  FREE_ARRAY(ir->H, s32, numbering.values, ir->maxDepth);
+  FREE_ARRAY(ir->H, s32, numbering.starts, ir->maxDepth);
+}
+
+// Dead stores ------------------------------------------------------------
+
+// The slots live before instruction i, given those live after it.
+static void liveBefore(struct Ir* ir, s32 i, struct SlotSet* after, struct SlotSet* before) {
+  struct IrInstr* instr = &ir->instrs[i];
+  *before = *after;
+
+  switch (instr->action) {
+    case IR_DROP:
+      return;
+    case IR_READ_SLOT:
+      keepSlotsBelow(before, instr->depth);
+      addSlot(before, instr->slot);
+      return;
+    case IR_READ_HOISTED:
+      keepSlotsBelow(before, instr->depth);
+      return;
+    case IR_KEEP:
+      break;
+  }
+
+  struct Function* function = ir->function;
+  u8* bc = codeAt(ir, i);
+  s32 depth = instr->depth;
+  s32 depthAfter = depth + stackEffect(function, instr->offset);
+
+  // Slots popped or pushed here hold some other value on the other side.
+  keepSlotsBelow(before, depthAfter < depth ? depthAfter : depth);
+  if (bc[0] == BC_SET_LOCAL) {
+    removeSlot(before, bc[1]);
+  }
+
+  s32 reads = stackReads(function, instr->offset);
+  for (s32 slot = depth - reads; slot < depth; slot++) {
+    addSlot(before, slot);
+  }
+  if (hasSlotOperand(bc[0])) {
+    addSlot(before, bc[1]);
+    if (bc[0] != BC_GET_LOCAL && bc[0] != BC_SET_LOCAL) {
+      addSlot(before, bc[1] + 1);
+      addSlot(before, bc[1] + 2);
+    }
+  } else if (bc[0] == BC_GET_SELF_FIELD || bc[0] == BC_SET_SELF_FIELD) {
+    addSlot(before, 0);
+  } else if (bc[0] == BC_CLOSURE) {
+    struct Function* inner = AS_FUNCTION(function->constants.values[bc[1]]);
+    for (s32 k = 0; k < inner->upvalueCount; k++) {
+      if (bc[2 + k * 2] != CAPTURE_UPVALUE) {
+        addSlot(before, bc[3 + k * 2]);
+      }
+    }
+  }
+}
+
+// Fills live with the slots live before each instruction.
+static void computeLiveness(struct Ir* ir, struct SlotSet* live) {
+  s32 targets[U8_COUNT + 1];
+  for (s32 i = 0; i < ir->count; i++) {
+    clearSlots(&live[i]);
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (s32 i = ir->count - 1; i >= 0; i--) {
+      if (ir->instrs[i].depth < 0) {
+        continue;
+      }
+
+      struct SlotSet after;
+      clearSlots(&after);
+      if (!isUnconditional(codeAt(ir, i)[0]) && i + 1 < ir->count) {
+        addSlots(&after, &live[i + 1]);
+      }
+      s32 count = jumpTargets(ir, i, targets);
+      for (s32 t = 0; t < count; t++) {
+        addSlots(&after, &live[targets[t]]);
+      }
+
+      struct SlotSet before;
+      liveBefore(ir, i, &after, &before);
+      if (!sameSlots(&before, &live[i])) {
+        live[i] = before;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Pushes that can't fail and have no effect.
+static bool isPlainPush(struct Ir* ir, s32 i) {
+  switch (ir->instrs[i].action) {
+    case IR_READ_SLOT:
+    case IR_READ_HOISTED:
+      return true;
+    case IR_DROP:
+      return false;
+    case IR_KEEP:
+      break;
+  }
+
+  switch (codeAt(ir, i)[0]) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_GET_LOCAL:
+    case BC_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Drops SET_LOCAL; POP where nothing reads the slot before it is written
+// again or goes away, along with the value when it was simply pushed.
+// Slots a closure takes are always kept.
+static void removeDeadStores(struct Ir* ir) {
+  struct SlotSet* live = ALLOCATE(ir->H, struct SlotSet, ir->count);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    computeLiveness(ir, live);
+
+    for (s32 i = 0; i + 1 < ir->count; i++) {
+      struct IrInstr* instr = &ir->instrs[i];
+      struct IrInstr* next = &ir->instrs[i + 1];
+      u8* bc = codeAt(ir, i);
+      if (instr->depth < 0 || instr->action != IR_KEEP || bc[0] != BC_SET_LOCAL
+          || next->isLeader || next->action != IR_KEEP || codeAt(ir, i + 1)[0] != BC_POP
+          || hasSlot(&ir->captured, bc[1]) || hasSlot(&live[i + 1], bc[1])) {
+        continue;
+      }
+
+      instr->action = IR_DROP;
+      if (!instr->isLeader && isPlainPush(ir, i - 1)) {
+        ir->instrs[i - 1].action = IR_DROP;
+        next->action = IR_DROP;
+      }
+      changed = true;
+    }
+  }
+
+  FREE_ARRAY(ir->H, struct SlotSet, live, ir->count);
+}
+
+// Lowering ---------------------------------------------------------------
+
+struct IrPatch {
+  s32 operand; // Where the jump's 16 bit operand ended up.
+  s32 from;    // The instruction it belongs to.
+  s32 to;      // The instruction it lands on.
+  bool backward;
+};
+
+struct Lowering {
+  u8* bc;
+  s32* lines;
+  s32 count;
+  s32 capacity;
+
+  s32* before;  // Where the code put in front of each instruction starts.
+  s32* offsets; // Where each instruction ended up.
+
+  struct IrPatch* patches;
+  s32 patchCount;
+  s32 patchCapacity;
+  bool failed;
+};
+
+static void emitByte(struct Lowering* out, u8 byte, s32 line) {
+  out->bc[out->count] = byte;
+  out->lines[out->count] = line;
+  out->count++;
+}
+
+static void emitSlot(struct Lowering* out, s32 slot, s32 line) {
+  if (slot > UINT8_MAX) {
+    out->failed = true;
+  }
+  emitByte(out, (u8)slot, line);
+}
+
+static void emitJumpOperand(
+    struct Lowering* out, s32 from, s32 to, bool backward, s32 line) {
+  struct IrPatch* patch = &out->patches[out->patchCount++];
+  patch->operand = out->count;
+  patch->from = from;
+  patch->to = to;
+  patch->backward = backward;
+
+  emitByte(out, 0xff, line);
+  emitByte(out, 0xff, line);
+}
+
+// Slots at or above a loop's hoisted values move up past them.
+static s32 shiftSlot(struct Ir* ir, struct IrInstr* instr, s32 slot) {
+  if (instr->hoist != -1 && slot >= ir->hoists[instr->hoist].base) {
+    return slot + ir->hoists[instr->hoist].loadCount;
+  }
+  return slot;
+}
+
+static void lowerInstruction(struct Ir* ir, struct Lowering* out, s32 i) {
+  struct IrInstr* instr = &ir->instrs[i];
+  struct Function* function = ir->function;
+  u8* bc = codeAt(ir, i);
+  s32 line = function->lines[instr->offset];
+
+  switch (instr->action) {
+    case IR_DROP:
+      return;
+    case IR_READ_SLOT:
+      emitByte(out, BC_GET_LOCAL, line);
+      emitSlot(out, shiftSlot(ir, instr, instr->slot), line);
+      return;
+    case IR_READ_HOISTED:
+      emitByte(out, BC_GET_LOCAL, line);
+      emitSlot(out, instr->slot, line);
+      return;
+    case IR_KEEP:
+      break;
+  }
+
+  if (bc[0] == BC_SWITCH) {
+    for (s32 k = 0; k < 4; k++) {
+      emitByte(out, bc[k], line);
+    }
+    for (s32 entry = 0; entry < switchEntryCount(function, instr->offset); entry++) {
+      emitJumpOperand(out, i,
+          ir->index[switchTarget(function, instr->offset, entry)], false, line);
+    }
+    return;
+  }
+
+  s32 length = instructionLength(function, instr->offset);
+  s32 copied = isJump(bc[0]) ? length - 2 : length;
+  for (s32 k = 0; k < copied; k++) {
+    if (k == 1 && hasSlotOperand(bc[0])) {
+      emitSlot(out, shiftSlot(ir, instr, bc[1]), line);
+    } else if (bc[0] == BC_CLOSURE && k >= 3 && k % 2 == 1 && bc[k - 1] != CAPTURE_UPVALUE) {
+      emitSlot(out, shiftSlot(ir, instr, bc[k]), line);
+    } else {
+      emitByte(out, bc[k], line);
+    }
+  }
+
+  if (isJump(bc[0])) {
+    emitJumpOperand(out, i, ir->index[jumpTarget(function, instr->offset)],
+        bc[0] == BC_LOOP, line);
+  }
+}
+
+// Where a jump lands. Going round a loop again skips the loads hoisted in
+// front of it; coming in from outside runs them.
+static s32 landing(struct Ir* ir, struct Lowering* out, struct IrPatch* patch) {
+  s32 hoist = ir->instrs[patch->to].hoist;
+  if (hoist != -1 && ir->hoists[hoist].start == patch->to
+      && ir->instrs[patch->from].hoist == hoist) {
+    return out->offsets[patch->to];
+  }
+  return out->before[patch->to];
+}
+
+static s32 countJumpOperands(struct Ir* ir) {
+  s32 count = 0;
+  for (s32 i = 0; i < ir->count; i++) {
+    u8 op = codeAt(ir, i)[0];
+    if (isJump(op)) {
+      count++;
+    } else if (op == BC_SWITCH) {
+      count += switchEntryCount(ir->function, ir->instrs[i].offset);
+    }
+  }
+  return count;
+}
+
+static void beginLowering(
+    struct Ir* ir, struct Lowering* out, s32 capacity, s32 patchCapacity) {
+  struct State* H = ir->H;
+  out->capacity = capacity;
+  out->patchCapacity = patchCapacity;
+  out->bc = ALLOCATE(H, u8, capacity);
+  out->lines = ALLOCATE(H, s32, capacity);
+  out->before = ALLOCATE(H, s32, ir->count);
+  out->offsets = ALLOCATE(H, s32, ir->count);
+  out->patches = ALLOCATE(H, struct IrPatch, patchCapacity);
+  out->count = 0;
+  out->patchCount = 0;
+  out->failed = false;
+}
+
+// Re-encodes the jumps and puts the new code in place of the old.
+static void finishLowering(struct Ir* ir, struct Lowering* out) {
+  struct State* H = ir->H;
+  struct Function* function = ir->function;
+
+  for (s32 p = 0; p < out->patchCount; p++) {
+    struct IrPatch* patch = &out->patches[p];
+    s32 end = patch->operand + 2;
+    s32 target = landing(ir, out, patch);
+    s32 jump = patch->backward ? end - target : target - end;
+    if (jump < 0 || jump > UINT16_MAX) {
+      out->failed = true;
+      break;
+    }
+    out->bc[patch->operand] = (jump >> 8) & 0xff;
+    out->bc[patch->operand + 1] = jump & 0xff;
+  }
+
+  FREE_ARRAY(H, s32, out->before, ir->count);
+  FREE_ARRAY(H, s32, out->offsets, ir->count);
+  FREE_ARRAY(H, struct IrPatch, out->patches, out->patchCapacity);
+
+  // Slots or jumps that no longer fit leave the function as it was.
+  if (out->failed) {
+    FREE_ARRAY(H, u8, out->bc, out->capacity);
+    FREE_ARRAY(H, s32, out->lines, out->capacity);
+    return;
+  }
+
+  FREE_ARRAY(H, u8, function->bc, function->bcCapacity);
+  FREE_ARRAY(H, s32, function->lines, function->bcCapacity);
+  function->bc = out->bc;
+  function->lines = out->lines;
+  function->bcCount = out->count;
+  function->bcCapacity = out->capacity;
+}
+
+static void lowerIr(struct Ir* ir) {
+  struct Function* function = ir->function;
+
+  s32 capacity = function->bcCount;
+  for (s32 h = 0; h < ir->hoistCount; h++) {
+    struct IrHoist* hoist = &ir->hoists[h];
+    for (s32 k = 0; k < hoist->loadCount; k++) {
+      capacity += instructionLength(function, ir->instrs[hoist->loads[k]].offset) + 1;
+    }
+  }
+
+  struct Lowering out;
+  beginLowering(ir, &out, capacity, countJumpOperands(ir));
+
+  for (s32 i = 0; i < ir->count; i++) {
+    out.before[i] = out.count;
+
+    for (s32 h = 0; h < ir->hoistCount; h++) {
+      struct IrHoist* hoist = &ir->hoists[h];
+      if (hoist->end != i) {
+        continue;
+      }
+      for (s32 k = 0; k < hoist->loadCount; k++) {
+        emitByte(&out, BC_POP, function->lines[ir->instrs[i - 1].offset]);
+      }
+    }
+    for (s32 h = 0; h < ir->hoistCount; h++) {
+      struct IrHoist* hoist = &ir->hoists[h];
+      if (hoist->start != i) {
+        continue;
+      }
+      for (s32 k = 0; k < hoist->loadCount; k++) {
+        s32 offset = ir->instrs[hoist->loads[k]].offset;
+        for (s32 b = 0; b < instructionLength(function, offset); b++) {
+          emitByte(&out, function->bc[offset + b], function->lines[offset]);
+        }
+      }
+    }
+
+    out.offsets[i] = out.count;
+    lowerInstruction(ir, &out, i);
+  }
+
+  finishLowering(ir, &out);
+}
+
+// Inlining ---------------------------------------------------------------
+
+// What an inlined callee needs of the caller, worked out before any of it
+// is written so that a call that can't be inlined is left whole.
+struct Inlinee {
+  struct Function* function;
+  s32 resultDepth; // Its stack depth once the result is pushed.
+  s32 maxDepth;
+  s32 cacheCount;  // Inline caches the copy needs of its own.
+  u8 constants[U8_COUNT]; // Its constants -> the caller's.
+};
+
+// Maps one of the callee's constants into the caller's pool, sharing an
+// equal one that is already there.
+static bool mapConstant(struct Ir* ir, struct Inlinee* inlinee, u8 constant) {
+  struct ValueArray* pool = &ir->function->constants;
+  Value value = inlinee->function->constants.values[constant];
+  for (s32 i = 0; i < pool->count && i <= UINT8_MAX; i++) {
+    if (sameConstant(pool->values[i], value)) {
+      inlinee->constants[constant] = (u8)i;
+      return true;
+    }
+  }
+
+  s32 added = addFunctionConstant(ir->H, ir->function, value);
+  inlinee->constants[constant] = (u8)added;
+  return added <= UINT8_MAX;
+}
+
+// The constant operand of an instruction the inliner copies, or -1.
+static s32 constantOperand(u8* bc) {
+  switch (bc[0]) {
+    case BC_CONSTANT:
+    case BC_GET_STATIC:
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+    case BC_SET_PROPERTY:
+    case BC_INVOKE:
+    case BC_TAIL_INVOKE:
+    case BC_CALL_STATIC:
+    case BC_TAIL_CALL_STATIC:
+      return bc[1];
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+    case BC_LOAD_CONSTANT:
+      return bc[2];
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      return bc[3];
+    default:
+      return -1;
+  }
+}
+
+static bool hasCache(u8 op) {
+  return op == BC_PUSH_PROPERTY || op == BC_GET_PROPERTY
+      || op == BC_SET_PROPERTY || op == BC_INVOKE || op == BC_TAIL_INVOKE
+      || op == BC_CALL_STATIC || op == BC_TAIL_CALL_STATIC;
+}
+
+// Whether the inliner can copy an instruction of a finished function.
+// Superinstructions are taken apart again so the passes after inlining
+// only ever see the plain ones.
+static bool isInlinable(u8 op) {
+  switch (op) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_POP:
+    case BC_ARRAY:
+    case BC_GET_SUBSCRIPT:
+    case BC_SET_SUBSCRIPT:
+    case BC_GET_GLOBAL:
+    case BC_SET_GLOBAL:
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+    case BC_GET_STATIC:
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+    case BC_SET_PROPERTY:
+    case BC_DESTRUCT_ARRAY:
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_CONCAT:
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+    case BC_NEGATE:
+    case BC_NOT:
+    case BC_CALL:
+    case BC_TAIL_CALL:
+    case BC_INSTANCE:
+    case BC_RETURN:
+    case BC_INVOKE:
+    case BC_TAIL_INVOKE:
+    case BC_CALL_STATIC:
+    case BC_TAIL_CALL_STATIC:
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+    case BC_SET_LOCAL_POP:
+    case BC_MOVE:
+    case BC_LOAD_CONSTANT:
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+    case BC_EQUAL_NUM:
+    case BC_NOT_EQUAL_NUM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether a callee is small, straight-line code ending in its only
+// BC_RETURN, with nothing of its own for closures to capture.
+static bool analyzeInlinee(struct Ir* ir, struct Closure* callee, s32 argCount,
+                           struct Inlinee* inlinee) {
+  struct Function* function = callee->function;
+  inlinee->function = function;
+  if (function->upvalueCount != 0 || function->arity != argCount
+      || function->bcCount > MAX_INLINE_LENGTH) {
+    return false;
+  }
+
+  s32 depth = function->arity + 1;
+  inlinee->maxDepth = depth;
+  inlinee->cacheCount = 0;
+  for (s32 offset = 0; offset < function->bcCount;
+      offset += instructionLength(function, offset)) {
+    u8* bc = &function->bc[offset];
+    bool last = offset + instructionLength(function, offset) == function->bcCount;
+    if (!isInlinable(bc[0]) || (bc[0] == BC_RETURN) != last) {
+      return false;
+    }
+
+    s32 constant = constantOperand(bc);
+    if (constant != -1 && !mapConstant(ir, inlinee, (u8)constant)) {
+      return false;
+    }
+    if (hasCache(bc[0])) {
+      inlinee->cacheCount++;
+    }
+
+    if (!last) {
+      depth += stackEffect(function, offset);
+    }
+    if (depth + 1 > inlinee->maxDepth) {
+      inlinee->maxDepth = depth + 1;
+    }
+  }
+
+  inlinee->resultDepth = depth;
+  return ir->function->cacheCount + inlinee->cacheCount <= UINT16_MAX;
+}
+
+static u8 plainArithmetic(u8 op) {
+  switch (op) {
+    case BC_ADD_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_ADD_RR:
+    case BC_ADD_RK:
+      return BC_ADD;
+    case BC_SUBTRACT_LOCALS:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+    case BC_SUBTRACT_RR:
+    case BC_SUBTRACT_RK:
+      return BC_SUBTRACT;
+    case BC_MULTIPLY_RR:
+    case BC_MULTIPLY_RK:
+      return BC_MULTIPLY;
+    default:
+      return BC_DIVIDE;
+  }
+}
+
+static void emitCache(struct Ir* ir, struct Lowering* out, s32 line) {
+  u16 cache = ir->function->cacheCount++;
+  emitByte(out, (cache >> 8) & 0xff, line);
+  emitByte(out, cache & 0xff, line);
+}
+
+// The caller's frame stays under an inlined callee, so the callee's tail
+// calls become ordinary ones.
+static u8 ordinaryCall(u8 op) {
+  switch (op) {
+    case BC_TAIL_CALL: return BC_CALL;
+    case BC_TAIL_INVOKE: return BC_INVOKE;
+    case BC_TAIL_CALL_STATIC: return BC_CALL_STATIC;
+    default: return op;
+  }
+}
+
+// Copies one instruction of the callee, its slots moved up to base. Its
+// line records where it came from, so errors in it still show the
+// callee's frame.
+static void emitInlined(
+    struct Ir* ir, struct Lowering* out, struct Inlinee* inlinee,
+    s32 offset, s32 base, s32 callLine) {
+  struct Function* function = inlinee->function;
+  u8* bc = &function->bc[offset];
+  u8* constants = inlinee->constants;
+  s32 line = addInlinedLine(ir->H, ir->function, function, function->lines[offset], callLine);
+
+  switch (bc[0]) {
+    case BC_CONSTANT:
+    case BC_GET_STATIC:
+      emitByte(out, bc[0], line);
+      emitByte(out, constants[bc[1]], line);
+      return;
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+      emitByte(out, bc[0], line);
+      emitSlot(out, base + bc[1], line);
+      return;
+    case BC_SET_LOCAL_POP:
+      emitByte(out, BC_SET_LOCAL, line);
+      emitSlot(out, base + bc[1], line);
+      emitByte(out, BC_POP, line);
+      return;
+    case BC_TAIL_CALL:
+      emitByte(out, ordinaryCall(bc[0]), line);
+      emitByte(out, bc[1], line);
+      return;
+    case BC_EQUAL_NUM:
+    case BC_NOT_EQUAL_NUM:
+      emitByte(out, bc[0] == BC_EQUAL_NUM ? BC_EQUAL : BC_NOT_EQUAL, line);
+      return;
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+    case BC_SET_PROPERTY:
+      emitByte(out, bc[0], line);
+      emitByte(out, constants[bc[1]], line);
+      emitCache(ir, out, line);
+      return;
+    case BC_INVOKE:
+    case BC_TAIL_INVOKE:
+    case BC_CALL_STATIC:
+    case BC_TAIL_CALL_STATIC:
+      emitByte(out, ordinaryCall(bc[0]), line);
+      emitByte(out, constants[bc[1]], line);
+      emitByte(out, bc[2], line);
+      emitCache(ir, out, line);
+      return;
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      emitByte(out, BC_GET_LOCAL, line);
+      emitSlot(out, base + bc[1], line);
+      if (bc[0] == BC_ADD_LOCALS || bc[0] == BC_SUBTRACT_LOCALS) {
+        emitByte(out, BC_GET_LOCAL, line);
+        emitSlot(out, base + bc[2], line);
+      } else {
+        emitByte(out, BC_CONSTANT, line);
+        emitByte(out, constants[bc[2]], line);
+      }
+      emitByte(out, plainArithmetic(bc[0]), line);
+      return;
+    case BC_MOVE:
+    case BC_LOAD_CONSTANT:
+      if (bc[0] == BC_MOVE) {
+        emitByte(out, BC_GET_LOCAL, line);
+        emitSlot(out, base + bc[2], line);
+      } else {
+        emitByte(out, BC_CONSTANT, line);
+        emitByte(out, constants[bc[2]], line);
+      }
+      emitByte(out, BC_SET_LOCAL, line);
+      emitSlot(out, base + bc[1], line);
+      emitByte(out, BC_POP, line);
+      return;
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      emitByte(out, BC_GET_LOCAL, line);
+      emitSlot(out, base + bc[2], line);
+      if (bc[0] >= BC_ADD_RK) {
+        emitByte(out, BC_CONSTANT, line);
+        emitByte(out, constants[bc[3]], line);
+      } else {
+        emitByte(out, BC_GET_LOCAL, line);
+        emitSlot(out, base + bc[3], line);
+      }
+      emitByte(out, plainArithmetic(bc[0]), line);
+      emitByte(out, BC_SET_LOCAL, line);
+      emitSlot(out, base + bc[1], line);
+      emitByte(out, BC_POP, line);
+      return;
+    default:
+      for (s32 k = 0; k < instructionLength(function, offset); k++) {
+        emitByte(out, bc[k], line);
+      }
+      return;
+  }
+}
+
+static bool isStaticCall(u8 op) {
+  return op == BC_CALL_STATIC || op == BC_TAIL_CALL_STATIC;
+}
+
+static u8 callArgCount(u8* bc) {
+  return isStaticCall(bc[0]) ? bc[2] : bc[1];
+}
+
+// [callee]; [args]; CALL n
+//   => [callee]; [args]; JUMP_IF_NOT_CALLEE n k L
+//      [body]; SET_LOCAL base; POP...; JUMP M
+//   L: CALL n
+//   M:
+// The copy leaves the result where the callee was, just like the call. A
+// BC_CALL_STATIC goes back to looking the method up right after its
+// struct, so the guard has the method to check.
+static void emitInlinedCall(
+    struct Ir* ir, struct Lowering* out, struct Inlinee* inlinee,
+    s32 i, u8 calleeConstant) {
+  struct Function* function = ir->function;
+  u8* bc = codeAt(ir, i);
+  s32 line = function->lines[ir->instrs[i].offset];
+  u8 argCount = callArgCount(bc);
+  s32 base = ir->instrs[i].depth - argCount - 1;
+
+  emitByte(out, BC_JUMP_IF_NOT_CALLEE, line);
+  emitByte(out, argCount, line);
+  emitByte(out, calleeConstant, line);
+  s32 guard = out->count;
+  emitByte(out, 0xff, line);
+  emitByte(out, 0xff, line);
+
+  struct Function* callee = inlinee->function;
+  s32 offset = 0;
+  for (; callee->bc[offset] != BC_RETURN; offset += instructionLength(callee, offset)) {
+    emitInlined(ir, out, inlinee, offset, base, line);
+  }
+  s32 returnLine = addInlinedLine(ir->H, function, callee, callee->lines[offset], line);
+  emitByte(out, BC_SET_LOCAL, returnLine);
+  emitSlot(out, base, returnLine);
+  for (s32 k = 1; k < inlinee->resultDepth; k++) {
+    emitByte(out, BC_POP, returnLine);
+  }
+  emitByte(out, BC_JUMP, line);
+  emitJumpOperand(out, i, i + 1, false, line);
+
+  s32 jump = out->count - (guard + 2);
+  out->bc[guard] = (jump >> 8) & 0xff;
+  out->bc[guard + 1] = jump & 0xff;
+
+  out->offsets[i] = out->count;
+  bool isTail = bc[0] == BC_TAIL_CALL || bc[0] == BC_TAIL_CALL_STATIC;
+  emitByte(out, isTail ? BC_TAIL_CALL : BC_CALL, line);
+  emitByte(out, argCount, line);
+}
+
+// Copies the callees of the calls the compiler knew the targets of into
+// the caller, behind a check that the callee is still the same closure.
+// Returns whether the code changed.
+static bool inlineCalls(struct Ir* ir, struct InlineSite* sites, s32 siteCount) {
+  struct Function* function = ir->function;
+  struct Inlinee* inlinees = ALLOCATE(ir->H, struct Inlinee, siteCount);
+  s32* siteAt = ALLOCATE(ir->H, s32, ir->count);
+  s32* receiverAt = ALLOCATE(ir->H, s32, ir->count);
+  for (s32 i = 0; i < ir->count; i++) {
+    siteAt[i] = -1;
+    receiverAt[i] = -1;
+  }
+
+  s32 capacity = function->bcCount;
+  s32 inlined = 0;
+  for (s32 s = 0; s < siteCount; s++) {
+    s32 i = sites[s].offset < function->bcCount ? ir->index[sites[s].offset] : -1;
+    if (i == -1 || ir->instrs[i].depth < 0) {
+      continue;
+    }
+
+    u8* bc = codeAt(ir, i);
+    if (isStaticCall(bc[0]) ? ir->index[sites[s].receiverEnd] == -1
+        : bc[0] != BC_CALL && bc[0] != BC_TAIL_CALL) {
+      continue;
+    }
+
+    struct Inlinee* inlinee = &inlinees[s];
+    u8 argCount = callArgCount(bc);
+    if (!analyzeInlinee(ir, sites[s].callee, argCount, inlinee)
+        || ir->instrs[i].depth - argCount - 1 + inlinee->maxDepth > UINT8_MAX) {
+      continue;
+    }
+
+    siteAt[i] = s;
+    inlined++;
+    // Taking superinstructions apart at most doubles their length.
+    capacity += 2 * inlinee->function->bcCount + inlinee->resultDepth + 12;
+  }
+
+  // The guards' constants come last, so a pool too full for one of them
+  // only loses that call.
+  u8* calleeConstants = ALLOCATE(ir->H, u8, siteCount);
+  for (s32 i = 0; i < ir->count; i++) {
+    s32 s = siteAt[i];
+    if (s == -1) {
+      continue;
+    }
+    s32 constant = addFunctionConstant(ir->H, function, NEW_OBJ(sites[s].callee));
+    if (constant > UINT8_MAX) {
+      function->constants.count--;
+      siteAt[i] = -1;
+      inlined--;
+      continue;
+    }
+
+    calleeConstants[s] = (u8)constant;
+    if (isStaticCall(codeAt(ir, i)[0])) {
+      receiverAt[ir->index[sites[s].receiverEnd]] = i;
+    }
+  }
+
+  if (inlined > 0) {
+    struct Lowering out;
+    beginLowering(ir, &out, capacity, countJumpOperands(ir) + inlined);
+    for (s32 i = 0; i < ir->count; i++) {
+      out.before[i] = out.count;
+      if (receiverAt[i] != -1) {
+        u8* call = codeAt(ir, receiverAt[i]);
+        s32 line = function->lines[ir->instrs[receiverAt[i]].offset];
+        emitByte(&out, BC_GET_STATIC, line);
+        emitByte(&out, call[1], line);
+      }
+
+      out.offsets[i] = out.count;
+      if (siteAt[i] != -1) {
+        emitInlinedCall(ir, &out, &inlinees[siteAt[i]], i, calleeConstants[siteAt[i]]);
+      } else {
+        lowerInstruction(ir, &out, i);
+      }
+    }
+    finishLowering(ir, &out);
+    inlined = out.failed ? 0 : inlined;
+  }
+
+  FREE_ARRAY(ir->H, u8, calleeConstants, siteCount);
+  FREE_ARRAY(ir->H, s32, receiverAt, ir->count);
+  FREE_ARRAY(ir->H, s32, siteAt, ir->count);
+  FREE_ARRAY(ir->H, struct Inlinee, inlinees, siteCount);
+  return inlined > 0;
+}
+
+static bool hasChanges(struct Ir* ir) {
+  if (ir->hoistCount > 0) {
+    return true;
+  }
+  for (s32 i = 0; i < ir->count; i++) {
+    if (ir->instrs[i].action != IR_KEEP) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void freeLifted(struct Ir* ir, s32 length) {
+  FREE_ARRAY(ir->H, struct IrInstr, ir->instrs, ir->count);
+  FREE_ARRAY(ir->H, s32, ir->index, length + 1);
+}
+
+void runIrPasses(
+    struct State* H, struct Function* function,
+    struct InlineSite* sites, s32 siteCount) {
+  struct Ir ir;
+  ir.H = H;
+  ir.function = function;
+  s32 length = function->bcCount;
+
+  liftFunction(&ir);
+  if (siteCount > 0 && inlineCalls(&ir, sites, siteCount)) {
+    freeLifted(&ir, length);
+    length = function->bcCount;
+    liftFunction(&ir);
+  }
+  hoistInvariants(&ir);
+  numberValues(&ir);
+  removeDeadStores(&ir);
+  if (hasChanges(&ir)) {
+    lowerIr(&ir);
+  }
+
+  FREE_ARRAY(H, struct IrHoist, ir.hoists, ir.loopCount);
+  freeLifted(&ir, length);
+}
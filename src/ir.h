@@ -0,0 +1,20 @@
+#ifndef _HOBBYL_IR_H
+#define _HOBBYL_IR_H
+
+#include "common.h"
+#include "object.h"
+
+// A call the compiler knows the target of, for as long as the variable it
+// was read from still holds that closure.
+struct InlineSite {
+  s32 offset; // The BC_CALL or BC_CALL_STATIC.
+  // Where a BC_CALL_STATIC's struct was pushed by, or -1.
+  s32 receiverEnd;
+  struct Closure* callee;
+};
+
+void runIrPasses(
+    struct State* H, struct Function* function,
+    struct InlineSite* sites, s32 siteCount);
+
+#endif // _HOBBYL_IR_H
@@ -0,0 +1,1443 @@
+// mmap's MAP_ANONYMOUS isn't part of plain C11.
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "opcodes.h"
+#include "optimizer.h"
+
+// The generated code keeps three values in callee-saved registers:
+//   rbx  struct State* H
+//   r12  struct CallFrame* frame
+//   r13  frame->slots, which only moves when a call grows the stack
+// The VM's stack top stays in H, because the helpers move it. Everything
+// else is scratch, and helpers are called with the SysV ABI.
+
+#define STACK_TOP ((s32)offsetof(struct State, stackTop))
+#define FRAME_IP ((u8)offsetof(struct CallFrame, ip))
+#define FRAME_SLOTS ((u8)offsetof(struct CallFrame, slots))
+#define FRAME_CLOSURE ((s32)offsetof(struct CallFrame, closure))
+#define GLOBAL_VALUES ((s32)offsetof(struct State, globalValues.values))
+#define CLOSURE_UPVALUES ((s32)offsetof(struct Closure, upvalues))
+#define UPVALUE_LOCATION ((s32)offsetof(struct Upvalue, location))
+#define OBJECT_TYPE ((s32)offsetof(struct Obj, type))
+
+#define JIT_SHORT(bc, at) ((u16)((bc[at] << 8) | bc[at + 1]))
+
+typedef enum JitResult (*JitEntry)(struct State* H, struct CallFrame* frame, u8* code);
+
+struct JumpFixup {
+  s32 operand; // Where the rel32 sits in the code.
+  s32 target;  // Bytecode offset it lands on.
+};
+
+struct Emitter {
+  struct State* H;
+  struct Function* function;
+
+  u8* code;
+  s32 count;
+  s32 capacity;
+
+  s32* native; // Bytecode offset -> code offset.
+  struct JumpFixup* fixups;
+  s32 fixupCount;
+
+  s32 epilogue;
+  s32 error;
+
+  // Type guards of the current fast path, patched to its slow path.
+  s32 slowJumps[2];
+  s32 slowCount;
+};
+
+static void emit8(struct Emitter* emitter, u8 byte) {
+  if (emitter->count == emitter->capacity) {
+    s32 oldCapacity = emitter->capacity;
+    emitter->capacity = GROW_CAPACITY(oldCapacity);
+    emitter->code = GROW_ARRAY(emitter->H, u8, emitter->code, oldCapacity, emitter->capacity);
+  }
+  emitter->code[emitter->count++] = byte;
+}
+
+static void emitBytes(struct Emitter* emitter, const u8* bytes, s32 count) {
+  for (s32 i = 0; i < count; i++) {
+    emit8(emitter, bytes[i]);
+  }
+}
+
+#define EMIT(...) \
+    do { \
+      const u8 bytes[] = {__VA_ARGS__}; \
+      emitBytes(emitter, bytes, sizeof(bytes)); \
+    } while (false)
+
+static void emit32(struct Emitter* emitter, s32 value) {
+  u32 bits = (u32)value;
+  for (s32 i = 0; i < 4; i++) {
+    emit8(emitter, (bits >> (i * 8)) & 0xff);
+  }
+}
+
+static void emit64(struct Emitter* emitter, u64 value) {
+  for (s32 i = 0; i < 8; i++) {
+    emit8(emitter, (value >> (i * 8)) & 0xff);
+  }
+}
+
+static void patch32(struct Emitter* emitter, s32 operand, s32 value) {
+  u32 bits = (u32)value;
+  for (s32 i = 0; i < 4; i++) {
+    emitter->code[operand + i] = (bits >> (i * 8)) & 0xff;
+  }
+}
+
+// Jumps to code that has already been emitted.
+static void emitJumpBack(struct Emitter* emitter, s32 to) {
+  emit32(emitter, to - (emitter->count + 4));
+}
+
+// Jumps to a bytecode offset, patched once every instruction has a home.
+static void emitJumpTo(struct Emitter* emitter, s32 target) {
+  struct JumpFixup* fixup = &emitter->fixups[emitter->fixupCount++];
+  fixup->operand = emitter->count;
+  fixup->target = target;
+  emit32(emitter, 0);
+}
+
+// mov rcx, imm64
+static void emitLoadValue(struct Emitter* emitter, Value value) {
+  EMIT(0x48, 0xb9);
+  emit64(emitter, value);
+}
+
+// mov rcx, [r13 + slot * 8]
+static void emitLoadSlot(struct Emitter* emitter, u8 slot) {
+  EMIT(0x49, 0x8b, 0x8d);
+  emit32(emitter, slot * (s32)sizeof(Value));
+}
+
+// mov [r13 + slot * 8], rcx
+static void emitStoreSlot(struct Emitter* emitter, u8 slot) {
+  EMIT(0x49, 0x89, 0x8d);
+  emit32(emitter, slot * (s32)sizeof(Value));
+}
+
+// Pushes rcx onto the VM stack.
+static void emitPush(struct Emitter* emitter) {
+  EMIT(0x48, 0x8b, 0x83); emit32(emitter, STACK_TOP); // mov rax, [rbx + stackTop]
+  EMIT(0x48, 0x89, 0x08);                             // mov [rax], rcx
+  EMIT(0x48, 0x83, 0xc0, 0x08);                       // add rax, 8
+  EMIT(0x48, 0x89, 0x83); emit32(emitter, STACK_TOP); // mov [rbx + stackTop], rax
+}
+
+// Loads the top of the VM stack into rcx.
+static void emitPeek(struct Emitter* emitter) {
+  EMIT(0x48, 0x8b, 0x83); emit32(emitter, STACK_TOP); // mov rax, [rbx + stackTop]
+  EMIT(0x48, 0x8b, 0x48, 0xf8);                       // mov rcx, [rax - 8]
+}
+
+// Pops the top of the VM stack into rcx.
+static void emitPop(struct Emitter* emitter) {
+  EMIT(0x48, 0x8b, 0x83); emit32(emitter, STACK_TOP); // mov rax, [rbx + stackTop]
+  EMIT(0x48, 0x83, 0xe8, 0x08);                       // sub rax, 8
+  EMIT(0x48, 0x89, 0x83); emit32(emitter, STACK_TOP); // mov [rbx + stackTop], rax
+  EMIT(0x48, 0x8b, 0x08);                             // mov rcx, [rax]
+}
+
+// frame->ip = ip, so run() and runtimeError() know where the frame is.
+static void emitStoreIp(struct Emitter* emitter, const u8* ip) {
+  EMIT(0x48, 0xb8); emit64(emitter, (u64)(uintptr_t)ip); // mov rax, imm64
+  EMIT(0x49, 0x89, 0x44, 0x24, FRAME_IP);                // mov [r12 + ip], rax
+}
+
+// Hands the frame back to run() at ip.
+static void emitExit(struct Emitter* emitter, const u8* ip) {
+  emitStoreIp(emitter, ip);
+  EMIT(0xb8); emit32(emitter, JIT_EXIT); // mov eax, JIT_EXIT
+  EMIT(0xe9); emitJumpBack(emitter, emitter->epilogue);
+}
+
+// Jumps to target if rcx holds nil or false.
+static void emitJumpIfFalsey(struct Emitter* emitter, s32 target) {
+  EMIT(0x48, 0xba); emit64(emitter, NEW_FALSE); // mov rdx, imm64
+  EMIT(0x48, 0x39, 0xd1);                       // cmp rcx, rdx
+  EMIT(0x0f, 0x84); emitJumpTo(emitter, target); // je
+  EMIT(0x48, 0xba); emit64(emitter, NEW_NIL);
+  EMIT(0x48, 0x39, 0xd1);
+  EMIT(0x0f, 0x84); emitJumpTo(emitter, target);
+}
+
+// Calls helper(H, frame, bc) and bails out to the error stub if it fails.
+// The flags are left from testing its result, for branching helpers.
+static void emitHelper(struct Emitter* emitter, JitHelper helper, s32 offset, s32 length) {
+  const u8* bc = emitter->function->bc + offset;
+  emitStoreIp(emitter, bc + length);
+  EMIT(0x48, 0x89, 0xdf);                                    // mov rdi, rbx
+  EMIT(0x4c, 0x89, 0xe6);                                    // mov rsi, r12
+  EMIT(0x48, 0xba); emit64(emitter, (u64)(uintptr_t)bc);     // mov rdx, imm64
+  EMIT(0x48, 0xb8); emit64(emitter, (u64)(uintptr_t)helper); // mov rax, imm64
+  EMIT(0xff, 0xd0);                                          // call rax
+  EMIT(0x85, 0xc0);                                          // test eax, eax
+  EMIT(0x0f, 0x88); emitJumpBack(emitter, emitter->error);   // js error
+}
+
+static JitHelper helperFor(u8 op) {
+  switch (op) {
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+      return jitArithmetic;
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_EQUAL_NUM:
+    case BC_NOT_EQUAL_NUM:
+      return jitEquality;
+    case BC_CONCAT: return jitConcat;
+    case BC_NEGATE: return jitNegate;
+    case BC_NOT: return jitNot;
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      return jitLocalArithmetic;
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      return jitRegisterArithmetic;
+    case BC_GET_GLOBAL: return jitGetGlobal;
+    case BC_SET_GLOBAL: return jitSetGlobal;
+    case BC_GET_UPVALUE: return jitGetUpvalue;
+    case BC_SET_UPVALUE: return jitSetUpvalue;
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+      return jitGetProperty;
+    case BC_SET_PROPERTY: return jitSetProperty;
+    case BC_GET_SELF_FIELD: return jitGetSelfField;
+    case BC_SET_SELF_FIELD: return jitSetSelfField;
+    case BC_GET_SUBSCRIPT: return jitGetSubscript;
+    case BC_FOR_IN_PREP: return jitForInPrep;
+    default:
+      return NULL;
+  }
+}
+
+static JitHelper branchHelperFor(u8 op) {
+  switch (op) {
+    case BC_JUMP_IF_NOT_EQUAL:
+    case BC_JUMP_IF_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+    case BC_JUMP_IF_EQUAL_NUM:
+      return jitCompareJump;
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+    case BC_JUMP_IF_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+    case BC_JUMP_IF_EQUAL_RK:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+      return jitRegisterCompareJump;
+    case BC_FOR_PREP:
+      return jitForPrep;
+    case BC_FOR_LOOP:
+      return jitForLoop;
+    case BC_FOR_IN_LOOP:
+      return jitForInLoop;
+    case BC_JUMP_IF_NOT_CALLEE:
+      return jitCalleeGuard;
+    default:
+      return NULL;
+  }
+}
+
+static s32 jumpTargetOf(struct Function* function, s32 offset, s32 length) {
+  u8* bc = function->bc;
+  u16 jump = (u16)((bc[offset + length - 2] << 8) | bc[offset + length - 1]);
+  if (bc[offset] == BC_LOOP) {
+    return offset + length - jump;
+  }
+  return offset + length + jump;
+}
+
+// Emits a rel32 to be pointed at code emitted later with landHere().
+static s32 emitForward(struct Emitter* emitter) {
+  s32 operand = emitter->count;
+  emit32(emitter, 0);
+  return operand;
+}
+
+static void landHere(struct Emitter* emitter, s32 operand) {
+  patch32(emitter, operand, emitter->count - (operand + 4));
+}
+
+// Fast paths inline the number case of an instruction and fall back to its
+// helper for everything else, including the errors. Operands are guarded
+// and loaded into xmm0 and xmm1.
+
+// mov r9, QNAN, for the guards.
+static void emitLoadQnan(struct Emitter* emitter) {
+  EMIT(0x49, 0xb9); emit64(emitter, QNAN);
+}
+
+// Emits a short jump, to be pointed at code emitted later with
+// landShort().
+static s32 emitShortForward(struct Emitter* emitter, u8 opcode) {
+  emit8(emitter, opcode);
+  emit8(emitter, 0);
+  return emitter->count - 1;
+}
+
+static void landShort(struct Emitter* emitter, s32 operand) {
+  emitter->code[operand] = (u8)(emitter->count - (operand + 1));
+}
+
+// Sets the flags for whether the value in rax is a double (jne) or not.
+static void emitTestDouble(struct Emitter* emitter) {
+  EMIT(0x49, 0x89, 0xc0); // mov r8, rax
+  EMIT(0x4d, 0x21, 0xc8); // and r8, r9
+  EMIT(0x4d, 0x39, 0xc8); // cmp r8, r9
+}
+
+// Sets the flags for whether the value in rax is an int (je) or not.
+static void emitTestInt(struct Emitter* emitter) {
+  EMIT(0x49, 0x89, 0xc0);                                  // mov r8, rax
+  EMIT(0x49, 0xc1, 0xe8, 0x20);                            // shr r8, 32
+  EMIT(0x41, 0x81, 0xf8); emit32(emitter, (s32)((QNAN | INT_TAG) >> 32)); // cmp r8d, imm32
+}
+
+// Moves the number in rax to xmm as a double. Unless it's already known to
+// be a double it's guarded first: ints are converted, and anything else
+// takes the slow path.
+static void emitNumberOperand(struct Emitter* emitter, u8 xmm, bool guard) {
+  s32 isDouble = -1;
+  s32 done = -1;
+  if (guard) {
+    emitTestDouble(emitter);
+    isDouble = emitShortForward(emitter, 0x75);              // jne isDouble
+    emitTestInt(emitter);
+    EMIT(0x0f, 0x85);                                        // jne slow
+    emitter->slowJumps[emitter->slowCount++] = emitForward(emitter);
+    EMIT(0xf2, 0x0f, 0x2a, 0xc0 | (xmm << 3));               // cvtsi2sd xmm, eax
+    done = emitShortForward(emitter, 0xeb);                  // jmp done
+    landShort(emitter, isDouble);
+  }
+  EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0 | (xmm << 3));           // movq xmm, rax
+  if (guard) {
+    landShort(emitter, done);
+  }
+}
+
+static void emitSlotOperand(struct Emitter* emitter, u8 slot, u8 xmm, bool guard) {
+  EMIT(0x49, 0x8b, 0x85); emit32(emitter, slot * (s32)sizeof(Value)); // mov rax, [r13 + slot * 8]
+  emitNumberOperand(emitter, xmm, guard);
+}
+
+// Reads distance values below the stack top, which rdx must hold.
+static void emitStackOperand(struct Emitter* emitter, s32 distance, u8 xmm, bool guard) {
+  EMIT(0x48, 0x8b, 0x42, (u8)(-distance * (s32)sizeof(Value))); // mov rax, [rdx - distance * 8]
+  emitNumberOperand(emitter, xmm, guard);
+}
+
+static void emitConstantOperand(struct Emitter* emitter, Value constant, u8 xmm) {
+  f64 number = AS_NUMBER(constant);
+  u64 bits;
+  memcpy(&bits, &number, sizeof(bits));
+  EMIT(0x48, 0xb8); emit64(emitter, bits);            // mov rax, imm64
+  EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0 | (xmm << 3));    // movq xmm, rax
+}
+
+// rdx = H->stackTop
+static void emitLoadStackTop(struct Emitter* emitter) {
+  EMIT(0x48, 0x8b, 0x93); emit32(emitter, STACK_TOP);
+}
+
+// H->stackTop = rdx - distance * 8, without touching the flags.
+static void emitDropStack(struct Emitter* emitter, s32 distance) {
+  EMIT(0x48, 0x8d, 0x52, (u8)(-distance * (s32)sizeof(Value))); // lea rdx, [rdx - distance * 8]
+  EMIT(0x48, 0x89, 0x93); emit32(emitter, STACK_TOP);            // mov [rbx + stackTop], rdx
+}
+
+// rax = the number xmm0 op xmm1.
+static void emitArithmetic(struct Emitter* emitter, u8 sseOp) {
+  EMIT(0xf2, 0x0f, sseOp, 0xc1);       // opsd xmm0, xmm1
+  EMIT(0x66, 0x48, 0x0f, 0x7e, 0xc0);  // movq rax, xmm0
+}
+
+enum Comparison {
+  COMPARE_GREATER,
+  COMPARE_GREATER_EQUAL,
+  COMPARE_LESSER,
+  COMPARE_LESSER_EQUAL,
+};
+
+// Sets the flags so that "above" means the comparison holds and "above or
+// equal" means its inclusive form. NaNs compare unordered, which reads as
+// below, so they fail every comparison like they do in C.
+static void emitCompare(struct Emitter* emitter, enum Comparison comparison) {
+  if (comparison == COMPARE_GREATER || comparison == COMPARE_GREATER_EQUAL) {
+    EMIT(0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+  } else {
+    EMIT(0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+  }
+}
+
+static bool isInclusive(enum Comparison comparison) {
+  return comparison == COMPARE_GREATER_EQUAL || comparison == COMPARE_LESSER_EQUAL;
+}
+
+// rax = whether the flags from emitCompare() hold, as a bool Value.
+static void emitCompareResult(struct Emitter* emitter, enum Comparison comparison) {
+  EMIT(0x0f, isInclusive(comparison) ? 0x93 : 0x97, 0xc0); // setae/seta al
+  EMIT(0x0f, 0xb6, 0xc0);                                  // movzx eax, al
+  EMIT(0x83, 0xc0, TAG_FALSE);                             // add eax, TAG_FALSE
+  EMIT(0x4c, 0x09, 0xc8);                                  // or rax, r9
+}
+
+// Jumps to target unless the flags from emitCompare() hold.
+static void emitJumpUnlessCompare(struct Emitter* emitter, enum Comparison comparison, s32 target) {
+  EMIT(0x0f, isInclusive(comparison) ? 0x82 : 0x86); // jb/jbe
+  emitJumpTo(emitter, target);
+}
+
+// Ends the fast path and starts the slow one.
+static s32 beginSlowPath(struct Emitter* emitter) {
+  EMIT(0xe9); // jmp done
+  s32 done = emitForward(emitter);
+  for (s32 i = 0; i < emitter->slowCount; i++) {
+    landHere(emitter, emitter->slowJumps[i]);
+  }
+  emitter->slowCount = 0;
+  return done;
+}
+
+static u8 sseArithmetic(u8 op) {
+  switch (op) {
+    case BC_ADD: case BC_ADD_LOCALS: case BC_ADD_LOCAL_CONSTANT:
+    case BC_ADD_RR: case BC_ADD_RK:
+      return 0x58;
+    case BC_SUBTRACT: case BC_SUBTRACT_LOCALS: case BC_SUBTRACT_LOCAL_CONSTANT:
+    case BC_SUBTRACT_RR: case BC_SUBTRACT_RK:
+      return 0x5c;
+    case BC_MULTIPLY: case BC_MULTIPLY_RR: case BC_MULTIPLY_RK:
+      return 0x59;
+    case BC_DIVIDE: case BC_DIVIDE_RR: case BC_DIVIDE_RK:
+      return 0x5e;
+    default:
+      return 0;
+  }
+}
+
+static bool comparisonOf(u8 op, enum Comparison* comparison) {
+  switch (op) {
+    case BC_GREATER: case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_RR: case BC_JUMP_IF_NOT_GREATER_RK:
+      *comparison = COMPARE_GREATER;
+      return true;
+    case BC_GREATER_EQUAL: case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR: case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+      *comparison = COMPARE_GREATER_EQUAL;
+      return true;
+    case BC_LESSER: case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_RR: case BC_JUMP_IF_NOT_LESSER_RK:
+      *comparison = COMPARE_LESSER;
+      return true;
+    case BC_LESSER_EQUAL: case BC_JUMP_IF_NOT_LESSER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR: case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+      *comparison = COMPARE_LESSER_EQUAL;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Loads the right operand of a local or register instruction, which names
+// either a slot or a constant. Only number constants have a fast path.
+static bool emitRightOperand(struct Emitter* emitter, bool isSlot, u8 operand, bool guard) {
+  if (isSlot) {
+    emitSlotOperand(emitter, operand, 1, guard);
+    return true;
+  }
+
+  Value constant = emitter->function->constants.values[operand];
+  if (!IS_NUMBER(constant)) {
+    return false;
+  }
+  emitConstantOperand(emitter, constant, 1);
+  return true;
+}
+
+#define GUARD_LEFT 0x1
+#define GUARD_RIGHT 0x2
+
+// Loads the operands of a number instruction into xmm0 and xmm1, guarding
+// the ones flagged in guards. Stack forms leave the stack top in rdx.
+// Returns false for other instructions, and for constants that aren't
+// numbers.
+static bool emitNumberOperands(struct Emitter* emitter, const u8* bc, u8 guards) {
+  bool guardLeft = (guards & GUARD_LEFT) != 0;
+  bool guardRight = (guards & GUARD_RIGHT) != 0;
+  u8 op = bc[0];
+  switch (op) {
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+      emitLoadStackTop(emitter);
+      emitStackOperand(emitter, 2, 0, guardLeft);
+      emitStackOperand(emitter, 1, 1, guardRight);
+      return true;
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      emitSlotOperand(emitter, bc[1], 0, guardLeft);
+      return emitRightOperand(emitter,
+          op == BC_ADD_LOCALS || op == BC_SUBTRACT_LOCALS, bc[2], guardRight);
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      emitSlotOperand(emitter, bc[2], 0, guardLeft);
+      return emitRightOperand(emitter, op <= BC_DIVIDE_RR, bc[3], guardRight);
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+      emitSlotOperand(emitter, bc[1], 0, guardLeft);
+      return emitRightOperand(emitter, op <= BC_JUMP_IF_NOT_LESSER_EQUAL_RR, bc[2], guardRight);
+    default:
+      return false;
+  }
+}
+
+static bool isNumberBranch(u8 op) {
+  enum Comparison comparison;
+  return comparisonOf(op, &comparison) && op != BC_GREATER && op != BC_GREATER_EQUAL
+      && op != BC_LESSER && op != BC_LESSER_EQUAL;
+}
+
+// Finishes a number instruction that doesn't branch, once its operands
+// are loaded.
+static void emitNumberResult(struct Emitter* emitter, const u8* bc) {
+  u8 op = bc[0];
+  enum Comparison comparison = COMPARE_GREATER;
+  if (comparisonOf(op, &comparison)) {
+    emitCompare(emitter, comparison);
+    emitCompareResult(emitter, comparison);
+  } else {
+    emitArithmetic(emitter, sseArithmetic(op));
+  }
+
+  switch (op) {
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      EMIT(0x48, 0x89, 0xc1); // mov rcx, rax
+      emitPush(emitter);
+      break;
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      EMIT(0x49, 0x89, 0x85); emit32(emitter, bc[1] * (s32)sizeof(Value)); // mov [r13 + dest * 8], rax
+      break;
+    default:
+      EMIT(0x48, 0x89, 0x42, 0xf0); // mov [rdx - 16], rax
+      emitDropStack(emitter, 1);
+      break;
+  }
+}
+
+// Compares the operands of a number branch, popping them first for the
+// stack forms. Returns the comparison the flags hold.
+static enum Comparison emitNumberBranch(struct Emitter* emitter, const u8* bc) {
+  enum Comparison comparison = COMPARE_GREATER;
+  comparisonOf(bc[0], &comparison);
+  if (bc[0] < BC_JUMP_IF_NOT_EQUAL_RR) {
+    emitDropStack(emitter, 2);
+  }
+  emitCompare(emitter, comparison);
+  return comparison;
+}
+
+// Emits the number fast path of an instruction followed by its helper as
+// the slow path. Returns false, having emitted nothing, for instructions
+// without one.
+static bool emitFastPath(struct Emitter* emitter, s32 offset, s32 length) {
+  struct Function* function = emitter->function;
+  u8* bc = function->bc + offset;
+  u8 op = bc[0];
+  bool branches = isNumberBranch(op);
+  s32 start = emitter->count;
+
+  emitter->slowCount = 0;
+  if (op == BC_GET_GLOBAL) {
+    EMIT(0x48, 0x8b, 0x83); emit32(emitter, GLOBAL_VALUES);              // mov rax, [rbx + globalValues]
+    EMIT(0x48, 0x8b, 0x88); emit32(emitter, JIT_SHORT(bc, 1) * (s32)sizeof(Value)); // mov rcx, [rax + slot * 8]
+    EMIT(0x48, 0xba); emit64(emitter, NEW_UNDEFINED);                   // mov rdx, imm64
+    EMIT(0x48, 0x39, 0xd1);                                             // cmp rcx, rdx
+    EMIT(0x0f, 0x84);                                                   // je slow
+    emitter->slowJumps[emitter->slowCount++] = emitForward(emitter);
+    emitPush(emitter);
+  } else {
+    emitLoadQnan(emitter);
+    if (!emitNumberOperands(emitter, bc, GUARD_LEFT | GUARD_RIGHT)) {
+      emitter->count = start;
+      return false;
+    }
+
+    if (branches) {
+      enum Comparison comparison = emitNumberBranch(emitter, bc);
+      emitJumpUnlessCompare(emitter, comparison, jumpTargetOf(function, offset, length));
+    } else {
+      emitNumberResult(emitter, bc);
+    }
+  }
+
+  s32 done = beginSlowPath(emitter);
+  if (branches) {
+    emitHelper(emitter, branchHelperFor(op), offset, length);
+    EMIT(0x0f, 0x85); emitJumpTo(emitter, jumpTargetOf(function, offset, length)); // jnz
+  } else {
+    emitHelper(emitter, helperFor(op), offset, length);
+  }
+  landHere(emitter, done);
+  return true;
+}
+
+// rcx = the value of the closure's upvalue at index, read through its box
+// if it has one.
+static void emitGetUpvalue(struct Emitter* emitter, u8 index) {
+  EMIT(0x49, 0x8b, 0x84, 0x24); emit32(emitter, FRAME_CLOSURE);         // mov rax, [r12 + closure]
+  EMIT(0x48, 0x8b, 0x80); emit32(emitter, CLOSURE_UPVALUES);          // mov rax, [rax + upvalues]
+  EMIT(0x48, 0x8b, 0x88); emit32(emitter, index * (s32)sizeof(Value)); // mov rcx, [rax + index * 8]
+  EMIT(0x48, 0x89, 0xc8);                                             // mov rax, rcx
+  EMIT(0x48, 0xc1, 0xe8, 0x30);                                       // shr rax, 48
+  EMIT(0x3d); emit32(emitter, (s32)((SIGN_BIT | QNAN) >> 48));        // cmp eax, imm32
+  s32 notObject = emitShortForward(emitter, 0x75);                    // jne done
+  EMIT(0x48, 0x89, 0xc8);                                             // mov rax, rcx
+  EMIT(0x48, 0xc1, 0xe0, 0x10);                                       // shl rax, 16
+  EMIT(0x48, 0xc1, 0xe8, 0x10);                                       // shr rax, 16
+  EMIT(0x83, 0xb8); emit32(emitter, OBJECT_TYPE); emit8(emitter, OBJ_UPVALUE); // cmp dword [rax + type], OBJ_UPVALUE
+  s32 notBoxed = emitShortForward(emitter, 0x75);                     // jne done
+  EMIT(0x48, 0x8b, 0x80); emit32(emitter, UPVALUE_LOCATION);          // mov rax, [rax + location]
+  EMIT(0x48, 0x8b, 0x08);                                             // mov rcx, [rax]
+  landShort(emitter, notObject);
+  landShort(emitter, notBoxed);
+}
+
+// The loops of a function are found the first time one of them is asked
+// for, and stay put from then on since baseline code points into them.
+static struct HotLoop* findLoop(struct State* H, struct Function* function, s32 offset) {
+  if (function->loops == NULL) {
+    s32 count = 0;
+    for (s32 at = 0; at < function->bcCount; at += instructionLength(function, at)) {
+      if (function->bc[at] == BC_LOOP) {
+        count++;
+      }
+    }
+
+    function->loops = ALLOCATE(H, struct HotLoop, count);
+    function->loopCount = count;
+    s32 i = 0;
+    for (s32 at = 0; at < function->bcCount; at += instructionLength(function, at)) {
+      if (function->bc[at] == BC_LOOP) {
+        struct HotLoop* loop = &function->loops[i++];
+        loop->offset = at;
+        loop->hotness = 0;
+        loop->watched = true;
+        loop->trace = NULL;
+      }
+    }
+  }
+
+  for (s32 i = 0; i < function->loopCount; i++) {
+    if (function->loops[i].offset == offset) {
+      return &function->loops[i];
+    }
+  }
+  return NULL;
+}
+
+// Emits the template for one instruction. Returns false for instructions
+// left to run(), which get an exit back to it instead.
+static bool emitInstruction(struct Emitter* emitter, s32 offset) {
+  struct Function* function = emitter->function;
+  u8* bc = function->bc + offset;
+  s32 length = instructionLength(function, offset);
+
+  switch (bc[0]) {
+    case BC_CONSTANT:
+      emitLoadValue(emitter, function->constants.values[bc[1]]);
+      emitPush(emitter);
+      return true;
+    case BC_NIL:   emitLoadValue(emitter, NEW_NIL); emitPush(emitter); return true;
+    case BC_TRUE:  emitLoadValue(emitter, NEW_TRUE); emitPush(emitter); return true;
+    case BC_FALSE: emitLoadValue(emitter, NEW_FALSE); emitPush(emitter); return true;
+    case BC_GET_UPVALUE:
+      emitGetUpvalue(emitter, bc[1]);
+      emitPush(emitter);
+      return true;
+    case BC_POP:
+      EMIT(0x48, 0x83, 0xab); emit32(emitter, STACK_TOP); emit8(emitter, 0x08); // sub qword [rbx + stackTop], 8
+      return true;
+    case BC_GET_LOCAL:
+      emitLoadSlot(emitter, bc[1]);
+      emitPush(emitter);
+      return true;
+    case BC_SET_LOCAL:
+      emitPeek(emitter);
+      emitStoreSlot(emitter, bc[1]);
+      return true;
+    case BC_SET_LOCAL_POP:
+      emitPop(emitter);
+      emitStoreSlot(emitter, bc[1]);
+      return true;
+    case BC_MOVE:
+      emitLoadSlot(emitter, bc[2]);
+      emitStoreSlot(emitter, bc[1]);
+      return true;
+    case BC_LOAD_CONSTANT:
+      emitLoadValue(emitter, function->constants.values[bc[2]]);
+      emitStoreSlot(emitter, bc[1]);
+      return true;
+    case BC_JUMP:
+      EMIT(0xe9); emitJumpTo(emitter, jumpTargetOf(function, offset, length));
+      return true;
+    case BC_LOOP: {
+      // Watched loops go back through run(), see jitLoop().
+      struct HotLoop* loop = findLoop(emitter->H, function, offset);
+      EMIT(0x48, 0xb8); emit64(emitter, (u64)(uintptr_t)&loop->watched); // mov rax, imm64
+      EMIT(0x80, 0x38, 0x00);                                            // cmp byte [rax], 0
+      EMIT(0x0f, 0x84); emitJumpTo(emitter, jumpTargetOf(function, offset, length)); // je
+      emitExit(emitter, bc);
+      return true;
+    }
+    case BC_JUMP_IF_FALSE:
+      emitPeek(emitter);
+      emitJumpIfFalsey(emitter, jumpTargetOf(function, offset, length));
+      return true;
+    case BC_POP_JUMP_IF_FALSE:
+      emitPop(emitter);
+      emitJumpIfFalsey(emitter, jumpTargetOf(function, offset, length));
+      return true;
+  }
+
+  if (emitFastPath(emitter, offset, length)) {
+    return true;
+  }
+
+  JitHelper helper = helperFor(bc[0]);
+  if (helper != NULL) {
+    emitHelper(emitter, helper, offset, length);
+    return true;
+  }
+
+  helper = branchHelperFor(bc[0]);
+  if (helper != NULL) {
+    emitHelper(emitter, helper, offset, length);
+    EMIT(0x0f, 0x85); emitJumpTo(emitter, jumpTargetOf(function, offset, length)); // jnz
+    return true;
+  }
+
+  emitExit(emitter, bc);
+  return false;
+}
+
+static void emitPrologue(struct Emitter* emitter) {
+  // Three pushes keep the stack 16 byte aligned for the helper calls.
+  EMIT(0x53);                                // push rbx
+  EMIT(0x41, 0x54);                          // push r12
+  EMIT(0x41, 0x55);                          // push r13
+  EMIT(0x48, 0x89, 0xfb);                    // mov rbx, rdi
+  EMIT(0x49, 0x89, 0xf4);                    // mov r12, rsi
+  EMIT(0x4d, 0x8b, 0x6c, 0x24, FRAME_SLOTS); // mov r13, [r12 + slots]
+  EMIT(0xff, 0xe2);                          // jmp rdx
+
+  emitter->epilogue = emitter->count;
+  EMIT(0x41, 0x5d); // pop r13
+  EMIT(0x41, 0x5c); // pop r12
+  EMIT(0x5b);       // pop rbx
+  EMIT(0xc3);       // ret
+
+  emitter->error = emitter->count;
+  EMIT(0xb8); emit32(emitter, JIT_ERROR); // mov eax, JIT_ERROR
+  EMIT(0xe9); emitJumpBack(emitter, emitter->epilogue);
+}
+
+// Copies the finished code into its own executable pages.
+static u8* installCode(struct Emitter* emitter, size_t* size) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  *size = ((size_t)emitter->count + pageSize - 1) / pageSize * pageSize;
+
+  u8* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+
+  memcpy(code, emitter->code, emitter->count);
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+}
+
+// Whether the compiled function would run long enough between exits to
+// pay for entering it, see JIT_MIN_RUN.
+static bool worthEntering(struct Function* function, const bool* entered) {
+  s32 run = 0;
+  for (s32 offset = 0; offset < function->bcCount; offset += instructionLength(function, offset)) {
+    if (!entered[offset]) {
+      run = 0;
+      continue;
+    }
+    if (function->bc[offset] == BC_LOOP || ++run >= JIT_MIN_RUN) {
+      return true;
+    }
+  }
+  return JIT_MIN_RUN == 0;
+}
+
+struct JitCode* compileJit(struct State* H, struct Function* function) {
+  s32 count = function->bcCount;
+
+  struct Emitter emitter;
+  emitter.H = H;
+  emitter.function = function;
+  emitter.code = NULL;
+  emitter.count = 0;
+  emitter.capacity = 0;
+  emitter.native = ALLOCATE(H, s32, count);
+  // At most two jumps per instruction, for the falsey checks.
+  emitter.fixups = ALLOCATE(H, struct JumpFixup, count * 2);
+  emitter.fixupCount = 0;
+
+  bool* entered = ALLOCATE(H, bool, count);
+  for (s32 offset = 0; offset < count; offset++) {
+    entered[offset] = false;
+  }
+
+  emitPrologue(&emitter);
+  for (s32 offset = 0; offset < count; offset += instructionLength(function, offset)) {
+    emitter.native[offset] = emitter.count;
+    entered[offset] = emitInstruction(&emitter, offset);
+  }
+
+  for (s32 i = 0; i < emitter.fixupCount; i++) {
+    struct JumpFixup* fixup = &emitter.fixups[i];
+    patch32(&emitter, fixup->operand, emitter.native[fixup->target] - (fixup->operand + 4));
+  }
+
+  size_t size;
+  u8* code = worthEntering(function, entered) ? installCode(&emitter, &size) : NULL;
+
+  struct JitCode* jit = NULL;
+  if (code != NULL) {
+    jit = ALLOCATE(H, struct JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->entryCount = count;
+    jit->entries = ALLOCATE(H, u8*, count);
+    for (s32 offset = 0; offset < count; offset++) {
+      jit->entries[offset] = entered[offset] ? code + emitter.native[offset] : NULL;
+    }
+  }
+
+  FREE_ARRAY(H, u8, emitter.code, emitter.capacity);
+  FREE_ARRAY(H, s32, emitter.native, count);
+  FREE_ARRAY(H, struct JumpFixup, emitter.fixups, count * 2);
+  FREE_ARRAY(H, bool, entered, count);
+  return jit;
+}
+
+void freeJit(struct State* H, struct JitCode* jit) {
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(H, u8*, jit->entries, jit->entryCount);
+  FREE(H, struct JitCode, jit);
+}
+
+enum JitResult runJit(struct State* H, struct CallFrame* frame, u8* ip) {
+  struct Function* function = frame->closure->function;
+  JitEntry entry = (JitEntry)(void*)function->jit->code;
+  return entry(H, frame, function->jit->entries[ip - function->bc]);
+}
+
+// Tracing.
+
+// Where a number instruction finds its operands, as slots counted from the
+// frame's base. Stack forms read from below depth, the stack depth before
+// the instruction. A constant right operand is -1. Returns false for other
+// instructions.
+static bool numberOperandSlots(const u8* bc, s32 depth, s32* left, s32* right) {
+  u8 op = bc[0];
+  switch (op) {
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+      *left = depth - 2;
+      *right = depth - 1;
+      return true;
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      *left = bc[1];
+      *right = op == BC_ADD_LOCALS || op == BC_SUBTRACT_LOCALS ? bc[2] : -1;
+      return true;
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      *left = bc[2];
+      *right = op <= BC_DIVIDE_RR ? bc[3] : -1;
+      return true;
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+      *left = bc[1];
+      *right = op <= BC_JUMP_IF_NOT_LESSER_EQUAL_RR ? bc[2] : -1;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isTraceable(struct Function* function, s32 offset, s32 header) {
+  switch (function->bc[offset]) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_POP:
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+    case BC_SET_LOCAL_POP:
+    case BC_MOVE:
+    case BC_LOAD_CONSTANT:
+    case BC_JUMP:
+    case BC_JUMP_IF_FALSE:
+    case BC_POP_JUMP_IF_FALSE:
+      return true;
+    case BC_LOOP:
+      // Only the loop's own back edge, inner loops get traces of their own.
+      return jumpTargetOf(function, offset, instructionLength(function, offset)) == header;
+    default:
+      return helperFor(function->bc[offset]) != NULL
+          || branchHelperFor(function->bc[offset]) != NULL;
+  }
+}
+
+// Leaves the trace for run() at ip when the flags satisfy the condition
+// code cc, the second byte of a jcc rel32.
+static void emitExitIf(struct Emitter* emitter, u8 cc, const u8* ip) {
+  EMIT(0x0f, cc ^ 1); // the opposite jcc, over the exit
+  s32 skip = emitForward(emitter);
+  emitExit(emitter, ip);
+  landHere(emitter, skip);
+}
+
+#define JCC_EQUAL 0x84
+#define JCC_NOT_EQUAL 0x85
+#define JCC_ABOVE_EQUAL 0x83
+#define JCC_ABOVE 0x87
+
+struct TraceCompiler {
+  struct Emitter* emitter;
+  struct Recorder* recorder;
+  // Which slots, locals and temporaries alike, hold numbers at this point
+  // of the trace. Anything not known to is guarded before use.
+  bool* known;
+  s32 knownCount;
+  s32 depth;
+  s32 loopStart;
+};
+
+static s32 nextOffsetOf(struct Recorder* recorder, s32 step) {
+  return step + 1 < recorder->stepCount ? recorder->steps[step + 1].offset : recorder->header;
+}
+
+// Emits a number instruction specialized to number operands, some of them
+// already known to be numbers. Returns false if it couldn't.
+static bool emitTraceNumbers(struct TraceCompiler* compiler, s32 step) {
+  struct Emitter* emitter = compiler->emitter;
+  struct Function* function = emitter->function;
+  struct TraceStep* traceStep = &compiler->recorder->steps[step];
+  s32 offset = traceStep->offset;
+  s32 length = instructionLength(function, offset);
+  u8* bc = function->bc + offset;
+  bool* known = compiler->known;
+
+  s32 left, right;
+  if (traceStep->numbers != (GUARD_LEFT | GUARD_RIGHT)
+      || !numberOperandSlots(bc, compiler->depth, &left, &right)) {
+    return false;
+  }
+
+  u8 guards = 0;
+  if (!known[left]) guards |= GUARD_LEFT;
+  if (right >= 0 && !known[right]) guards |= GUARD_RIGHT;
+
+  s32 start = emitter->count;
+  emitter->slowCount = 0;
+  emitLoadQnan(emitter);
+  if (!emitNumberOperands(emitter, bc, guards)) {
+    emitter->count = start;
+    emitter->slowCount = 0;
+    return false;
+  }
+  u8 op = bc[0];
+  if (isNumberBranch(op)) {
+    enum Comparison comparison = emitNumberBranch(emitter, bc);
+    u8 holds = isInclusive(comparison) ? JCC_ABOVE_EQUAL : JCC_ABOVE;
+    s32 target = jumpTargetOf(function, offset, length);
+    if (nextOffsetOf(compiler->recorder, step) == target) {
+      emitExitIf(emitter, holds, bc + length);
+    } else {
+      emitExitIf(emitter, holds ^ 1, function->bc + target);
+    }
+  } else {
+    emitNumberResult(emitter, bc);
+  }
+
+  if (emitter->slowCount > 0) {
+    s32 done = beginSlowPath(emitter);
+    emitExit(emitter, bc);
+    landHere(emitter, done);
+  }
+
+  compiler->depth += stackEffect(function, offset);
+  enum Comparison comparison;
+  if (op >= BC_ADD_RR && op <= BC_DIVIDE_RK) {
+    known[bc[1]] = true;
+  } else if (!isNumberBranch(op)) {
+    known[compiler->depth - 1] = !comparisonOf(op, &comparison);
+  }
+  return true;
+}
+
+static bool emitTraceStep(struct TraceCompiler* compiler, s32 step) {
+  struct Emitter* emitter = compiler->emitter;
+  struct Function* function = emitter->function;
+  s32 offset = compiler->recorder->steps[step].offset;
+  s32 length = instructionLength(function, offset);
+  u8* bc = function->bc + offset;
+  bool* known = compiler->known;
+
+  // Room for the push of any one instruction.
+  if (compiler->depth < 0 || compiler->depth >= compiler->knownCount) {
+    return false;
+  }
+
+  switch (bc[0]) {
+    case BC_CONSTANT:
+      emitLoadValue(emitter, function->constants.values[bc[1]]);
+      emitPush(emitter);
+      known[compiler->depth++] = IS_DOUBLE(function->constants.values[bc[1]]);
+      return true;
+    case BC_NIL:   emitLoadValue(emitter, NEW_NIL); break;
+    case BC_TRUE:  emitLoadValue(emitter, NEW_TRUE); break;
+    case BC_FALSE: emitLoadValue(emitter, NEW_FALSE); break;
+    case BC_POP:
+      EMIT(0x48, 0x83, 0xab); emit32(emitter, STACK_TOP); emit8(emitter, 0x08); // sub qword [rbx + stackTop], 8
+      compiler->depth--;
+      return true;
+    case BC_GET_LOCAL:
+      emitLoadSlot(emitter, bc[1]);
+      emitPush(emitter);
+      known[compiler->depth] = known[bc[1]];
+      compiler->depth++;
+      return true;
+    case BC_SET_LOCAL:
+      emitPeek(emitter);
+      emitStoreSlot(emitter, bc[1]);
+      known[bc[1]] = known[compiler->depth - 1];
+      return true;
+    case BC_SET_LOCAL_POP:
+      emitPop(emitter);
+      emitStoreSlot(emitter, bc[1]);
+      known[bc[1]] = known[--compiler->depth];
+      return true;
+    case BC_MOVE:
+      emitLoadSlot(emitter, bc[2]);
+      emitStoreSlot(emitter, bc[1]);
+      known[bc[1]] = known[bc[2]];
+      return true;
+    case BC_LOAD_CONSTANT:
+      emitLoadValue(emitter, function->constants.values[bc[2]]);
+      emitStoreSlot(emitter, bc[1]);
+      known[bc[1]] = IS_DOUBLE(function->constants.values[bc[2]]);
+      return true;
+    case BC_JUMP:
+      return true;
+    case BC_LOOP:
+      EMIT(0xe9); emitJumpBack(emitter, compiler->loopStart);
+      return true;
+    case BC_JUMP_IF_FALSE:
+    case BC_POP_JUMP_IF_FALSE: {
+      if (bc[0] == BC_JUMP_IF_FALSE) {
+        emitPeek(emitter);
+      } else {
+        emitPop(emitter);
+        compiler->depth--;
+      }
+
+      s32 target = jumpTargetOf(function, offset, length);
+      if (nextOffsetOf(compiler->recorder, step) == target) {
+        EMIT(0x48, 0xba); emit64(emitter, NEW_FALSE); // mov rdx, imm64
+        EMIT(0x48, 0x39, 0xd1);                       // cmp rcx, rdx
+        EMIT(0x0f, JCC_EQUAL);                        // je falsey
+        s32 falsey = emitForward(emitter);
+        EMIT(0x48, 0xba); emit64(emitter, NEW_NIL);
+        EMIT(0x48, 0x39, 0xd1);
+        emitExitIf(emitter, JCC_NOT_EQUAL, bc + length);
+        landHere(emitter, falsey);
+      } else {
+        EMIT(0x48, 0xba); emit64(emitter, NEW_FALSE);
+        EMIT(0x48, 0x39, 0xd1);
+        emitExitIf(emitter, JCC_EQUAL, function->bc + target);
+        EMIT(0x48, 0xba); emit64(emitter, NEW_NIL);
+        EMIT(0x48, 0x39, 0xd1);
+        emitExitIf(emitter, JCC_EQUAL, function->bc + target);
+      }
+      return true;
+    }
+    default:
+      if (emitTraceNumbers(compiler, step)) {
+        return true;
+      }
+
+      if (bc[0] == BC_GET_GLOBAL) {
+        emitFastPath(emitter, offset, length);
+      } else if (helperFor(bc[0]) != NULL) {
+        emitHelper(emitter, helperFor(bc[0]), offset, length);
+      } else if (branchHelperFor(bc[0]) != NULL) {
+        emitHelper(emitter, branchHelperFor(bc[0]), offset, length);
+        s32 target = jumpTargetOf(function, offset, length);
+        if (nextOffsetOf(compiler->recorder, step) == target) {
+          emitExitIf(emitter, JCC_EQUAL, bc + length);
+        } else {
+          emitExitIf(emitter, JCC_NOT_EQUAL, function->bc + target);
+        }
+        compiler->depth += stackEffect(function, offset);
+        if (bc[0] == BC_FOR_LOOP) {
+          known[bc[1]] = false;
+        } else if (bc[0] == BC_FOR_IN_LOOP) {
+          known[bc[1] + 1] = false;
+          known[bc[1] + 2] = false;
+        }
+        return true;
+      } else {
+        return false;
+      }
+
+      // Whatever a helper leaves behind has to be checked again.
+      compiler->depth += stackEffect(function, offset);
+      if (compiler->depth > 0) {
+        known[compiler->depth - 1] = false;
+      }
+      if (bc[0] >= BC_ADD_RR && bc[0] <= BC_DIVIDE_RK) {
+        known[bc[1]] = false;
+      }
+      return true;
+  }
+
+  // nil, true and false.
+  emitPush(emitter);
+  known[compiler->depth++] = false;
+  return true;
+}
+
+// Emits the whole trace, assuming the slots flagged in entryKnown hold
+// numbers at the loop header. Leaves what's known when it loops back in
+// known. Returns false if some step can't be compiled.
+static bool emitTrace(struct TraceCompiler* compiler, const bool* entryKnown) {
+  struct Emitter* emitter = compiler->emitter;
+  struct Recorder* recorder = compiler->recorder;
+  const u8* header = emitter->function->bc + recorder->header;
+
+  // Ints are turned into doubles on the way in, the trace computes in
+  // doubles only.
+  emitLoadQnan(emitter);
+  for (s32 slot = 0; slot < recorder->depth; slot++) {
+    compiler->known[slot] = entryKnown[slot];
+    if (entryKnown[slot]) {
+      s32 disp = slot * (s32)sizeof(Value);
+      EMIT(0x49, 0x8b, 0x85); emit32(emitter, disp); // mov rax, [r13 + slot * 8]
+      emitTestDouble(emitter);
+      s32 isDouble = emitShortForward(emitter, 0x75); // jne isDouble
+      emitTestInt(emitter);
+      emitExitIf(emitter, JCC_NOT_EQUAL, header);
+      EMIT(0xf2, 0x0f, 0x2a, 0xc0);                  // cvtsi2sd xmm0, eax
+      EMIT(0x66, 0x41, 0x0f, 0xd6, 0x85); emit32(emitter, disp); // movq [r13 + slot * 8], xmm0
+      landShort(emitter, isDouble);
+    }
+  }
+
+  compiler->loopStart = emitter->count;
+  compiler->depth = recorder->depth;
+  for (s32 step = 0; step < recorder->stepCount; step++) {
+    if (!emitTraceStep(compiler, step)) {
+      return false;
+    }
+  }
+  return compiler->depth == recorder->depth;
+}
+
+static struct Trace* compileTrace(struct State* H, struct Recorder* recorder) {
+  struct Function* function = recorder->function;
+
+  struct Emitter emitter;
+  emitter.H = H;
+  emitter.function = function;
+  emitter.code = NULL;
+  emitter.count = 0;
+  emitter.capacity = 0;
+  // Traces only jump within code they've already emitted.
+  emitter.native = NULL;
+  emitter.fixups = NULL;
+  emitter.fixupCount = 0;
+  emitter.slowCount = 0;
+
+  struct TraceCompiler compiler;
+  compiler.emitter = &emitter;
+  compiler.recorder = recorder;
+  compiler.knownCount = function->maxStack > U8_COUNT ? function->maxStack : U8_COUNT;
+  compiler.known = ALLOCATE(H, bool, compiler.knownCount);
+
+  bool entryKnown[U8_COUNT];
+  for (s32 slot = 0; slot < recorder->depth; slot++) {
+    entryKnown[slot] = recorder->numbers[slot];
+  }
+
+  // The code after the loop start relies on what's known there, so a slot
+  // only counts as known on entry if it still is when the trace loops.
+  emitPrologue(&emitter);
+  s32 start = emitter.count;
+  bool compiled;
+  bool changed;
+  do {
+    emitter.count = start;
+    compiled = emitTrace(&compiler, entryKnown);
+    changed = false;
+    for (s32 slot = 0; compiled && slot < recorder->depth; slot++) {
+      if (entryKnown[slot] && !compiler.known[slot]) {
+        entryKnown[slot] = false;
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  struct Trace* trace = NULL;
+  if (compiled) {
+    size_t size;
+    u8* code = installCode(&emitter, &size);
+    if (code != NULL) {
+      trace = ALLOCATE(H, struct Trace, 1);
+      trace->code = code;
+      trace->size = size;
+      trace->entry = code + start;
+      trace->depth = recorder->depth;
+    }
+  }
+
+  FREE_ARRAY(H, u8, emitter.code, emitter.capacity);
+  FREE_ARRAY(H, bool, compiler.known, compiler.knownCount);
+  return trace;
+}
+
+static enum JitResult runTrace(struct State* H, struct CallFrame* frame, struct Trace* trace) {
+  JitEntry entry = (JitEntry)(void*)trace->code;
+  return entry(H, frame, trace->entry);
+}
+
+static void startRecording(struct State* H, struct CallFrame* frame, struct HotLoop* loop) {
+  s32 depth = (s32)(H->stackTop - frame->slots);
+  if (depth > U8_COUNT) {
+    loop->watched = false;
+    return;
+  }
+
+  struct Recorder* recorder = ALLOCATE(H, struct Recorder, 1);
+  recorder->function = frame->closure->function;
+  recorder->loop = loop;
+  recorder->frameCount = H->frameCount;
+  recorder->header = (s32)(frame->ip - recorder->function->bc);
+  recorder->depth = depth;
+  for (s32 slot = 0; slot < depth; slot++) {
+    recorder->numbers[slot] = IS_NUMBER(frame->slots[slot]);
+  }
+  recorder->stepCount = 0;
+  H->recorder = recorder;
+}
+
+void stopRecording(struct State* H) {
+  if (H->recorder != NULL) {
+    FREE(H, struct Recorder, H->recorder);
+    H->recorder = NULL;
+  }
+}
+
+// Gives up on a loop for good.
+static void abandonLoop(struct State* H) {
+  H->recorder->loop->watched = false;
+  stopRecording(H);
+}
+
+enum JitResult jitLoop(struct State* H, struct CallFrame* frame, u16 jump) {
+  struct Function* function = frame->closure->function;
+  // frame->ip is past the BC_LOOP and its 16 bit jump.
+  s32 offset = (s32)(frame->ip - function->bc) - 3;
+  frame->ip -= jump;
+
+  if (H->recorder != NULL) {
+    return JIT_EXIT;
+  }
+
+  struct HotLoop* loop = findLoop(H, function, offset);
+  if (loop->trace != NULL) {
+    // Unless something left a temporary behind, like a for loop's.
+    if (H->stackTop - frame->slots != loop->trace->depth) {
+      return JIT_EXIT;
+    }
+    return runTrace(H, frame, loop->trace);
+  }
+
+  if (loop->watched && ++loop->hotness >= TRACE_THRESHOLD) {
+    startRecording(H, frame, loop);
+  }
+  return JIT_EXIT;
+}
+
+void recordInstruction(struct State* H, struct CallFrame* frame, u8* ip) {
+  struct Recorder* recorder = H->recorder;
+  struct Function* function = frame->closure->function;
+  if (H->frameCount != recorder->frameCount || function != recorder->function) {
+    abandonLoop(H);
+    return;
+  }
+
+  s32 offset = (s32)(ip - function->bc);
+  if (offset == recorder->header && recorder->stepCount > 0) {
+    recorder->loop->trace = compileTrace(H, recorder);
+    if (recorder->loop->trace == NULL) {
+      abandonLoop(H);
+    } else {
+      stopRecording(H);
+    }
+    return;
+  }
+
+  // Left the loop before getting back around, try again another time.
+  if (offset < recorder->header || offset > recorder->loop->offset) {
+    recorder->loop->hotness = 0;
+    stopRecording(H);
+    return;
+  }
+
+  if (recorder->stepCount == TRACE_MAX || !isTraceable(function, offset, recorder->header)) {
+    abandonLoop(H);
+    return;
+  }
+
+  struct TraceStep* step = &recorder->steps[recorder->stepCount++];
+  step->offset = offset;
+  step->numbers = 0;
+  s32 left, right;
+  if (numberOperandSlots(ip, (s32)(H->stackTop - frame->slots), &left, &right)) {
+    if (IS_NUMBER(frame->slots[left])) step->numbers |= GUARD_LEFT;
+    if (right < 0 || IS_NUMBER(frame->slots[right])) step->numbers |= GUARD_RIGHT;
+  }
+}
+
+void freeLoops(struct State* H, struct Function* function) {
+  for (s32 i = 0; i < function->loopCount; i++) {
+    struct Trace* trace = function->loops[i].trace;
+    if (trace != NULL) {
+      munmap(trace->code, trace->size);
+      FREE(H, struct Trace, trace);
+    }
+  }
+  FREE_ARRAY(H, struct HotLoop, function->loops, function->loopCount);
+}
+
+#undef JCC_EQUAL
+#undef JCC_NOT_EQUAL
+#undef JCC_ABOVE_EQUAL
+#undef JCC_ABOVE
+
+#undef EMIT
+#undef JIT_SHORT
+
+#endif
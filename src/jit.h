@@ -0,0 +1,130 @@
+#ifndef _HOBBYL_JIT_H
+#define _HOBBYL_JIT_H
+
+#include "common.h"
+#include "object.h"
+
+#ifdef JIT
+
+// Baseline JIT. A function that has been called JIT_THRESHOLD times gets
+// its bytecode translated to x86-64, one template per instruction. The
+// templates keep the VM's stack and frame layout, so run() can hand a
+// frame to the machine code at any supported instruction and take it
+// back at any other. Calls, returns and the rarer instructions always go
+// back through run().
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+// Entering and leaving the machine code costs about as much as running a
+// few instructions in run(). A function without loops is only compiled
+// when it has a stretch of at least JIT_MIN_RUN instructions the templates
+// run without going back, or else a call-heavy function like fib would
+// pay that cost between every pair of calls and get slower.
+#ifndef JIT_MIN_RUN
+#define JIT_MIN_RUN 8
+#endif
+
+enum JitResult {
+  JIT_EXIT,  // frame->ip is the next instruction for run() to execute.
+  JIT_ERROR, // A runtime error has already been reported.
+};
+
+// Slow paths called from the templates. They decode their operands from
+// the instruction at bc and return JIT_HELPER_ERROR after reporting a
+// runtime error. Branching helpers return 1 when the jump is taken.
+#define JIT_HELPER_ERROR -1
+typedef s32 (*JitHelper)(struct State* H, struct CallFrame* frame, const u8* bc);
+
+struct JitCode {
+  u8* code;
+  size_t size;
+  // Bytecode offset -> machine code for that instruction, or NULL where
+  // run() can't enter (mid-instruction offsets and unsupported opcodes).
+  u8** entries;
+  s32 entryCount;
+};
+
+// Returns NULL when the function can't be compiled or isn't worth it.
+struct JitCode* compileJit(struct State* H, struct Function* function);
+void freeJit(struct State* H, struct JitCode* jit);
+enum JitResult runJit(struct State* H, struct CallFrame* frame, u8* ip);
+
+// Tracing. Every BC_LOOP counts how often it jumps back. Once a loop is
+// hot, run() shows the recorder each instruction of the next iteration
+// along with its operands. The recorded path is compiled on its own,
+// specialized to the number operands it saw: guards check those once and
+// the rest of the trace relies on them. A guard that fails, or a branch
+// going the other way, leaves the trace for run() at that instruction.
+
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 50
+#endif
+#define TRACE_MAX 256
+
+struct Trace {
+  u8* code;
+  size_t size;
+  u8* entry;
+  s32 depth; // Stack depth at the loop header, from the frame's slots.
+};
+
+struct HotLoop {
+  s32 offset; // Of the BC_LOOP instruction.
+  s32 hotness;
+  // Whether the back edge goes through run(), to be counted or to enter
+  // the trace. Baseline code reads it, and keeps the jump to itself once
+  // the loop turns out not to be traceable.
+  bool watched;
+  struct Trace* trace;
+};
+
+struct TraceStep {
+  s32 offset;
+  u8 numbers; // Which of the number operands held numbers.
+};
+
+struct Recorder {
+  struct Function* function;
+  struct HotLoop* loop;
+  s32 frameCount;
+  s32 header;
+  s32 depth;
+  bool numbers[U8_COUNT]; // Which slots held numbers at the loop header.
+  s32 stepCount;
+  struct TraceStep steps[TRACE_MAX];
+};
+
+enum JitResult jitLoop(struct State* H, struct CallFrame* frame, u16 jump);
+void recordInstruction(struct State* H, struct CallFrame* frame, u8* ip);
+void stopRecording(struct State* H);
+void freeLoops(struct State* H, struct Function* function);
+
+s32 jitArithmetic(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitEquality(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitConcat(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitNegate(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitNot(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitCompareJump(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitLocalArithmetic(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitRegisterArithmetic(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitRegisterCompareJump(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitForPrep(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitForLoop(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitForInPrep(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitForInLoop(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitCalleeGuard(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitGetGlobal(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitSetGlobal(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitGetUpvalue(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitSetUpvalue(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitGetProperty(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitSetProperty(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitGetSelfField(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitSetSelfField(struct State* H, struct CallFrame* frame, const u8* bc);
+s32 jitGetSubscript(struct State* H, struct CallFrame* frame, const u8* bc);
+
+#endif
+
+#endif // _HOBBYL_JIT_H
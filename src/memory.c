@@ -10,6 +10,7 @@
 
 #include "object.h"
 #include "compiler.h"
+#include "jit.h"
 #include "table.h"
 
 #define GC_HEAP_GROW_FACTOR 2
@@ -58,7 +59,8 @@ static void freeObject(struct State* H, struct Obj* object) {
     }
     case OBJ_STRUCT: {
       struct Struct* strooct = (struct Struct*)object;
-      freeTable(H, &strooct->defaultFields);
+      freeTable(H, &strooct->fields);
+      freeValueArray(H, &strooct->defaultFields);
       freeTable(H, &strooct->methods);
       freeTable(H, &strooct->staticMethods);
       FREE(H, struct Struct, object);
@@ -66,14 +68,14 @@ static void freeObject(struct State* H, struct Obj* object) {
     }
     case OBJ_INSTANCE: {
       struct Instance* instance = (struct Instance*)object;
-      freeTable(H, &instance->fields);
-      FREE(H, struct Instance, object);
+      reallocate(
+          H, object,
+          sizeof(struct Instance) + sizeof(Value) * instance->fieldCount, 0);
       break;
     }
     case OBJ_CLOSURE: {
       struct Closure* closure = (struct Closure*)object;
-      FREE_ARRAY(
-          H, struct Upvalue*, closure->upvalues, closure->upvalueCount);
+      FREE_ARRAY(H, Value, closure->upvalues, closure->upvalueCount);
       FREE(H, struct Closure, object);
       break;
     }
@@ -85,6 +87,17 @@ static void freeObject(struct State* H, struct Obj* object) {
       struct Function* function = (struct Function*)object;
       FREE_ARRAY(H, u8, function->bc, function->bcCapacity);
       FREE_ARRAY(H, s32, function->lines, function->bcCapacity);
+      FREE_ARRAY(H, struct InlinedLine, function->inlinedLines,
+          function->inlinedLineCapacity);
+      if (function->caches != NULL) {
+        FREE_ARRAY(H, struct InlineCache, function->caches, function->cacheCount);
+      }
+#ifdef JIT
+      if (function->jit != NULL) {
+        freeJit(H, function->jit);
+      }
+      freeLoops(H, function);
+#endif
       freeValueArray(H, &function->constants);
       FREE(H, struct Function, object);
       break;
@@ -166,6 +179,16 @@ static void blackenObject(struct State* H, struct Obj* object) {
       struct Function* function = (struct Function*)object;
       markObject(H, (struct Obj*)function->name);
       markArray(H, &function->constants);
+      for (s32 i = 0; i < function->inlinedLineCount; i++) {
+        markObject(H, (struct Obj*)function->inlinedLines[i].function);
+      }
+      for (s32 i = 0; function->caches != NULL && i < function->cacheCount; i++) {
+        struct InlineCache* cache = &function->caches[i];
+        for (s32 j = 0; j < cache->count; j++) {
+          markObject(H, (struct Obj*)cache->entries[j].strooct);
+          markObject(H, (struct Obj*)cache->entries[j].method);
+        }
+      }
       break;
     }
     case OBJ_BOUND_METHOD: {
@@ -178,14 +201,15 @@ static void blackenObject(struct State* H, struct Obj* object) {
       struct Closure* closure = (struct Closure*)object;
       markObject(H, (struct Obj*)closure->function);
       for (s32 i = 0; i < closure->upvalueCount; i++) {
-        markObject(H, (struct Obj*)closure->upvalues[i]);
+        markValue(H, closure->upvalues[i]);
       }
       break;
     }
     case OBJ_STRUCT: {
       struct Struct* strooct = (struct Struct*)object;
       markObject(H, (struct Obj*)strooct->name);
-      markTable(H, &strooct->defaultFields);
+      markTable(H, &strooct->fields);
+      markArray(H, &strooct->defaultFields);
       markTable(H, &strooct->methods);
       markTable(H, &strooct->staticMethods);
       break;
@@ -193,7 +217,10 @@ static void blackenObject(struct State* H, struct Obj* object) {
     case OBJ_INSTANCE: {
       struct Instance* instance = (struct Instance*)object;
       markObject(H, (struct Obj*)instance->strooct);
-      markTable(H, &instance->fields);
+      markObject(H, (struct Obj*)instance->bound);
+      for (s32 i = 0; i < instance->fieldCount; i++) {
+        markValue(H, instance->fields[i]);
+      }
       break;
     }
     case OBJ_ENUM: {
@@ -225,7 +252,9 @@ static void markRoots(struct State* H) {
     markObject(H, (struct Obj*)upvalue);
   }
 
-  markTable(H, &H->globals);
+  markTable(H, &H->globalSlots);
+  markArray(H, &H->globalNames);
+  markArray(H, &H->globalValues);
   markCompilerRoots(H, H->parser);
 }
 
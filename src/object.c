@@ -51,25 +51,30 @@ struct Struct* newStruct(struct State* H, struct String* name) {
   struct Struct* strooct = ALLOCATE_OBJ(H, struct Struct, OBJ_STRUCT);
 
   strooct->name = name;
-  initTable(&strooct->defaultFields);
+  initTable(&strooct->fields);
+  initValueArray(&strooct->defaultFields);
   initTable(&strooct->methods);
   initTable(&strooct->staticMethods);
   return strooct;
 }
 
 struct Instance* newInstance(struct State* H, struct Struct* strooct) {
-  struct Instance* instance = ALLOCATE_OBJ(H, struct Instance, OBJ_INSTANCE);
+  s32 fieldCount = strooct->defaultFields.count;
+  struct Instance* instance = (struct Instance*)allocateObject(
+      H, sizeof(struct Instance) + sizeof(Value) * fieldCount, OBJ_INSTANCE);
   instance->strooct = strooct;
-  initTable(&instance->fields);
-  copyTable(H, &instance->fields, &strooct->defaultFields);
+  instance->fieldCount = fieldCount;
+  instance->bound = NULL;
+  for (s32 i = 0; i < fieldCount; i++) {
+    instance->fields[i] = strooct->defaultFields.values[i];
+  }
   return instance;
 }
 
 struct Closure* newClosure(struct State* H, struct Function* function) {
-  struct Upvalue** upvalues = ALLOCATE(
-      H, struct Upvalue*, function->upvalueCount);
+  Value* upvalues = ALLOCATE(H, Value, function->upvalueCount);
   for (s32 i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
+    upvalues[i] = NEW_NIL;
   }
 
   struct Closure* closure = ALLOCATE_OBJ(H, struct Closure, OBJ_CLOSURE);
@@ -97,15 +102,38 @@ struct Function* newFunction(struct State* H) {
   function->bcCapacity = 0;
   function->bc = NULL;
   function->lines = NULL;
+  function->inlinedLineCount = 0;
+  function->inlinedLineCapacity = 0;
+  function->inlinedLines = NULL;
+  function->maxStack = 0;
+#ifdef JIT
+  function->callCount = 0;
+  function->jit = NULL;
+  function->loopCount = 0;
+  function->loops = NULL;
+#endif
+  function->cacheCount = 0;
+  function->caches = NULL;
   initValueArray(&function->constants);
 
   return function;
 }
 
-struct CFunctionBinding* newCFunctionBinding(struct State* H, CFunction cFunc) {
+void initInlineCaches(struct State* H, struct Function* function) {
+  function->caches = ALLOCATE(H, struct InlineCache, function->cacheCount);
+  for (s32 i = 0; i < function->cacheCount; i++) {
+    function->caches[i].count = 0;
+    function->caches[i].megamorphic = false;
+  }
+}
+
+struct CFunctionBinding* newCFunctionBinding(
+    struct State* H, CFunction cFunc, s32 arity, s32 resultCount) {
   struct CFunctionBinding* cFunction = ALLOCATE_OBJ(
       H, struct CFunctionBinding, OBJ_CFUNCTION);
   cFunction->cFunc = cFunc;
+  cFunction->arity = arity;
+  cFunction->resultCount = resultCount;
   return cFunction;
 }
 
@@ -174,6 +202,67 @@ s32 addFunctionConstant(
   return function->constants.count - 1;
 }
 
+static s32 findInlinedLine(
+    struct State* H, struct Function* function,
+    struct Function* from, s32 line, s32 callLine) {
+  for (s32 i = 0; i < function->inlinedLineCount; i++) {
+    struct InlinedLine* existing = &function->inlinedLines[i];
+    if (existing->function == from && existing->line == line
+        && existing->callLine == callLine) {
+      return -i - 1;
+    }
+  }
+
+  if (function->inlinedLineCapacity < function->inlinedLineCount + 1) {
+    s32 oldCapacity = function->inlinedLineCapacity;
+    function->inlinedLineCapacity = GROW_CAPACITY(oldCapacity);
+    function->inlinedLines = GROW_ARRAY(H, struct InlinedLine,
+        function->inlinedLines, oldCapacity, function->inlinedLineCapacity);
+  }
+
+  struct InlinedLine* added = &function->inlinedLines[function->inlinedLineCount++];
+  added->function = from;
+  added->line = line;
+  added->callLine = callLine;
+  return -function->inlinedLineCount;
+}
+
+// Brings a line of callee's over into function's table. A line of the
+// callee's own code becomes one inlined at callLine, one the callee got
+// from inlining keeps where it came from, with its call lines brought
+// over in turn.
+static s32 moveInlinedLine(
+    struct State* H, struct Function* function,
+    struct Function* callee, s32 line, bool isCalleeCode, s32 callLine) {
+  if (line >= 0) {
+    return isCalleeCode
+        ? findInlinedLine(H, function, callee, line, callLine)
+        : line;
+  }
+
+  struct InlinedLine inner = callee->inlinedLines[-line - 1];
+  s32 innerLine = moveInlinedLine(H, function, callee, inner.line, false, callLine);
+  s32 innerCallLine = moveInlinedLine(
+      H, function, callee, inner.callLine, isCalleeCode, callLine);
+  return findInlinedLine(H, function, inner.function, innerLine, innerCallLine);
+}
+
+// The line to give code from callee at line when it is inlined into
+// function at callLine.
+s32 addInlinedLine(
+    struct State* H, struct Function* function,
+    struct Function* callee, s32 line, s32 callLine) {
+  return moveInlinedLine(H, function, callee, line, true, callLine);
+}
+
+// The line in function's own source that line belongs to.
+s32 outermostLine(struct Function* function, s32 line) {
+  while (line < 0) {
+    line = function->inlinedLines[-line - 1].callLine;
+  }
+  return line;
+}
+
 static void printFunction(struct Function* function) {
   if (function->name == NULL) {
     printf("<script>");
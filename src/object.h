@@ -16,10 +16,11 @@
 #define IS_INSTANCE(value)     isObjOfType(value, OBJ_INSTANCE)
 #define IS_ENUM(value)         isObjOfType(value, OBJ_ENUM)
 #define IS_ARRAY(value)        isObjOfType(value, OBJ_ARRAY)
+#define IS_UPVALUE(value)      isObjOfType(value, OBJ_UPVALUE)
 
 #define AS_CLOSURE(value)      ((struct Closure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((struct Function*)AS_OBJ(value))
-#define AS_CFUNCTION(value)    (((struct CFunctionBinding*)AS_OBJ(value))->cFunc)
+#define AS_CFUNCTION(value)    ((struct CFunctionBinding*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((struct BoundMethod*)AS_OBJ(value))
 #define AS_STRING(value)       ((struct String*)AS_OBJ(value))
 #define AS_CSTRING(value)      (AS_STRING(value)->chars)
@@ -27,6 +28,7 @@
 #define AS_INSTANCE(value)     ((struct Instance*)AS_OBJ(value))
 #define AS_ENUM(value)         ((struct Enum*)AS_OBJ(value))
 #define AS_ARRAY(value)        ((struct Array*)AS_OBJ(value))
+#define AS_UPVALUE(value)      ((struct Upvalue*)AS_OBJ(value))
 
 enum ObjType {
   OBJ_CLOSURE,
@@ -48,26 +50,45 @@ enum ObjType {
 #define TAG_NIL   1
 #define TAG_FALSE 2
 #define TAG_TRUE  3
+#define TAG_UNDEFINED 4
+// Numbers that fit in 32 bits are kept as ints in the low half of the
+// payload, marked with this bit above it. They're still just numbers to
+// scripts: IS_NUMBER and AS_NUMBER take either kind.
+#define INT_TAG ((u64)0x0002000000000000)
 
 typedef u64 Value;
 
 #define IS_BOOL(value)     (((value) | 1) == NEW_TRUE)
 #define IS_NIL(value)      ((value) == NEW_NIL)
-#define IS_NUMBER(value)   (((value) & QNAN) != QNAN)
+#define IS_UNDEFINED(value) ((value) == NEW_UNDEFINED)
+#define IS_DOUBLE(value)   (((value) & QNAN) != QNAN)
+// Object pointers fit in 48 bits, so they never have INT_TAG set.
+#define IS_INT(value)      (((value) & (QNAN | INT_TAG)) == (QNAN | INT_TAG))
+#define IS_NUMBER(value)   (IS_DOUBLE(value) || IS_INT(value))
+// Tests both operands of an arithmetic instruction at once.
+#define ARE_INTS(a, b)     IS_INT((a) & (b))
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)     ((value) == NEW_TRUE)
+#define AS_INT(value)      ((s32)(u32)(value))
 #define AS_NUMBER(value)   valueToNumber(value)
 #define AS_OBJ(value) ((struct Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define NEW_FALSE          ((Value)(u64)(QNAN | TAG_FALSE))
 #define NEW_TRUE           ((Value)(u64)(QNAN | TAG_TRUE))
 #define NEW_NIL            ((Value)(u64)(QNAN | TAG_NIL))
+// Marks a global slot that has been referenced but not defined yet. Scripts
+// never see it.
+#define NEW_UNDEFINED      ((Value)(u64)(QNAN | TAG_UNDEFINED))
 #define NEW_BOOL(boolean)  (boolean ? NEW_TRUE : NEW_FALSE)
+#define NEW_INT(integer)   ((Value)(QNAN | INT_TAG | (u64)(u32)(integer)))
 #define NEW_NUMBER(number) numberToValue(number)
 #define NEW_OBJ(obj) (Value)(SIGN_BIT | QNAN | (u64)(uintptr_t)(obj))
 
 static inline f64 valueToNumber(Value value) {
+  if (IS_INT(value)) {
+    return AS_INT(value);
+  }
   f64 number;
   memcpy(&number, &value, sizeof(Value));
   return number;
@@ -86,6 +107,7 @@ enum ValueType {
   VALTYPE_NIL,
   VALTYPE_NUMBER,
   VALTYPE_OBJ,
+  VALTYPE_UNDEFINED,
 };
 
 typedef struct {
@@ -99,15 +121,22 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VALTYPE_BOOL)
 #define IS_NIL(value)     ((value).type == VALTYPE_NIL)
+#define IS_UNDEFINED(value) ((value).type == VALTYPE_UNDEFINED)
 #define IS_NUMBER(value)  ((value).type == VALTYPE_NUMBER)
+#define IS_DOUBLE(value)  IS_NUMBER(value)
+#define IS_INT(value)     false
+#define ARE_INTS(a, b)    false
 #define IS_OBJ(value)     ((value).type == VALTYPE_OBJ)
 
 #define AS_BOOL(value)    ((value).as.boolean)
+#define AS_INT(value)     ((s32)(value).as.number)
 #define AS_NUMBER(value)  ((value).as.number)
 #define AS_OBJ(value)     ((value).as.obj)
 
 #define NEW_BOOL(value)   ((struct Value){VALTYPE_BOOL, {.boolean = value}})
 #define NEW_NIL           ((struct Value){VALTYPE_NIL, {.number = 0}})
+#define NEW_UNDEFINED     ((struct Value){VALTYPE_UNDEFINED, {.number = 0}})
+#define NEW_INT(value)    NEW_NUMBER((f64)(value))
 #define NEW_NUMBER(value) ((struct Value){VALTYPE_NUMBER, {.number = value}})
 #define NEW_OBJ(value)    ((struct Value){VALTYPE_OBJ, {.obj = (struct Obj*)value}})
 
@@ -119,8 +148,15 @@ struct ValueArray {
   Value* values;
 };
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * U8_COUNT)
+// The stack and the frame array start small and grow on demand. FRAMES_MAX
+// only exists to turn runaway recursion into an error.
+#define FRAMES_MAX 65536
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+#define STACK_SLACK 8
+// A runtime error prints at most this many frames from either end of the
+// trace, so a stack overflow doesn't print tens of thousands of them.
+#define TRACE_FRAMES 16
 
 struct Entry {
   struct String* key;
@@ -140,12 +176,19 @@ struct CallFrame {
 };
 
 struct State {
-  struct CallFrame frames[FRAMES_MAX];
+  struct CallFrame* frames;
   s32 frameCount;
+  s32 frameCapacity;
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
-  struct Table globals;
+  s32 stackCapacity;
+  // Globals are resolved to slots at compile time. A slot stays undefined
+  // until its DEFINE_GLOBAL runs, so code can refer to a global that is
+  // only defined later.
+  struct Table globalSlots;        // Global name -> slot.
+  struct ValueArray globalNames;   // Slot -> name, for error messages.
+  struct ValueArray globalValues;
   struct Table strings;
   struct Upvalue* openUpvalues;
 
@@ -159,6 +202,10 @@ struct State {
   struct Obj** grayStack;
 
   struct Parser* parser;
+
+#ifdef JIT
+  struct Recorder* recorder;
+#endif
 };
 
 struct Obj {
@@ -167,6 +214,29 @@ struct Obj {
   struct Obj* next;
 };
 
+#define INLINE_CACHE_ENTRIES 4
+
+// A receiver struct seen at a property access or invoke site.
+struct InlineCacheEntry {
+  struct Struct* strooct;
+  s32 field;              // Slot of the field in the instance, or -1.
+  struct Closure* method; // Resolved from the struct's methods if not a field.
+};
+
+struct InlineCache {
+  u8 count;
+  bool megamorphic; // Ran out of entries, always take the slow path.
+  struct InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+};
+
+// Where code the IR passes inlined came from. Either line can itself be
+// one of these, for code that was inlined into the callee first.
+struct InlinedLine {
+  struct Function* function;
+  s32 line;     // Its line in function.
+  s32 callLine; // The line of the call it took the place of.
+};
+
 struct Function {
   struct Obj obj;
   u8 arity;
@@ -175,7 +245,26 @@ struct Function {
   s32 bcCount;
   s32 bcCapacity;
   u8* bc;
+  // A line below zero is inlined code, -1 being inlinedLines[0].
   s32* lines;
+  s32 inlinedLineCount;
+  s32 inlinedLineCapacity;
+  struct InlinedLine* inlinedLines;
+  // Deepest the stack gets while this function runs, counting the callee
+  // and argument slots. Calls reserve this much up front.
+  s32 maxStack;
+
+#ifdef JIT
+  s32 callCount;
+  struct JitCode* jit;
+  s32 loopCount;
+  struct HotLoop* loops;
+#endif
+
+  // One per property access or invoke site, indexed by the instruction's
+  // cache operand.
+  u16 cacheCount;
+  struct InlineCache* caches;
 
   struct ValueArray constants;
   struct String* name;
@@ -184,7 +273,10 @@ struct Function {
 struct Closure {
   struct Obj obj;
   struct Function* function;
-  struct Upvalue** upvalues;
+  // Variables that are never assigned are captured as plain values. The
+  // rest share an Upvalue box with the frame that declared them, which
+  // scripts never see as a value of its own.
+  Value* upvalues;
   u8 upvalueCount;
 };
 
@@ -195,11 +287,17 @@ struct Upvalue {
   struct Upvalue* next;
 };
 
-typedef Value (*CFunction)(struct State* H);
+// Natives get their arguments in argv and write each of their results
+// to out. They return false once they've reported a runtime error.
+// Nothing on the stack may move while they run, argv points into it.
+typedef bool (*CFunction)(
+    struct State* H, s32 argc, const Value* argv, Value* out);
 
 struct CFunctionBinding {
   struct Obj obj;
   CFunction cFunc;
+  s32 arity;       // Checked before calling, or -1 to take any number.
+  s32 resultCount; // Scripts get nil for none, an array for several.
 };
 
 struct String {
@@ -212,7 +310,8 @@ struct String {
 struct Struct {
   struct Obj obj;
   struct String* name;
-  struct Table defaultFields;
+  struct Table fields;              // Field name -> slot index.
+  struct ValueArray defaultFields;  // Indexed by slot.
   struct Table methods;
   struct Table staticMethods;
 };
@@ -220,7 +319,13 @@ struct Struct {
 struct Instance {
   struct Obj obj;
   struct Struct* strooct;
-  struct Table fields;
+  // Normally the struct's field count. It's only smaller for an instance
+  // made by a field default while its struct was still being declared.
+  s32 fieldCount;
+  // The last method read off this instance as a value. Reading the same
+  // one again hands this back instead of allocating another.
+  struct BoundMethod* bound;
+  Value fields[];
 };
 
 struct BoundMethod {
@@ -247,6 +352,7 @@ void freeValueArray(struct State* H, struct ValueArray* array);
 void reserveValueArray(struct State* H, struct ValueArray* array, s32 size);
 void printValue(Value value);
 bool valuesEqual(Value a, Value b);
+bool sameConstant(Value a, Value b);
 
 struct Array* newArray(struct State* H);
 struct Enum* newEnum(struct State* H, struct String* name);
@@ -258,12 +364,18 @@ struct Instance* newInstance(struct State* H, struct Struct* strooct);
 struct Closure* newClosure(struct State* H, struct Function* function);
 struct Upvalue* newUpvalue(struct State* H, Value* slot);
 struct Function* newFunction(struct State* H);
-struct CFunctionBinding* newCFunctionBinding(struct State* H, CFunction cFunc);
+struct CFunctionBinding* newCFunctionBinding(
+    struct State* H, CFunction cFunc, s32 arity, s32 resultCount);
 struct BoundMethod* newBoundMethod(
     struct State* H, Value receiver, struct Closure* method);
+void initInlineCaches(struct State* H, struct Function* function);
 void writeBytecode(struct State* H, struct Function* function, u8 byte, s32 line);
 s32 addFunctionConstant(
     struct State* H, struct Function* function, Value value);
+s32 addInlinedLine(
+    struct State* H, struct Function* function,
+    struct Function* callee, s32 line, s32 callLine);
+s32 outermostLine(struct Function* function, s32 line);
 
 void printObject(Value value);
 
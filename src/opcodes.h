@@ -22,6 +22,8 @@ enum Bytecode {
   BC_PUSH_PROPERTY,
   BC_GET_PROPERTY,
   BC_SET_PROPERTY,
+  BC_GET_SELF_FIELD,
+  BC_SET_SELF_FIELD,
   BC_DESTRUCT_ARRAY,
   BC_EQUAL,
   BC_NOT_EQUAL,
@@ -41,8 +43,22 @@ enum Bytecode {
   BC_JUMP,
   BC_JUMP_IF_FALSE,
   BC_INEQUALITY_JUMP,
+  // Jump table for a match over integers. Takes the lowest label as a
+  // signed short and the table size, then one forward jump per label from
+  // the lowest up, and a last one for everything else. Like any other
+  // jump, each is relative to the end of its own operand.
+  BC_SWITCH,
   BC_LOOP,
+  // Numeric for loops. Both take the slot of the counter, followed by the
+  // limit and the step, and jump forward out of the loop when it is done.
+  BC_FOR_PREP,
+  BC_FOR_LOOP,
+  // for-in loops, taking the slot of the collection, followed by the index
+  // and the loop variable. Only the loop instruction has a jump.
+  BC_FOR_IN_PREP,
+  BC_FOR_IN_LOOP,
   BC_CALL,
+  BC_TAIL_CALL,
   BC_INSTANCE,
   BC_CLOSURE,
   BC_CLOSE_UPVALUE,
@@ -54,7 +70,79 @@ enum Bytecode {
   BC_METHOD,
   BC_STATIC_METHOD,
   BC_INVOKE,
+  BC_TAIL_INVOKE,
+  // Calls a static method of a top-level struct, taking the name, the
+  // argument count and an inline cache like BC_INVOKE does. The struct sits
+  // under the arguments.
+  BC_CALL_STATIC,
+  BC_TAIL_CALL_STATIC,
+  // Guards a call the IR passes inlined. Takes the argument count and a
+  // constant, and jumps forward to the call itself unless the callee
+  // under the arguments is that constant.
+  BC_JUMP_IF_NOT_CALLEE,
+
+  // Superinstructions, only ever selected by the optimizer.
+  BC_POP_JUMP_IF_FALSE,
+  BC_JUMP_IF_NOT_EQUAL,
+  BC_JUMP_IF_EQUAL,
+  BC_JUMP_IF_NOT_GREATER,
+  BC_JUMP_IF_NOT_GREATER_EQUAL,
+  BC_JUMP_IF_NOT_LESSER,
+  BC_JUMP_IF_NOT_LESSER_EQUAL,
+  BC_ADD_LOCALS,
+  BC_SUBTRACT_LOCALS,
+  BC_ADD_LOCAL_CONSTANT,
+  BC_SUBTRACT_LOCAL_CONSTANT,
+  BC_INVOKE_LOCAL,
+  BC_SET_LOCAL_POP,
+
+  // Register forms, selected by the optimizer in REGISTER_BYTECODE builds.
+  // Operands name frame slots (R) or constants (K) directly, and results
+  // are written straight into a slot instead of going through the stack.
+  BC_MOVE,
+  BC_LOAD_CONSTANT,
+  BC_ADD_RR,
+  BC_SUBTRACT_RR,
+  BC_MULTIPLY_RR,
+  BC_DIVIDE_RR,
+  BC_ADD_RK,
+  BC_SUBTRACT_RK,
+  BC_MULTIPLY_RK,
+  BC_DIVIDE_RK,
+  BC_JUMP_IF_NOT_EQUAL_RR,
+  BC_JUMP_IF_EQUAL_RR,
+  BC_JUMP_IF_NOT_GREATER_RR,
+  BC_JUMP_IF_NOT_GREATER_EQUAL_RR,
+  BC_JUMP_IF_NOT_LESSER_RR,
+  BC_JUMP_IF_NOT_LESSER_EQUAL_RR,
+  BC_JUMP_IF_NOT_EQUAL_RK,
+  BC_JUMP_IF_EQUAL_RK,
+  BC_JUMP_IF_NOT_GREATER_RK,
+  BC_JUMP_IF_NOT_GREATER_EQUAL_RK,
+  BC_JUMP_IF_NOT_LESSER_RK,
+  BC_JUMP_IF_NOT_LESSER_EQUAL_RK,
+
+  // Quickened forms, written over their generic instruction by run() once
+  // it has seen numbers for both operands, and back if it sees otherwise.
+  // They take the same operands, so the swap can happen in place.
+  BC_EQUAL_NUM,
+  BC_NOT_EQUAL_NUM,
+  BC_JUMP_IF_NOT_EQUAL_NUM,
+  BC_JUMP_IF_EQUAL_NUM,
+  BC_JUMP_IF_NOT_EQUAL_NUM_RR,
+  BC_JUMP_IF_EQUAL_NUM_RR,
+  BC_JUMP_IF_NOT_EQUAL_NUM_RK,
+  BC_JUMP_IF_EQUAL_NUM_RK,
+
   BC_BREAK,
 };
 
+// How BC_CLOSURE fills in each upvalue, from the first byte of its pair.
+// The second is a slot of the enclosing frame, or one of its upvalues.
+enum Capture {
+  CAPTURE_UPVALUE, // The enclosing closure's upvalue, as it is.
+  CAPTURE_LOCAL,   // A box for the slot, shared with the frame.
+  CAPTURE_VALUE,   // A copy of the slot, for variables never assigned.
+};
+
 #endif // _HOBBYL_OPCODES
@@ -0,0 +1,914 @@
+#include "optimizer.h"
+
+#include "memory.h"
+#include "object.h"
+#include "opcodes.h"
+
+// Rewrites a finished function's bytecode. Everything here works on the
+// original code and writes a new copy, so offsets in the old code stay
+// valid for the whole pass. Jumps are re-encoded at the end through an
+// old offset -> new offset map.
+
+// How many JUMPs in a row threadJumps() follows, which also stops it on
+// a jump to itself.
+#define MAX_JUMP_THREADING 8
+
+struct JumpPatch {
+  s32 operand;   // Where the jump's 16 bit operand ended up.
+  s32 target;    // Old offset the jump lands on.
+  bool backward;
+};
+
+struct Optimizer {
+  struct State* H;
+  struct Function* function;
+  u8* bc;
+  s32* lines;
+  s32 count;
+
+  s32* targets; // How many jumps land on each old offset.
+  s32* offsets; // Old offset -> new offset.
+
+  struct JumpPatch* patches;
+  s32 patchCount;
+
+  u8* newBc;
+  s32* newLines;
+  s32 newCount;
+};
+
+s32 instructionLength(struct Function* function, s32 offset) {
+  switch ((enum Bytecode)function->bc[offset]) {
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_POP:
+    case BC_GET_SUBSCRIPT:
+    case BC_SET_SUBSCRIPT:
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_EQUAL_NUM:
+    case BC_NOT_EQUAL_NUM:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_CONCAT:
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+    case BC_NEGATE:
+    case BC_NOT:
+    case BC_INSTANCE:
+    case BC_CLOSE_UPVALUE:
+    case BC_RETURN:
+      return 1;
+    case BC_CONSTANT:
+    case BC_ARRAY:
+    case BC_GET_UPVALUE:
+    case BC_SET_UPVALUE:
+    case BC_GET_LOCAL:
+    case BC_SET_LOCAL:
+    case BC_SET_LOCAL_POP:
+    case BC_INIT_PROPERTY:
+    case BC_GET_STATIC:
+    case BC_GET_SELF_FIELD:
+    case BC_SET_SELF_FIELD:
+    case BC_DESTRUCT_ARRAY:
+    case BC_CALL:
+    case BC_TAIL_CALL:
+    case BC_ENUM:
+    case BC_STRUCT:
+    case BC_STRUCT_FIELD:
+    case BC_METHOD:
+    case BC_STATIC_METHOD:
+    case BC_FOR_IN_PREP:
+      return 2;
+    case BC_JUMP:
+    case BC_JUMP_IF_FALSE:
+    case BC_INEQUALITY_JUMP:
+    case BC_LOOP:
+    case BC_ENUM_VALUE:
+    case BC_DEFINE_GLOBAL:
+    case BC_GET_GLOBAL:
+    case BC_SET_GLOBAL:
+    case BC_POP_JUMP_IF_FALSE:
+    case BC_JUMP_IF_NOT_EQUAL:
+    case BC_JUMP_IF_EQUAL:
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+    case BC_JUMP_IF_EQUAL_NUM:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+    case BC_MOVE:
+    case BC_LOAD_CONSTANT:
+    case BC_BREAK:
+      return 3;
+    case BC_PUSH_PROPERTY:
+    case BC_GET_PROPERTY:
+    case BC_SET_PROPERTY:
+    case BC_FOR_PREP:
+    case BC_FOR_LOOP:
+    case BC_FOR_IN_LOOP:
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+      return 4;
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+    case BC_JUMP_IF_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+    case BC_JUMP_IF_EQUAL_RK:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+    case BC_INVOKE:
+    case BC_TAIL_INVOKE:
+    case BC_CALL_STATIC:
+    case BC_TAIL_CALL_STATIC:
+    case BC_JUMP_IF_NOT_CALLEE:
+      return 5;
+    case BC_INVOKE_LOCAL:
+      return 6;
+    case BC_SWITCH:
+      return 4 + (function->bc[offset + 3] + 1) * 2;
+    case BC_CLOSURE: {
+      struct Function* inner = AS_FUNCTION(
+          function->constants.values[function->bc[offset + 1]]);
+      return 2 + inner->upvalueCount * 2;
+    }
+  }
+
+  return 1;
+}
+
+bool isJump(u8 op) {
+  switch (op) {
+    case BC_JUMP:
+    case BC_JUMP_IF_FALSE:
+    case BC_INEQUALITY_JUMP:
+    case BC_LOOP:
+    case BC_FOR_PREP:
+    case BC_FOR_LOOP:
+    case BC_FOR_IN_LOOP:
+    case BC_POP_JUMP_IF_FALSE:
+    case BC_JUMP_IF_NOT_EQUAL:
+    case BC_JUMP_IF_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+    case BC_JUMP_IF_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+    case BC_JUMP_IF_EQUAL_RK:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+    case BC_JUMP_IF_EQUAL_NUM:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+    case BC_JUMP_IF_NOT_CALLEE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Control never falls through these to the next instruction.
+bool isUnconditional(u8 op) {
+  return op == BC_JUMP || op == BC_LOOP || op == BC_RETURN || op == BC_SWITCH;
+}
+
+// The jump distance is always the last operand, relative to the end of
+// the instruction.
+s32 jumpTarget(struct Function* function, s32 offset) {
+  u8* bc = function->bc;
+  s32 end = offset + instructionLength(function, offset);
+  u16 jump = (u16)((bc[end - 2] << 8) | bc[end - 1]);
+  if (bc[offset] == BC_LOOP) {
+    return end - jump;
+  }
+  return end + jump;
+}
+
+// Where one of the jumps of a BC_SWITCH lands, counting the default as the
+// entry after the last label.
+s32 switchTarget(struct Function* function, s32 offset, s32 entry) {
+  u8* bc = function->bc;
+  s32 operand = offset + 4 + entry * 2;
+  return operand + 2 + (u16)((bc[operand] << 8) | bc[operand + 1]);
+}
+
+s32 switchEntryCount(struct Function* function, s32 offset) {
+  return function->bc[offset + 3] + 1;
+}
+
+static bool isTarget(struct Optimizer* optimizer, s32 offset) {
+  return optimizer->targets[offset] > 0;
+}
+
+static u8 opAt(struct Optimizer* optimizer, s32 offset) {
+  // Every function ends in BC_RETURN, which never starts a sequence, so
+  // reading past it means the sequence didn't match.
+  return offset < optimizer->count ? optimizer->bc[offset] : BC_RETURN;
+}
+
+static void retarget(struct Optimizer* optimizer, s32 from, s32 to) {
+  optimizer->targets[from]--;
+  optimizer->targets[to]++;
+}
+
+static void emitByte(struct Optimizer* optimizer, u8 byte, s32 line) {
+  optimizer->newBc[optimizer->newCount] = byte;
+  optimizer->newLines[optimizer->newCount] = line;
+  optimizer->newCount++;
+}
+
+// Emits the placeholder operand of a jump whose opcode and other operands
+// have already been written.
+static void emitJumpOperand(struct Optimizer* optimizer, s32 target, bool backward, s32 line) {
+  struct JumpPatch* patch = &optimizer->patches[optimizer->patchCount++];
+  patch->operand = optimizer->newCount;
+  patch->target = target;
+  patch->backward = backward;
+
+  emitByte(optimizer, 0xff, line);
+  emitByte(optimizer, 0xff, line);
+}
+
+static void emitJump(struct Optimizer* optimizer, u8 op, s32 target, s32 line) {
+  emitByte(optimizer, op, line);
+  emitJumpOperand(optimizer, target, op == BC_LOOP, line);
+}
+
+static void copyInstruction(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  s32 line = optimizer->lines[offset];
+  optimizer->offsets[offset] = optimizer->newCount;
+
+  s32 length = instructionLength(optimizer->function, offset);
+  if (bc[offset] == BC_SWITCH) {
+    for (s32 i = 0; i < 4; i++) {
+      emitByte(optimizer, bc[offset + i], line);
+    }
+    for (s32 entry = 0; entry < switchEntryCount(optimizer->function, offset); entry++) {
+      emitJumpOperand(optimizer,
+          switchTarget(optimizer->function, offset, entry), false, line);
+    }
+    return;
+  }
+
+  if (isJump(bc[offset])) {
+    for (s32 i = 0; i < length - 2; i++) {
+      emitByte(optimizer, bc[offset + i], line);
+    }
+    emitJumpOperand(optimizer, jumpTarget(optimizer->function, offset),
+        bc[offset] == BC_LOOP, line);
+    return;
+  }
+
+  for (s32 i = 0; i < length; i++) {
+    emitByte(optimizer, bc[offset + i], line);
+  }
+}
+
+static u8 fusedCompareJump(u8 op) {
+  switch (op) {
+    case BC_EQUAL:         return BC_JUMP_IF_NOT_EQUAL;
+    case BC_NOT_EQUAL:     return BC_JUMP_IF_EQUAL;
+    case BC_GREATER:       return BC_JUMP_IF_NOT_GREATER;
+    case BC_GREATER_EQUAL: return BC_JUMP_IF_NOT_GREATER_EQUAL;
+    case BC_LESSER:        return BC_JUMP_IF_NOT_LESSER;
+    case BC_LESSER_EQUAL:  return BC_JUMP_IF_NOT_LESSER_EQUAL;
+    default:               return BC_BREAK;
+  }
+}
+
+// JUMP_IF_FALSE L; POP ... L: POP
+//   => POP_JUMP_IF_FALSE L + 1
+// [cmp]; JUMP_IF_FALSE L; POP ... L: POP
+//   => JUMP_IF_NOT_[cmp] L + 1
+// The POP at L is left for any other path reaching it. When there is
+// none it is dropped as unreachable.
+static s32 selectConditionalJump(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  u8 fused = fusedCompareJump(bc[offset]);
+  s32 jump = offset;
+  if (fused != BC_BREAK) {
+    jump = offset + 1;
+    if (isTarget(optimizer, jump)) {
+      return 0;
+    }
+  } else {
+    fused = BC_POP_JUMP_IF_FALSE;
+  }
+
+  if (opAt(optimizer, jump) != BC_JUMP_IF_FALSE
+      || opAt(optimizer, jump + 3) != BC_POP
+      || isTarget(optimizer, jump + 3)) {
+    return 0;
+  }
+
+  s32 target = jumpTarget(optimizer->function, jump);
+  if (opAt(optimizer, target) != BC_POP) {
+    return 0;
+  }
+
+  retarget(optimizer, target, target + 1);
+  emitJump(optimizer, fused, target + 1, optimizer->lines[offset]);
+  return jump + 4 - offset;
+}
+
+// GET_LOCAL a; GET_LOCAL b; ADD|SUBTRACT => ADD_LOCALS|SUBTRACT_LOCALS a b
+// GET_LOCAL a; CONSTANT k; ADD|SUBTRACT
+//   => ADD_LOCAL_CONSTANT|SUBTRACT_LOCAL_CONSTANT a k
+static s32 selectLocalArithmetic(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  u8 operand = opAt(optimizer, offset + 2);
+  u8 op = opAt(optimizer, offset + 4);
+  if (bc[offset] != BC_GET_LOCAL
+      || (operand != BC_GET_LOCAL && operand != BC_CONSTANT)
+      || (op != BC_ADD && op != BC_SUBTRACT)
+      || isTarget(optimizer, offset + 2)
+      || isTarget(optimizer, offset + 4)) {
+    return 0;
+  }
+
+  u8 fused;
+  if (operand == BC_GET_LOCAL) {
+    fused = op == BC_ADD ? BC_ADD_LOCALS : BC_SUBTRACT_LOCALS;
+  } else {
+    fused = op == BC_ADD ? BC_ADD_LOCAL_CONSTANT : BC_SUBTRACT_LOCAL_CONSTANT;
+  }
+
+  s32 line = optimizer->lines[offset];
+  emitByte(optimizer, fused, line);
+  emitByte(optimizer, bc[offset + 1], line);
+  emitByte(optimizer, bc[offset + 3], line);
+  return 5;
+}
+
+// Instructions that push exactly one value and touch nothing else.
+static bool isSimplePush(u8 op) {
+  switch (op) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_GET_LOCAL:
+    case BC_GET_UPVALUE:
+    case BC_GET_GLOBAL:
+    case BC_GET_SELF_FIELD:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// GET_LOCAL s; [argCount simple pushes]; INVOKE name argCount cache
+//   => [argCount simple pushes]; INVOKE_LOCAL s name argCount cache
+static s32 selectInvokeLocal(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  if (bc[offset] != BC_GET_LOCAL) {
+    return 0;
+  }
+
+  s32 argStart = offset + 2;
+  s32 cursor = argStart;
+  s32 argCount = 0;
+  while (!isTarget(optimizer, cursor) && isSimplePush(opAt(optimizer, cursor))) {
+    cursor += instructionLength(optimizer->function, cursor);
+    argCount++;
+  }
+
+  if (isTarget(optimizer, cursor)
+      || opAt(optimizer, cursor) != BC_INVOKE
+      || bc[cursor + 2] != argCount) {
+    return 0;
+  }
+
+  for (s32 arg = argStart; arg < cursor;
+      arg += instructionLength(optimizer->function, arg)) {
+    copyInstruction(optimizer, arg);
+  }
+
+  s32 line = optimizer->lines[cursor];
+  emitByte(optimizer, BC_INVOKE_LOCAL, line);
+  emitByte(optimizer, bc[offset + 1], line);
+  emitByte(optimizer, bc[cursor + 1], line);
+  emitByte(optimizer, bc[cursor + 2], line);
+  emitByte(optimizer, bc[cursor + 3], line);
+  emitByte(optimizer, bc[cursor + 4], line);
+  return cursor + 5 - offset;
+}
+
+#ifdef REGISTER_BYTECODE
+static u8 registerArithmetic(u8 op, bool constant) {
+  switch (op) {
+    case BC_ADD:      return constant ? BC_ADD_RK : BC_ADD_RR;
+    case BC_SUBTRACT: return constant ? BC_SUBTRACT_RK : BC_SUBTRACT_RR;
+    case BC_MULTIPLY: return constant ? BC_MULTIPLY_RK : BC_MULTIPLY_RR;
+    case BC_DIVIDE:   return constant ? BC_DIVIDE_RK : BC_DIVIDE_RR;
+    default:          return BC_BREAK;
+  }
+}
+
+static u8 registerCompareJump(u8 op, bool constant) {
+  switch (op) {
+    case BC_EQUAL:
+      return constant ? BC_JUMP_IF_NOT_EQUAL_RK : BC_JUMP_IF_NOT_EQUAL_RR;
+    case BC_NOT_EQUAL:
+      return constant ? BC_JUMP_IF_EQUAL_RK : BC_JUMP_IF_EQUAL_RR;
+    case BC_GREATER:
+      return constant ? BC_JUMP_IF_NOT_GREATER_RK : BC_JUMP_IF_NOT_GREATER_RR;
+    case BC_GREATER_EQUAL:
+      return constant
+          ? BC_JUMP_IF_NOT_GREATER_EQUAL_RK
+          : BC_JUMP_IF_NOT_GREATER_EQUAL_RR;
+    case BC_LESSER:
+      return constant ? BC_JUMP_IF_NOT_LESSER_RK : BC_JUMP_IF_NOT_LESSER_RR;
+    case BC_LESSER_EQUAL:
+      return constant
+          ? BC_JUMP_IF_NOT_LESSER_EQUAL_RK
+          : BC_JUMP_IF_NOT_LESSER_EQUAL_RR;
+    default:
+      return BC_BREAK;
+  }
+}
+
+// Matches GET_LOCAL a; GET_LOCAL b|CONSTANT k; op at offset, returning the
+// register form of op or BC_BREAK.
+static u8 matchRegisterOperands(
+    struct Optimizer* optimizer, s32 offset, u8 (*select)(u8, bool)) {
+  u8 operand = opAt(optimizer, offset + 2);
+  if (opAt(optimizer, offset) != BC_GET_LOCAL
+      || (operand != BC_GET_LOCAL && operand != BC_CONSTANT)
+      || isTarget(optimizer, offset + 2)
+      || isTarget(optimizer, offset + 4)) {
+    return BC_BREAK;
+  }
+  return select(opAt(optimizer, offset + 4), operand == BC_CONSTANT);
+}
+
+// [value]; SET_LOCAL d; POP, where value is one of
+//   GET_LOCAL s                      => MOVE d s
+//   CONSTANT k                       => LOAD_CONSTANT d k
+//   GET_LOCAL a; GET_LOCAL b; op     => op_RR d a b
+//   GET_LOCAL a; CONSTANT k; op      => op_RK d a k
+static s32 selectRegisterStore(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  u8 fused = matchRegisterOperands(optimizer, offset, registerArithmetic);
+  s32 store = offset + 5;
+  if (fused == BC_BREAK) {
+    if (bc[offset] == BC_GET_LOCAL) {
+      fused = BC_MOVE;
+    } else if (bc[offset] == BC_CONSTANT) {
+      fused = BC_LOAD_CONSTANT;
+    } else {
+      return 0;
+    }
+    store = offset + 2;
+  }
+
+  if (opAt(optimizer, store) != BC_SET_LOCAL
+      || opAt(optimizer, store + 2) != BC_POP
+      || isTarget(optimizer, store)
+      || isTarget(optimizer, store + 2)) {
+    return 0;
+  }
+
+  s32 line = optimizer->lines[offset];
+  emitByte(optimizer, fused, line);
+  emitByte(optimizer, bc[store + 1], line);
+  emitByte(optimizer, bc[offset + 1], line);
+  if (store != offset + 2) {
+    emitByte(optimizer, bc[offset + 3], line);
+  }
+  return store + 3 - offset;
+}
+
+// GET_LOCAL a; GET_LOCAL b|CONSTANT k; [cmp]; JUMP_IF_FALSE L; POP ... L: POP
+//   => JUMP_IF_NOT_[cmp]_RR|RK a b|k L + 1
+static s32 selectRegisterCompareJump(struct Optimizer* optimizer, s32 offset) {
+  u8* bc = optimizer->bc;
+  u8 fused = matchRegisterOperands(optimizer, offset, registerCompareJump);
+  s32 jump = offset + 5;
+  if (fused == BC_BREAK
+      || opAt(optimizer, jump) != BC_JUMP_IF_FALSE
+      || opAt(optimizer, jump + 3) != BC_POP
+      || isTarget(optimizer, jump)
+      || isTarget(optimizer, jump + 3)) {
+    return 0;
+  }
+
+  s32 target = jumpTarget(optimizer->function, jump);
+  if (opAt(optimizer, target) != BC_POP) {
+    return 0;
+  }
+
+  retarget(optimizer, target, target + 1);
+  s32 line = optimizer->lines[offset];
+  emitByte(optimizer, fused, line);
+  emitByte(optimizer, bc[offset + 1], line);
+  emitByte(optimizer, bc[offset + 3], line);
+  emitJumpOperand(optimizer, target + 1, false, line);
+  return jump + 4 - offset;
+}
+#endif
+
+// SET_LOCAL s; POP => SET_LOCAL_POP s
+static s32 selectSetLocalPop(struct Optimizer* optimizer, s32 offset) {
+  if (optimizer->bc[offset] != BC_SET_LOCAL
+      || opAt(optimizer, offset + 2) != BC_POP
+      || isTarget(optimizer, offset + 2)) {
+    return 0;
+  }
+
+  s32 line = optimizer->lines[offset];
+  emitByte(optimizer, BC_SET_LOCAL_POP, line);
+  emitByte(optimizer, optimizer->bc[offset + 1], line);
+  return 3;
+}
+
+// JUMP L, where nothing between the jump and L can be reached, emits
+// nothing and skips straight to L. This is what's left of the jump over
+// the else branch of an if without one, once its POP has been folded into
+// the conditional jump.
+static s32 selectNoOpJump(struct Optimizer* optimizer, s32 offset) {
+  if (optimizer->bc[offset] != BC_JUMP) {
+    return 0;
+  }
+
+  s32 end = offset + instructionLength(optimizer->function, offset);
+  s32 target = jumpTarget(optimizer->function, offset);
+  for (s32 skipped = end; skipped < target; skipped++) {
+    if (isTarget(optimizer, skipped)) {
+      return 0;
+    }
+  }
+
+  optimizer->targets[target]--;
+  return target - offset;
+}
+
+static s32 selectInstruction(struct Optimizer* optimizer, s32 offset) {
+  s32 consumed;
+  if ((consumed = selectNoOpJump(optimizer, offset)) != 0) {
+    return consumed;
+  }
+#ifdef REGISTER_BYTECODE
+  if ((consumed = selectRegisterStore(optimizer, offset)) != 0
+      || (consumed = selectRegisterCompareJump(optimizer, offset)) != 0) {
+    return consumed;
+  }
+#endif
+  if ((consumed = selectSetLocalPop(optimizer, offset)) != 0
+      || (consumed = selectInvokeLocal(optimizer, offset)) != 0
+      || (consumed = selectLocalArithmetic(optimizer, offset)) != 0
+      || (consumed = selectConditionalJump(optimizer, offset)) != 0) {
+    return consumed;
+  }
+
+  copyInstruction(optimizer, offset);
+  return instructionLength(optimizer->function, offset);
+}
+
+// Follows the unconditional jumps starting at target to where control
+// really ends up, as long as that is still forward of end.
+static s32 threadedTarget(struct Function* function, s32 end, s32 target) {
+  for (s32 hops = 0; hops < MAX_JUMP_THREADING; hops++) {
+    if (target >= function->bcCount || function->bc[target] != BC_JUMP) {
+      break;
+    }
+
+    s32 next = jumpTarget(function, target);
+    if (next - end > UINT16_MAX) {
+      break;
+    }
+    target = next;
+  }
+  return target;
+}
+
+static void writeJumpOperand(u8* operand, s32 jump) {
+  operand[0] = (jump >> 8) & 0xff;
+  operand[1] = jump & 0xff;
+}
+
+// Rewrites forward jumps that land on a JUMP to go straight to its target,
+// in place, before anything else looks at where jumps land. if/else
+// chains and breaks out of nested blocks both leave such chains behind.
+static void threadJumps(struct Optimizer* optimizer) {
+  struct Function* function = optimizer->function;
+  for (s32 offset = 0; offset < optimizer->count;
+      offset += instructionLength(function, offset)) {
+    u8 op = optimizer->bc[offset];
+    if (op == BC_SWITCH) {
+      for (s32 entry = 0; entry < switchEntryCount(function, offset); entry++) {
+        s32 operand = offset + 4 + entry * 2;
+        s32 target = threadedTarget(function, operand + 2,
+            switchTarget(function, offset, entry));
+        writeJumpOperand(&optimizer->bc[operand], target - (operand + 2));
+      }
+    } else if (isJump(op) && op != BC_LOOP) {
+      s32 end = offset + instructionLength(function, offset);
+      s32 target = threadedTarget(function, end, jumpTarget(function, offset));
+      writeJumpOperand(&optimizer->bc[end - 2], target - end);
+    }
+  }
+}
+
+static void countJumpTargets(struct Optimizer* optimizer) {
+  for (s32 offset = 0; offset < optimizer->count;
+      offset += instructionLength(optimizer->function, offset)) {
+    if (isJump(optimizer->bc[offset])) {
+      optimizer->targets[jumpTarget(optimizer->function, offset)]++;
+    } else if (optimizer->bc[offset] == BC_SWITCH) {
+      for (s32 entry = 0; entry < switchEntryCount(optimizer->function, offset); entry++) {
+        optimizer->targets[switchTarget(optimizer->function, offset, entry)]++;
+      }
+    }
+  }
+}
+
+static void patchJumps(struct Optimizer* optimizer) {
+  for (s32 i = 0; i < optimizer->patchCount; i++) {
+    struct JumpPatch* patch = &optimizer->patches[i];
+    s32 target = optimizer->offsets[patch->target];
+    s32 end = patch->operand + 2;
+    s32 jump = patch->backward ? end - target : target - end;
+
+    optimizer->newBc[patch->operand] = (jump >> 8) & 0xff;
+    optimizer->newBc[patch->operand + 1] = jump & 0xff;
+  }
+}
+
+// How many values an instruction leaves on the stack, minus how many it
+// takes off. Values a single instruction pushes only for a moment are
+// covered by STACK_SLACK at call time instead.
+s32 stackEffect(struct Function* function, s32 offset) {
+  u8* bc = function->bc;
+  switch ((enum Bytecode)bc[offset]) {
+    case BC_CONSTANT:
+    case BC_NIL:
+    case BC_TRUE:
+    case BC_FALSE:
+    case BC_GET_GLOBAL:
+    case BC_GET_UPVALUE:
+    case BC_GET_LOCAL:
+    case BC_PUSH_PROPERTY:
+    case BC_GET_SELF_FIELD:
+    case BC_DESTRUCT_ARRAY:
+    case BC_CLOSURE:
+    case BC_ENUM:
+    case BC_STRUCT:
+    case BC_ADD_LOCALS:
+    case BC_SUBTRACT_LOCALS:
+    case BC_ADD_LOCAL_CONSTANT:
+    case BC_SUBTRACT_LOCAL_CONSTANT:
+      return 1;
+    case BC_POP:
+    case BC_GET_SUBSCRIPT:
+    case BC_DEFINE_GLOBAL:
+    case BC_INIT_PROPERTY:
+    case BC_SET_PROPERTY:
+    case BC_EQUAL:
+    case BC_NOT_EQUAL:
+    case BC_EQUAL_NUM:
+    case BC_NOT_EQUAL_NUM:
+    case BC_GREATER:
+    case BC_GREATER_EQUAL:
+    case BC_LESSER:
+    case BC_LESSER_EQUAL:
+    case BC_CONCAT:
+    case BC_ADD:
+    case BC_SUBTRACT:
+    case BC_MULTIPLY:
+    case BC_DIVIDE:
+    case BC_MODULO:
+    case BC_POW:
+    case BC_INEQUALITY_JUMP:
+    case BC_CLOSE_UPVALUE:
+    case BC_RETURN:
+    case BC_STRUCT_FIELD:
+    case BC_METHOD:
+    case BC_STATIC_METHOD:
+    case BC_POP_JUMP_IF_FALSE:
+    case BC_SET_LOCAL_POP:
+      return -1;
+    case BC_SET_SUBSCRIPT:
+    case BC_JUMP_IF_NOT_EQUAL:
+    case BC_JUMP_IF_EQUAL:
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+    case BC_JUMP_IF_EQUAL_NUM:
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL:
+      return -2;
+    case BC_ARRAY:
+      return 1 - bc[offset + 1];
+    case BC_CALL:
+    case BC_TAIL_CALL:
+      return -bc[offset + 1];
+    case BC_INVOKE:
+    case BC_TAIL_INVOKE:
+    case BC_CALL_STATIC:
+    case BC_TAIL_CALL_STATIC:
+      return -bc[offset + 2];
+    case BC_INVOKE_LOCAL:
+      return 1 - bc[offset + 3];
+    case BC_SET_GLOBAL:
+    case BC_SET_UPVALUE:
+    case BC_SET_LOCAL:
+    case BC_GET_STATIC:
+    case BC_GET_PROPERTY:
+    case BC_SET_SELF_FIELD:
+    case BC_NEGATE:
+    case BC_NOT:
+    case BC_JUMP:
+    case BC_JUMP_IF_FALSE:
+    case BC_LOOP:
+    case BC_FOR_PREP:
+    case BC_FOR_LOOP:
+    case BC_FOR_IN_PREP:
+    case BC_FOR_IN_LOOP:
+    case BC_SWITCH:
+    case BC_INSTANCE:
+    case BC_ENUM_VALUE:
+    case BC_MOVE:
+    case BC_LOAD_CONSTANT:
+    case BC_ADD_RR:
+    case BC_SUBTRACT_RR:
+    case BC_MULTIPLY_RR:
+    case BC_DIVIDE_RR:
+    case BC_ADD_RK:
+    case BC_SUBTRACT_RK:
+    case BC_MULTIPLY_RK:
+    case BC_DIVIDE_RK:
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+    case BC_JUMP_IF_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+    case BC_JUMP_IF_EQUAL_RK:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+    case BC_JUMP_IF_NOT_LESSER_EQUAL_RK:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+    case BC_JUMP_IF_NOT_CALLEE:
+    case BC_BREAK:
+      return 0;
+  }
+
+  return 0;
+}
+
+static bool raiseDepth(s32* depths, s32 offset, s32 depth) {
+  if (depth <= depths[offset]) {
+    return false;
+  }
+  depths[offset] = depth;
+  return true;
+}
+
+// Walks the finished bytecode and records the deepest the stack can get,
+// counting the callee and its arguments. Jumps always agree on the depth
+// at their target, so a few passes settle even with backward loops.
+static s32 computeMaxStack(struct State* H, struct Function* function) {
+  s32 count = function->bcCount;
+  s32* depths = ALLOCATE(H, s32, count + 1);
+  for (s32 i = 0; i <= count; i++) {
+    depths[i] = -1;
+  }
+  depths[0] = function->arity + 1;
+
+  s32 maxStack = depths[0];
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (s32 offset = 0; offset < count;
+        offset += instructionLength(function, offset)) {
+      if (depths[offset] < 0) {
+        continue;
+      }
+
+      u8 op = function->bc[offset];
+      s32 depth = depths[offset] + stackEffect(function, offset);
+      if (depth > maxStack) {
+        maxStack = depth;
+      }
+
+      if (isJump(op)) {
+        changed |= raiseDepth(depths, jumpTarget(function, offset), depth);
+      } else if (op == BC_SWITCH) {
+        for (s32 entry = 0; entry < switchEntryCount(function, offset); entry++) {
+          changed |= raiseDepth(depths, switchTarget(function, offset, entry), depth);
+        }
+      }
+      if (!isUnconditional(op)) {
+        changed |= raiseDepth(depths, offset + instructionLength(function, offset), depth);
+      }
+    }
+  }
+
+  FREE_ARRAY(H, s32, depths, count + 1);
+  return maxStack;
+}
+
+void optimizeFunction(struct State* H, struct Function* function) {
+  struct Optimizer optimizer;
+  s32 count = function->bcCount;
+  optimizer.H = H;
+  optimizer.function = function;
+  optimizer.bc = function->bc;
+  optimizer.lines = function->lines;
+  optimizer.count = count;
+  optimizer.patchCount = 0;
+  optimizer.newCount = 0;
+
+  optimizer.targets = ALLOCATE(H, s32, count + 1);
+  optimizer.offsets = ALLOCATE(H, s32, count + 1);
+  optimizer.patches = ALLOCATE(H, struct JumpPatch, count);
+  optimizer.newBc = ALLOCATE(H, u8, count);
+  optimizer.newLines = ALLOCATE(H, s32, count);
+
+  for (s32 i = 0; i <= count; i++) {
+    optimizer.targets[i] = 0;
+    optimizer.offsets[i] = 0;
+  }
+
+  threadJumps(&optimizer);
+  countJumpTargets(&optimizer);
+
+  bool reachable = true;
+  s32 offset = 0;
+  while (offset < count) {
+    if (isTarget(&optimizer, offset)) {
+      reachable = true;
+    }
+
+    optimizer.offsets[offset] = optimizer.newCount;
+    if (!reachable) {
+      offset += instructionLength(function, offset);
+      continue;
+    }
+
+    s32 start = optimizer.newCount;
+    offset += selectInstruction(&optimizer, offset);
+    if (optimizer.newCount > start) {
+      reachable = !isUnconditional(optimizer.newBc[start]);
+    }
+  }
+  optimizer.offsets[count] = optimizer.newCount;
+
+  patchJumps(&optimizer);
+
+  FREE_ARRAY(H, u8, function->bc, function->bcCapacity);
+  FREE_ARRAY(H, s32, function->lines, function->bcCapacity);
+  function->bc = optimizer.newBc;
+  function->lines = optimizer.newLines;
+  function->bcCount = optimizer.newCount;
+  function->bcCapacity = count;
+  function->maxStack = computeMaxStack(H, function);
+
+  FREE_ARRAY(H, s32, optimizer.targets, count + 1);
+  FREE_ARRAY(H, s32, optimizer.offsets, count + 1);
+  FREE_ARRAY(H, struct JumpPatch, optimizer.patches, count);
+}
@@ -0,0 +1,16 @@
+#ifndef _HOBBYL_OPTIMIZER_H
+#define _HOBBYL_OPTIMIZER_H
+
+#include "common.h"
+#include "object.h"
+
+s32 instructionLength(struct Function* function, s32 offset);
+bool isJump(u8 op);
+bool isUnconditional(u8 op);
+s32 jumpTarget(struct Function* function, s32 offset);
+s32 switchTarget(struct Function* function, s32 offset, s32 entry);
+s32 switchEntryCount(struct Function* function, s32 offset);
+s32 stackEffect(struct Function* function, s32 offset);
+void optimizeFunction(struct State* H, struct Function* function);
+
+#endif // _HOBBYL_OPTIMIZER_H
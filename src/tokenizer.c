@@ -128,7 +128,7 @@ static enum TokenType identifierType(struct Tokenizer* tokenizer) {
       if (tokenizer->end - tokenizer->start > 1) {
         switch (*(tokenizer->start + 1)) {
           case 'a': return checkKeyword(tokenizer, 2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(tokenizer, 2, 2, "or", TOKEN_FOR);
+          case 'o': return checkKeyword(tokenizer, 2, 1, "r", TOKEN_FOR);
           case 'u': return checkKeyword(tokenizer, 2, 2, "nc", TOKEN_FUNC);
         }
       }
@@ -69,11 +69,23 @@ void printValue(Value value) {
   }
 }
 
+// Reading the same method off the same instance twice need not hand back
+// the same object, so bound methods compare by what they bind.
+static bool boundMethodsEqual(Value a, Value b) {
+  struct BoundMethod* left = AS_BOUND_METHOD(a);
+  struct BoundMethod* right = AS_BOUND_METHOD(b);
+  return left->method == right->method &&
+         valuesEqual(left->receiver, right->receiver);
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
+  if (a != b && IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b)) {
+    return boundMethodsEqual(a, b);
+  }
   return a == b;
 #else
   if (a.type != b.type) {
@@ -84,8 +96,31 @@ bool valuesEqual(Value a, Value b) {
     case VALTYPE_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VALTYPE_NIL:    return true;
     case VALTYPE_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VALTYPE_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    case VALTYPE_OBJ:
+      if (AS_OBJ(a) != AS_OBJ(b) && IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b)) {
+        return boundMethodsEqual(a, b);
+      }
+      return AS_OBJ(a) == AS_OBJ(b);
     default: return false;
   }
 #endif
 }
+
+// Constants are shared when they are the same value. Numbers compare by
+// their bits, so an int never stands in for a double or 0 for -0.
+bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) {
+    return false;
+  }
+
+  switch (a.type) {
+    case VALTYPE_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+    case VALTYPE_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(f64)) == 0;
+    case VALTYPE_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    default:             return true;
+  }
+#endif
+}
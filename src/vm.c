@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "opcodes.h"
@@ -20,19 +21,41 @@ static void resetStack(struct State* H) {
   H->stackTop = H->stack;
   H->frameCount = 0;
   H->openUpvalues = NULL;
+#ifdef JIT
+  stopRecording(H);
+#endif
+}
+
+// Prints where a frame of function is at. Inlined code prints the frames
+// of the calls it took the place of too.
+static void printTraceLine(struct Function* function, s32 line, struct String* name) {
+  if (line < 0) {
+    struct InlinedLine* inlined = &function->inlinedLines[-line - 1];
+    printTraceLine(function, inlined->callLine, name);
+    printTraceLine(function, inlined->line, inlined->function->name);
+    return;
+  }
+
+  fprintf(stderr, "[line #%d] in ", line);
+  if (name == NULL) {
+    fprintf(stderr, "script\n");
+  } else {
+    fprintf(stderr, "%s\n", name->chars);
+  }
 }
 
-static void runtimeError(struct State* H, const char* format, ...) {
+void runtimeError(struct State* H, const char* format, ...) {
   for (s32 i = 0; i < H->frameCount; i++) {
+    if (i == TRACE_FRAMES && H->frameCount > TRACE_FRAMES * 2) {
+      s32 omitted = H->frameCount - TRACE_FRAMES * 2;
+      fprintf(stderr, "... %d frame%s omitted ...\n", omitted, omitted == 1 ? "" : "s");
+      i += omitted;
+    }
+
     struct CallFrame* frame = &H->frames[i];
     struct Function* function = frame->closure->function;
     size_t instruction = frame->ip - function->bc - 1;
-    fprintf(stderr, "[line #%d] in ", function->lines[instruction]);
-    if (function->name == NULL) {
-      fprintf(stderr, "script\n");
-    } else {
-      fprintf(stderr, "%s\n", function->name->chars);
-    }
+    printTraceLine(function, function->lines[instruction], function->name);
   }
 
   va_list args;
@@ -58,34 +81,68 @@ static Value peek(struct State* H, s32 distance) {
   return H->stackTop[-1 - distance];
 }
 
-void bindCFunction(struct State* H, const char* name, CFunction cFunction) {
+s32 globalSlot(struct State* H, struct String* name) {
+  Value slot;
+  if (tableGet(&H->globalSlots, name, &slot)) {
+    return AS_INT(slot);
+  }
+
+  push(H, NEW_OBJ(name));
+  s32 index = H->globalValues.count;
+  writeValueArray(H, &H->globalNames, NEW_OBJ(name));
+  writeValueArray(H, &H->globalValues, NEW_UNDEFINED);
+  tableSet(H, &H->globalSlots, name, NEW_INT(index));
+  pop(H);
+  return index;
+}
+
+void bindCFunction(
+    struct State* H, const char* name, CFunction cFunction,
+    s32 arity, s32 resultCount) {
   push(H, NEW_OBJ(copyString(H, name, (s32)strlen(name))));
-  push(H, NEW_OBJ(newCFunctionBinding(H, cFunction)));
-  tableSet(H, &H->globals, AS_STRING(H->stack[0]), H->stack[1]);
+  push(H, NEW_OBJ(newCFunctionBinding(H, cFunction, arity, resultCount)));
+  s32 slot = globalSlot(H, AS_STRING(H->stack[0]));
+  H->globalValues.values[slot] = H->stack[1];
   pop(H);
   pop(H);
 }
 
-static Value wrap_print(struct State* H) {
-  printValue(peek(H, 0));
+static bool wrap_print(
+    UNUSED struct State* H, UNUSED s32 argc, const Value* argv,
+    UNUSED Value* out) {
+  printValue(argv[0]);
   printf("\n");
-  return NEW_NIL;
+  return true;
 }
 
-static Value wrap_clock(UNUSED struct State* H) {
-  return NEW_NUMBER((f64)clock() / CLOCKS_PER_SEC);
+static bool wrap_clock(
+    UNUSED struct State* H, UNUSED s32 argc, UNUSED const Value* argv,
+    Value* out) {
+  out[0] = NEW_NUMBER((f64)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
-static Value wrap_explode(UNUSED struct State* H) {
+static bool wrap_explode(
+    UNUSED struct State* H, UNUSED s32 argc, UNUSED const Value* argv,
+    Value* out) {
   // explodes the interpreter.
   // Returns true on success :^)
   *((int*)(size_t)rand()) = 0;
-  return NEW_BOOL(true);
+  out[0] = NEW_BOOL(true);
+  return true;
 }
 
 void initState(struct State* H) {
   H->objects = NULL;
   H->parser = NULL;
+#ifdef JIT
+  H->recorder = NULL;
+#endif
+  H->frames = NULL;
+  H->frameCapacity = 0;
+  H->stack = NULL;
+  H->stackTop = NULL;
+  H->stackCapacity = 0;
 
   H->bytesAllocated = 0;
   H->nextGc = 1024 * 1024;
@@ -94,35 +151,112 @@ void initState(struct State* H) {
   H->grayCapacity = 0;
   H->grayStack = NULL;
 
-  resetStack(H);
-
   initTable(&H->strings);
-  initTable(&H->globals);
+  initTable(&H->globalSlots);
+  initValueArray(&H->globalNames);
+  initValueArray(&H->globalValues);
+
+  H->frames = ALLOCATE(H, struct CallFrame, FRAMES_INITIAL);
+  H->frameCapacity = FRAMES_INITIAL;
+  H->stack = ALLOCATE(H, Value, STACK_INITIAL);
+  H->stackCapacity = STACK_INITIAL;
+  resetStack(H);
 
-  bindCFunction(H, "clock", wrap_clock);
-  bindCFunction(H, "explode", wrap_explode);
-  bindCFunction(H, "print", wrap_print);
+  bindCFunction(H, "clock", wrap_clock, 0, 1);
+  bindCFunction(H, "explode", wrap_explode, 0, 1);
+  bindCFunction(H, "print", wrap_print, 1, 0);
 
   H->parser = ALLOCATE(H, struct Parser, 1);
 }
 
 void freeState(struct State* H) {
+#ifdef JIT
+  stopRecording(H);
+#endif
   freeTable(H, &H->strings);
-  freeTable(H, &H->globals);
+  freeTable(H, &H->globalSlots);
+  freeValueArray(H, &H->globalNames);
+  freeValueArray(H, &H->globalValues);
   freeObjects(H);
+  FREE_ARRAY(H, struct CallFrame, H->frames, H->frameCapacity);
+  FREE_ARRAY(H, Value, H->stack, H->stackCapacity);
   FREE(H, struct Parser, H->parser);
 }
 
+// Makes room for `needed` values above the stack top. Growing can move the
+// stack, so frame slots and open upvalues are rebased onto the new one.
+static void ensureStack(struct State* H, s32 needed) {
+  s32 count = (s32)(H->stackTop - H->stack);
+  if (count + needed <= H->stackCapacity) {
+    return;
+  }
+
+  s32 oldCapacity = H->stackCapacity;
+  s32 capacity = oldCapacity;
+  while (capacity < count + needed) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+
+  Value* oldStack = H->stack;
+  H->stack = GROW_ARRAY(H, Value, H->stack, oldCapacity, capacity);
+  H->stackCapacity = capacity;
+  H->stackTop = H->stack + count;
+  if (H->stack == oldStack) {
+    return;
+  }
+
+  for (s32 i = 0; i < H->frameCount; i++) {
+    H->frames[i].slots = H->stack + (H->frames[i].slots - oldStack);
+  }
+  for (struct Upvalue* upvalue = H->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = H->stack + (upvalue->location - oldStack);
+  }
+}
+
+// Reserves a closure's whole stack, measured from its callee slot, which
+// sits argCount + 1 values below the top. STACK_SLACK covers the values a
+// single instruction or native pushes for a moment.
+static void reserveFrameStack(struct State* H, struct Closure* closure, s32 argCount) {
+  ensureStack(H, closure->function->maxStack - (argCount + 1) + STACK_SLACK);
+}
+
+#ifdef JIT
+// Compiles a function to machine code once it has been called often
+// enough. A function the JIT can't or won't compile is only tried once,
+// and isn't counted from then on.
+static void countCall(struct State* H, struct Function* function) {
+  if (function->callCount > JIT_THRESHOLD) {
+    return;
+  }
+  if (function->callCount++ == JIT_THRESHOLD) {
+    function->jit = compileJit(H, function);
+  }
+}
+#endif
+
 static bool call(struct State* H, struct Closure* closure, s32 argCount) {
   if (argCount != closure->function->arity) {
     runtimeError(H, "Expected %d arguments, but got %d.", closure->function->arity, argCount);
     return false;
   }
 
-  if (H->frameCount == FRAMES_MAX) {
-    runtimeError(H, "Stack overflow.");
-    return false;
+  if (H->frameCount == H->frameCapacity) {
+    if (H->frameCapacity == FRAMES_MAX) {
+      runtimeError(H, "Stack overflow.");
+      return false;
+    }
+
+    s32 oldCapacity = H->frameCapacity;
+    H->frameCapacity = GROW_CAPACITY(oldCapacity);
+    if (H->frameCapacity > FRAMES_MAX) {
+      H->frameCapacity = FRAMES_MAX;
+    }
+    H->frames = GROW_ARRAY(H, struct CallFrame, H->frames, oldCapacity, H->frameCapacity);
   }
+  reserveFrameStack(H, closure, argCount);
+#ifdef JIT
+  countCall(H, closure->function);
+#endif
 
   struct CallFrame* frame = &H->frames[H->frameCount++];
   frame->closure = closure;
@@ -131,6 +265,51 @@ static bool call(struct State* H, struct Closure* closure, s32 argCount) {
   return true;
 }
 
+// Natives run without a frame of their own. Their results replace the
+// callee and its arguments on the stack.
+static bool callNative(
+    struct State* H, struct CFunctionBinding* native, s32 argCount) {
+  if (native->arity != -1 && argCount != native->arity) {
+    runtimeError(H, "Expected %d arguments, but got %d.", native->arity, argCount);
+    return false;
+  }
+
+  if (native->resultCount == 1) {
+    Value* args = H->stackTop - argCount;
+    if (!native->cFunc(H, argCount, args, &args[-1])) {
+      return false;
+    }
+    H->stackTop = args;
+    return true;
+  }
+
+  // Otherwise the results go above the arguments, where the GC still sees
+  // them while they're gathered into an array.
+  ensureStack(H, native->resultCount + 1);
+  Value* args = H->stackTop - argCount;
+  Value* results = H->stackTop;
+  for (s32 i = 0; i < native->resultCount; i++) {
+    results[i] = NEW_NIL;
+  }
+  H->stackTop += native->resultCount;
+  if (!native->cFunc(H, argCount, args, results)) {
+    return false;
+  }
+
+  Value result = NEW_NIL;
+  if (native->resultCount > 1) {
+    struct Array* array = newArray(H);
+    push(H, NEW_OBJ(array));
+    for (s32 i = 0; i < native->resultCount; i++) {
+      writeValueArray(H, &array->values, results[i]);
+    }
+    result = NEW_OBJ(array);
+  }
+  args[-1] = result;
+  H->stackTop = args;
+  return true;
+}
+
 static bool callValue(struct State* H, Value callee, s32 argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
@@ -141,13 +320,8 @@ static bool callValue(struct State* H, Value callee, s32 argCount) {
       }
       case OBJ_CLOSURE:
         return call(H, AS_CLOSURE(callee), argCount);
-      case OBJ_CFUNCTION: {
-        CFunction cFunction = AS_CFUNCTION(callee);
-        Value result = cFunction(H);
-        H->stackTop -= argCount + 1;
-        push(H, result);
-        return true;
-      }
+      case OBJ_CFUNCTION:
+        return callNative(H, AS_CFUNCTION(callee), argCount);
       default:
         break;
     }
@@ -157,19 +331,74 @@ static bool callValue(struct State* H, Value callee, s32 argCount) {
   return false;
 }
 
+static struct String* fieldName(struct Struct* strooct, s32 field) {
+  for (s32 i = 0; i < strooct->fields.capacity; i++) {
+    struct Entry* entry = &strooct->fields.entries[i];
+    if (entry->key != NULL && AS_INT(entry->value) == field) {
+      return entry->key;
+    }
+  }
+  return NULL;
+}
+
+static s32 fieldSlot(struct Instance* instance, struct String* name) {
+  Value slot;
+  if (!tableGet(&instance->strooct->fields, name, &slot)) {
+    return -1;
+  }
+
+  s32 field = AS_INT(slot);
+  return field < instance->fieldCount ? field : -1;
+}
+
+// Field slots come from the struct, so the struct alone is a valid cache
+// key. Hits still check the slot against the instance's field count.
+static struct InlineCacheEntry* findCacheEntry(
+    struct InlineCache* cache, struct Struct* strooct) {
+  for (s32 i = 0; i < cache->count; i++) {
+    if (cache->entries[i].strooct == strooct) {
+      return &cache->entries[i];
+    }
+  }
+  return NULL;
+}
+
+static void updateCache(
+    struct InlineCache* cache,
+    struct Struct* strooct, s32 field, struct Closure* method) {
+  if (cache == NULL || cache->megamorphic) {
+    return;
+  }
+
+  if (cache->count == INLINE_CACHE_ENTRIES) {
+    // Probing would mostly miss from here on.
+    cache->megamorphic = true;
+    cache->count = 0;
+    return;
+  }
+
+  struct InlineCacheEntry* entry = &cache->entries[cache->count++];
+  entry->strooct = strooct;
+  entry->field = field;
+  entry->method = method;
+}
+
 static bool invokeFromStruct(
     struct State* H,
-    struct Struct* strooct, struct String* name, s32 argCount) {
+    struct Struct* strooct, struct String* name, s32 argCount,
+    struct InlineCache* cache) {
   Value method;
   if (!tableGet(&strooct->methods, name, &method)) {
     runtimeError(H, "Undefined property '%d'.", name->chars);
     return false;
   }
 
+  updateCache(cache, strooct, -1, AS_CLOSURE(method));
   return call(H, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(struct State* H, struct String* name, s32 argCount) {
+static bool invoke(
+    struct State* H, struct String* name, s32 argCount, struct InlineCache* cache) {
   Value receiver = peek(H, argCount);
   if (!IS_INSTANCE(receiver)) {
     runtimeError(H, "Only instances have methods.");
@@ -178,26 +407,69 @@ static bool invoke(struct State* H, struct String* name, s32 argCount) {
 
   struct Instance* instance = AS_INSTANCE(receiver);
 
-  Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  struct InlineCacheEntry* cached = findCacheEntry(cache, instance->strooct);
+  if (cached != NULL) {
+    if (cached->method != NULL) {
+      return call(H, cached->method, argCount);
+    }
+
+    if (cached->field < instance->fieldCount) {
+      Value value = instance->fields[cached->field];
+      H->stackTop[-argCount - 1] = value;
+      return callValue(H, value, argCount);
+    }
+  }
+
+  s32 field = fieldSlot(instance, name);
+  if (field != -1) {
+    updateCache(cache, instance->strooct, field, NULL);
+    Value value = instance->fields[field];
     H->stackTop[-argCount - 1] = value;
     return callValue(H, value, argCount);
   }
 
-  return invokeFromStruct(H, instance->strooct, name, argCount);
+  return invokeFromStruct(H, instance->strooct, name, argCount, cache);
 }
 
-static bool bindMethod(struct State* H, struct Struct* strooct, struct String* name) {
+// The method a BC_TAIL_INVOKE can hand its frame to, or NULL when the call
+// has to go through invoke() instead: the receiver isn't an instance, the
+// name is one of its fields, or there's no such method to call.
+static struct Closure* tailInvokeTarget(
+    Value receiver, struct String* name, struct InlineCache* cache) {
+  if (!IS_INSTANCE(receiver)) {
+    return NULL;
+  }
+
+  struct Instance* instance = AS_INSTANCE(receiver);
+  struct InlineCacheEntry* cached = findCacheEntry(cache, instance->strooct);
+  if (cached != NULL) {
+    return cached->method;
+  }
+
   Value method;
-  if (!tableGet(&strooct->methods, name, &method)) {
-    runtimeError(H, "Undefined property '%s'.", name->chars);
-    return false;
+  if (fieldSlot(instance, name) != -1
+      || !tableGet(&instance->strooct->methods, name, &method)) {
+    return NULL;
   }
+  updateCache(cache, instance->strooct, -1, AS_CLOSURE(method));
+  return AS_CLOSURE(method);
+}
 
-  struct BoundMethod* bound = newBoundMethod(H, peek(H, 0), AS_CLOSURE(method));
-  pop(H);
+// Replaces the instance on top of the stack with method bound to it, or
+// pushes it on top when popValue is false.
+static void bindMethod(
+    struct State* H, struct Instance* instance, struct Closure* method,
+    bool popValue) {
+  struct BoundMethod* bound = instance->bound;
+  if (bound == NULL || bound->method != method) {
+    bound = newBoundMethod(H, NEW_OBJ(instance), method);
+    instance->bound = bound;
+  }
+
+  if (popValue) {
+    pop(H); // Instance
+  }
   push(H, NEW_OBJ(bound));
-  return true;
 }
 
 static struct Upvalue* captureUpvalue(struct State* H, Value* local) {
@@ -224,6 +496,11 @@ static struct Upvalue* captureUpvalue(struct State* H, Value* local) {
   return createdUpvalue;
 }
 
+// Reads an upvalue of a closure, through its box if it has one.
+static inline Value upvalueValue(Value upvalue) {
+  return IS_UPVALUE(upvalue) ? *AS_UPVALUE(upvalue)->location : upvalue;
+}
+
 static void closeUpvalues(struct State* H, Value* last) {
   while (H->openUpvalues != NULL && H->openUpvalues->location >= last) {
     struct Upvalue* upvalue = H->openUpvalues;
@@ -239,39 +516,50 @@ static void defineMethod(struct State* H, struct String* name, struct Table* tab
   pop(H);
 }
 
-static bool setProperty(struct State* H, struct String* name) {
+static bool setProperty(
+    struct State* H, struct String* name, struct InlineCache* cache) {
   if (!IS_INSTANCE(peek(H, 1))) {
     runtimeError(H, "Can only use dot operator on instances.");
     return false;
   }
 
   struct Instance* instance = AS_INSTANCE(peek(H, 1));
-  if (tableSet(H, &instance->fields, name, peek(H, 0))) {
+  s32 field = fieldSlot(instance, name);
+  if (field == -1) {
     runtimeError(H, "Cannot create new properties on instances at runtime.");
     return false;
   }
 
+  instance->fields[field] = peek(H, 0);
+  updateCache(cache, instance->strooct, field, NULL);
   return true;
 }
 
-static bool getProperty(struct State* H, Value object, struct String* name, bool popValue) {
+static bool getProperty(
+    struct State* H, Value object, struct String* name, bool popValue,
+    struct InlineCache* cache) {
   if (IS_OBJ(object)) {
     switch (OBJ_TYPE(object)) {
       case OBJ_INSTANCE: {
         struct Instance* instance = AS_INSTANCE(object);
 
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
+        s32 field = fieldSlot(instance, name);
+        if (field != -1) {
+          updateCache(cache, instance->strooct, field, NULL);
           if (popValue) {
             pop(H); // Instance
           }
-          push(H, value);
+          push(H, instance->fields[field]);
           return true;
         }
 
-        if (!bindMethod(H, instance->strooct, name)) {
+        Value method;
+        if (!tableGet(&instance->strooct->methods, name, &method)) {
+          runtimeError(H, "Undefined property '%s'.", name->chars);
           return false;
         }
+        updateCache(cache, instance->strooct, -1, AS_CLOSURE(method));
+        bindMethod(H, instance, AS_CLOSURE(method), popValue);
         return true;
       }
       default:
@@ -321,10 +609,60 @@ static bool getStatic(struct State* H, Value object, struct String* name) {
   return false;
 }
 
+// Puts the static method a BC_CALL_STATIC names in place of the struct
+// under its arguments. Static methods are fixed once the struct is
+// declared, so the struct alone is a valid cache key.
+static bool getStaticCallee(
+    struct State* H, struct String* name, s32 argCount, struct InlineCache* cache) {
+  Value* callee = H->stackTop - argCount - 1;
+  if (IS_STRUCT(*callee)) {
+    struct Struct* strooct = AS_STRUCT(*callee);
+    struct InlineCacheEntry* cached = findCacheEntry(cache, strooct);
+    if (cached != NULL) {
+      *callee = NEW_OBJ(cached->method);
+      return true;
+    }
+
+    Value method;
+    if (tableGet(&strooct->staticMethods, name, &method) && IS_CLOSURE(method)) {
+      updateCache(cache, strooct, -1, AS_CLOSURE(method));
+      *callee = method;
+      return true;
+    }
+  }
+
+  // Let BC_GET_STATIC's lookup report what went wrong.
+  push(H, *callee);
+  if (!getStatic(H, peek(H, 0), name)) {
+    return false;
+  }
+  *callee = pop(H);
+  return true;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(struct State* H, struct CallFrame* frame, u8* ip) {
+  printf("        | ");
+  for (Value* slot = H->stack; slot < H->stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(
+      frame->closure->function, (s32)(ip - frame->closure->function->bc));
+}
+#endif
+
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Whether value is the very closure an inlined call was compiled for.
+static bool isCallee(Value value, Value callee) {
+  return IS_OBJ(value) && AS_OBJ(value) == AS_OBJ(callee);
+}
+
 static void concatenate(struct State* H) {
   struct String* b = AS_STRING(peek(H, 0));
   struct String* a = AS_STRING(peek(H, 1));
@@ -342,399 +680,1600 @@ static void concatenate(struct State* H) {
   push(H, NEW_OBJ(result));
 }
 
-static enum InterpretResult run(struct State* H) {
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (u16)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(outType, op) \
-    do { \
-      if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 1))) { \
-        runtimeError(H, "Operands must be numbers."); \
-        return RUNTIME_ERR; \
-      } \
-      f32 b = AS_NUMBER(pop(H)); \
-      f32 a = AS_NUMBER(pop(H)); \
-      push(H, outType(a op b)); \
-    } while (false)
+// Arithmetic on two ints. They give an int as long as the result fits,
+// and as long as it's what doubles would give: 0 * -1 is -0 there.
+// Otherwise they return false and the operation is done in doubles.
+static inline bool addInts(s32 a, s32 b, Value* result) {
+  s32 sum;
+  if (__builtin_add_overflow(a, b, &sum)) return false;
+  *result = NEW_INT(sum);
+  return true;
+}
 
-  struct CallFrame* frame = &H->frames[H->frameCount - 1];
+static inline bool subtractInts(s32 a, s32 b, Value* result) {
+  s32 difference;
+  if (__builtin_sub_overflow(a, b, &difference)) return false;
+  *result = NEW_INT(difference);
+  return true;
+}
 
-  while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("        | ");
-    for (Value* slot = H->stack; slot < H->stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        frame->closure->function, (s32)(frame->ip - frame->closure->function->bc));
-#endif
-    u8 instruction;
-    switch (instruction = READ_BYTE()) {
-      case BC_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(H, constant);
-        break;
-      }
-      case BC_NIL:   push(H, NEW_NIL); break;
-      case BC_TRUE:  push(H, NEW_BOOL(true)); break;
-      case BC_FALSE: push(H, NEW_BOOL(false)); break;
-      case BC_POP: pop(H); break;
-      case BC_ARRAY: {
-        u8 elementCount = READ_BYTE();
-        struct Array* array = newArray(H);
-        push(H, NEW_OBJ(array));
-        reserveValueArray(H, &array->values, elementCount);
-        for (u8 i = 1; i <= elementCount; i++) {
-          writeValueArray(H, &array->values, peek(H, elementCount - i + 1));
-        }
-        H->stackTop -= elementCount + 1;
-        push(H, NEW_OBJ(array));
-        break;
-      }
-      case BC_GET_SUBSCRIPT: {
-        if (!IS_NUMBER(peek(H, 0))) {
-          runtimeError(H, "Can only use subscript operator with numbers.");
-          return RUNTIME_ERR;
-        }
-        s32 index = AS_NUMBER(peek(H, 0));
+static inline bool multiplyInts(s32 a, s32 b, Value* result) {
+  s32 product;
+  if (__builtin_mul_overflow(a, b, &product)) return false;
+  if (product == 0 && (a < 0 || b < 0)) return false;
+  *result = NEW_INT(product);
+  return true;
+}
 
-        if (!IS_ARRAY(peek(H, 1))) {
-          runtimeError(H, "Invalid target for subscript operator.");
-          return RUNTIME_ERR;
-        }
+static inline bool divideInts(s32 a, s32 b, Value* result) {
+  if (b <= 0 || a % b != 0) return false;
+  *result = NEW_INT(a / b);
+  return true;
+}
 
-        struct Array* array = AS_ARRAY(peek(H, 1));
+static inline bool moduloInts(s32 a, s32 b, Value* result) {
+  if (a < 0 || b <= 0) return false;
+  *result = NEW_INT(a % b);
+  return true;
+}
 
-        if (index < 0 || index > array->values.count) {
-          runtimeError(H, "Index out of bounds. Array size is %d, but tried accessing %d",
-              array->values.count, index);
-          return RUNTIME_ERR;
-        }
+// Gets either kind of number as a double, or returns false for anything
+// else.
+static inline bool toDouble(Value value, f64* number) {
+  if (IS_DOUBLE(value)) {
+    memcpy(number, &value, sizeof(f64));
+    return true;
+  }
+  if (IS_INT(value)) {
+    *number = AS_INT(value);
+    return true;
+  }
+  return false;
+}
 
-        pop(H); // Index
-        pop(H); // Array
-        push(H, array->values.values[index]);
-        break;
-      }
-      case BC_SET_SUBSCRIPT: {
-        if (!IS_NUMBER(peek(H, 1))) {
-          runtimeError(H, "Can only use subscript operator with numbers.");
-          return RUNTIME_ERR;
-        }
-        s32 index = AS_NUMBER(peek(H, 1));
+// The same for callers that have already checked both operands are
+// numbers.
+static inline Value addNumbers(Value a, Value b) {
+  Value result;
+  if (ARE_INTS(a, b) && addInts(AS_INT(a), AS_INT(b), &result)) return result;
+  return NEW_NUMBER(AS_NUMBER(a) + AS_NUMBER(b));
+}
 
-        if (!IS_ARRAY(peek(H, 2))) {
-          runtimeError(H, "Invalid target for subscript operator.");
-          return RUNTIME_ERR;
-        }
+static inline Value subtractNumbers(Value a, Value b) {
+  Value result;
+  if (ARE_INTS(a, b) && subtractInts(AS_INT(a), AS_INT(b), &result)) return result;
+  return NEW_NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
+}
 
-        struct Array* array = AS_ARRAY(peek(H, 2));
+static inline Value multiplyNumbers(Value a, Value b) {
+  Value result;
+  if (ARE_INTS(a, b) && multiplyInts(AS_INT(a), AS_INT(b), &result)) return result;
+  return NEW_NUMBER(AS_NUMBER(a) * AS_NUMBER(b));
+}
 
-        if (index < 0 || index > array->values.count) {
-          runtimeError(H, "Index out of bounds. Array size is %d, but tried accessing %d",
-              array->values.count, index);
-          return RUNTIME_ERR;
-        }
+static inline Value divideNumbers(Value a, Value b) {
+  Value result;
+  if (ARE_INTS(a, b) && divideInts(AS_INT(a), AS_INT(b), &result)) return result;
+  return NEW_NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
+}
 
-        array->values.values[index] = pop(H);
-        pop(H); // Index
-        pop(H); // Array
-        push(H, array->values.values[index]);
-        break;
-      }
-      case BC_GET_GLOBAL: {
-        struct String* name = READ_STRING();
-        Value value;
-        if (!tableGet(&H->globals, name, &value)) {
-          runtimeError(H, "Undefined variable '%s'.", name->chars);
-          return RUNTIME_ERR;
-        }
-        push(H, value);
-        break;
-      }
-      case BC_SET_GLOBAL: {
-        struct String* name = READ_STRING();
-        if (tableSet(H, &H->globals, name, peek(H, 0))) {
-          tableDelete(&H->globals, name);
-          runtimeError(H, "Undefined variable '%s'.", name->chars);
-          return RUNTIME_ERR;
-        }
-        break;
-      }
-      case BC_DEFINE_GLOBAL: {
-        struct String* name = READ_STRING();
-        if (!tableSet(H, &H->globals, name, peek(H, 0))) {
-          tableDelete(&H->globals, name);
-          runtimeError(H, "Redefinition of '%s'.", name->chars);
-          return RUNTIME_ERR;
-        }
-        pop(H);
-        break;
-      }
-      case BC_GET_UPVALUE: {
-        u8 slot = READ_BYTE();
-        push(H, *frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case BC_SET_UPVALUE: {
-        u8 slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(H, 0);
-        break;
-      }
-      case BC_GET_LOCAL: {
-        u8 slot = READ_BYTE();
-        push(H, frame->slots[slot]);
-        break;
-      }
-      case BC_SET_LOCAL: {
-        u8 slot = READ_BYTE();
-        frame->slots[slot] = peek(H, 0);
-        break;
-      }
-      case BC_INIT_PROPERTY: {
-        if (!setProperty(H, READ_STRING())) {
-          return RUNTIME_ERR;
-        }
+static inline Value moduloNumbers(Value a, Value b) {
+  Value result;
+  if (ARE_INTS(a, b) && moduloInts(AS_INT(a), AS_INT(b), &result)) return result;
+  return NEW_NUMBER(fmod(AS_NUMBER(a), AS_NUMBER(b)));
+}
 
-        pop(H); // Value
-        break;
-      }
-      case BC_GET_STATIC: {
-        if (!getStatic(H, peek(H, 0), READ_STRING())) {
-          return RUNTIME_ERR;
-        }
-        break;
+static inline Value negateNumber(Value value) {
+  if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN) {
+    return NEW_INT(-AS_INT(value));
+  }
+  return NEW_NUMBER(-AS_NUMBER(value));
+}
+
+static inline s32 valueToIndex(Value index) {
+  return IS_INT(index) ? AS_INT(index) : (s32)AS_NUMBER(index);
+}
+
+#define COMPARE_NUMBERS(a, op, b) \
+    (ARE_INTS(a, b) ? AS_INT(a) op AS_INT(b) : AS_NUMBER(a) op AS_NUMBER(b))
+
+// A for loop keeps its counter, limit and step in consecutive slots. They
+// are checked once before the first iteration.
+static bool checkForRange(struct State* H, const Value* counter) {
+  if (!IS_NUMBER(counter[0]) || !IS_NUMBER(counter[1]) || !IS_NUMBER(counter[2])) {
+    runtimeError(H, "For loop range must be numbers.");
+    return false;
+  }
+  if (AS_NUMBER(counter[2]) == 0) {
+    runtimeError(H, "For loop step can't be zero.");
+    return false;
+  }
+  return true;
+}
+
+// A for-in loop keeps the collection, the index of the current element
+// and the element in consecutive slots. Other kinds of collection go
+// into both functions below.
+static bool checkIterable(struct State* H, const Value* collection) {
+  if (!IS_ARRAY(collection[0]) && !IS_STRING(collection[0])) {
+    runtimeError(H, "Can only iterate over arrays and strings.");
+    return false;
+  }
+  return true;
+}
+
+// Moves on to the next element, or returns false past the last one.
+static inline bool iterate(struct State* H, Value* collection) {
+  s32 index = AS_INT(collection[1]) + 1;
+  struct Obj* object = AS_OBJ(collection[0]);
+  switch (object->type) {
+    case OBJ_ARRAY: {
+      struct ValueArray* values = &((struct Array*)object)->values;
+      if (index >= values->count) {
+        return false;
       }
-      case BC_PUSH_PROPERTY:
-      case BC_GET_PROPERTY: {
-        if (!getProperty(
-            H, peek(H, 0), READ_STRING(), instruction == BC_GET_PROPERTY)) {
-          return RUNTIME_ERR;
-        }
-        break;
+      collection[2] = values->values[index];
+      break;
+    }
+    case OBJ_STRING: {
+      struct String* string = (struct String*)object;
+      if (index >= string->length) {
+        return false;
       }
-      case BC_SET_PROPERTY: {
-        if (!setProperty(H, READ_STRING())) {
-          return RUNTIME_ERR;
-        }
+      collection[2] = NEW_OBJ(copyString(H, string->chars + index, 1));
+      break;
+    }
+    default:
+      return false;
+  }
+  collection[1] = NEW_INT(index);
+  return true;
+}
 
-        // Removing the instance while keeping the rhs value on top.
-        Value value = pop(H);
-        pop(H);
-        push(H, value);
-        break;
+// The limit is part of the range, whichever way the step goes.
+static inline bool forContinues(const Value* counter) {
+  bool up = IS_INT(counter[2]) ? AS_INT(counter[2]) > 0 : AS_NUMBER(counter[2]) > 0;
+  return up
+      ? COMPARE_NUMBERS(counter[0], <=, counter[1])
+      : COMPARE_NUMBERS(counter[0], >=, counter[1]);
+}
+
+// Work out an instruction on constant operands the way run() would, for
+// the compiler to fold. They return false for anything run() would report
+// an error for, which is left to happen at runtime.
+bool foldBinary(struct State* H, u8 op, Value a, Value b, Value* result) {
+  switch (op) {
+    case BC_EQUAL:
+      *result = NEW_BOOL(valuesEqual(a, b));
+      return true;
+    case BC_NOT_EQUAL:
+      *result = NEW_BOOL(!valuesEqual(a, b));
+      return true;
+    case BC_CONCAT:
+      if (!IS_STRING(a) || !IS_STRING(b)) {
+        return false;
       }
-      case BC_DESTRUCT_ARRAY: {
-        u8 index = READ_BYTE();
+      push(H, a);
+      push(H, b);
+      concatenate(H);
+      *result = pop(H);
+      return true;
+    default:
+      break;
+  }
 
-        if (!IS_ARRAY(peek(H, 0))) {
-          runtimeError(H, "Can only destruct arrays");
-          return RUNTIME_ERR;
-        }
-        struct Array* array = AS_ARRAY(peek(H, 0));
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
 
-        push(H, array->values.values[index]);
-        break;
-      }
-      case BC_EQUAL: {
-        Value b = pop(H);
-        Value a = pop(H);
-        push(H, NEW_BOOL(valuesEqual(a, b)));
-        break;
-      }
-      case BC_NOT_EQUAL: {
-        Value b = pop(H);
-        Value a = pop(H);
-        push(H, NEW_BOOL(!valuesEqual(a, b)));
-        break;
+  switch (op) {
+    case BC_GREATER:       *result = NEW_BOOL(COMPARE_NUMBERS(a, >, b)); return true;
+    case BC_GREATER_EQUAL: *result = NEW_BOOL(COMPARE_NUMBERS(a, >=, b)); return true;
+    case BC_LESSER:        *result = NEW_BOOL(COMPARE_NUMBERS(a, <, b)); return true;
+    case BC_LESSER_EQUAL:  *result = NEW_BOOL(COMPARE_NUMBERS(a, <=, b)); return true;
+    case BC_ADD:           *result = addNumbers(a, b); return true;
+    case BC_SUBTRACT:      *result = subtractNumbers(a, b); return true;
+    case BC_MULTIPLY:      *result = multiplyNumbers(a, b); return true;
+    case BC_DIVIDE:        *result = divideNumbers(a, b); return true;
+    case BC_MODULO:        *result = moduloNumbers(a, b); return true;
+    case BC_POW:           *result = NEW_NUMBER(pow(AS_NUMBER(a), AS_NUMBER(b))); return true;
+    default:               return false;
+  }
+}
+
+bool foldUnary(u8 op, Value a, Value* result) {
+  switch (op) {
+    case BC_NOT:
+      *result = NEW_BOOL(isFalsey(a));
+      return true;
+    case BC_NEGATE:
+      if (!IS_NUMBER(a)) {
+        return false;
       }
-      case BC_CONCAT: {
-        if (!IS_STRING(peek(H, 0)) || !IS_STRING(peek(H, 1))) {
-          runtimeError(H, "Operands must be strings.");
-          return RUNTIME_ERR;
-        }
-        concatenate(H);
-        break;
+      *result = negateNumber(a);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Which jump of a BC_SWITCH table a match subject takes. Labels are
+// integers, so only a number equal to one of them picks its jump, just as
+// valuesEqual would. Anything else takes the last one.
+static inline s32 switchEntry(Value subject, s32 low, s32 count) {
+  if (IS_INT(subject)) {
+    s64 index = (s64)AS_INT(subject) - low;
+    return index >= 0 && index < count ? (s32)index : count;
+  }
+  if (IS_NUMBER(subject)) {
+    f64 index = AS_NUMBER(subject) - low;
+    if (index >= 0 && index < count && index == (s32)index) {
+      return (s32)index;
+    }
+  }
+  return count;
+}
+
+// Equality for the generic instructions. Having compared two numbers it
+// rewrites the instruction at opcode into its number form.
+static bool quickenEquality(u8* opcode, u8 numberForm, Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    *opcode = numberForm;
+    return COMPARE_NUMBERS(a, ==, b);
+  }
+  return valuesEqual(a, b);
+}
+
+// The number forms land here when their guard fails, and go back to being
+// generic.
+static bool deoptimizeEquality(u8* opcode, u8 genericForm, Value a, Value b) {
+  *opcode = genericForm;
+  return valuesEqual(a, b);
+}
+
+static enum InterpretResult run(struct State* H) {
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (u16)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->closure->function->constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->caches[READ_SHORT()])
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+    do { \
+      frame = &H->frames[H->frameCount - 1]; \
+      ip = frame->ip; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(H, __VA_ARGS__); \
+      return RUNTIME_ERR; \
+    } while (false)
+// result = a op b, trying ints first and falling back to doubles when the
+// operands are mixed or the int result doesn't fit.
+#define NUMBER_BINARY(a, intOperation, op, b, result) \
+    do { \
+      if (ARE_INTS(a, b) && intOperation(AS_INT(a), AS_INT(b), &(result))) break; \
+      f64 x, y; \
+      if (!toDouble(a, &x) || !toDouble(b, &y)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      result = NEW_NUMBER(x op y); \
+    } while (false)
+#define NUMBER_COMPARE(a, op, b, result) \
+    do { \
+      if (ARE_INTS(a, b)) { \
+        result = AS_INT(a) op AS_INT(b); \
+        break; \
+      } \
+      f64 x, y; \
+      if (!toDouble(a, &x) || !toDouble(b, &y)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      result = x op y; \
+    } while (false)
+#define ARITHMETIC_OP(intOperation, op) \
+    do { \
+      Value result; \
+      NUMBER_BINARY(peek(H, 1), intOperation, op, peek(H, 0), result); \
+      pop(H); \
+      pop(H); \
+      push(H, result); \
+    } while (false)
+#define COMPARISON_OP(op) \
+    do { \
+      bool result; \
+      NUMBER_COMPARE(peek(H, 1), op, peek(H, 0), result); \
+      pop(H); \
+      pop(H); \
+      push(H, NEW_BOOL(result)); \
+    } while (false)
+#define LOCAL_BINARY_OP(intOperation, op, readOperand) \
+    do { \
+      Value left = frame->slots[READ_BYTE()]; \
+      Value right = readOperand; \
+      Value result; \
+      NUMBER_BINARY(left, intOperation, op, right, result); \
+      push(H, result); \
+    } while (false)
+#define COMPARE_JUMP(op) \
+    do { \
+      u16 offset = READ_SHORT(); \
+      bool result; \
+      NUMBER_COMPARE(peek(H, 1), op, peek(H, 0), result); \
+      pop(H); \
+      pop(H); \
+      if (!result) { \
+        ip += offset; \
+      } \
+    } while (false)
+#define REGISTER_ARITHMETIC(intOperation, op, readRight) \
+    do { \
+      Value* dest = &frame->slots[READ_BYTE()]; \
+      Value left = frame->slots[READ_BYTE()]; \
+      Value right = readRight; \
+      NUMBER_BINARY(left, intOperation, op, right, *dest); \
+    } while (false)
+#define REGISTER_COMPARE_JUMP(op, readRight) \
+    do { \
+      Value left = frame->slots[READ_BYTE()]; \
+      Value right = readRight; \
+      u16 offset = READ_SHORT(); \
+      bool result; \
+      NUMBER_COMPARE(left, op, right, result); \
+      if (!result) { \
+        ip += offset; \
+      } \
+    } while (false)
+// The opcode byte of the instruction being executed, before any of its
+// operands are read.
+#define OPCODE() (ip - 1)
+// a == b in a number form, whose guard checks b unless it's a constant
+// the instruction was quickened for.
+#define NUMBER_EQUALS(opcode, genericForm, a, b, guardRight) \
+    (IS_NUMBER(a) && (!(guardRight) || IS_NUMBER(b)) \
+        ? COMPARE_NUMBERS(a, ==, b) \
+        : deoptimizeEquality(opcode, genericForm, a, b))
+#define REGISTER_EQUALITY_JUMP(jumpIfEqual, readRight, numberForm) \
+    do { \
+      u8* opcode = OPCODE(); \
+      Value left = frame->slots[READ_BYTE()]; \
+      Value right = readRight; \
+      u16 offset = READ_SHORT(); \
+      if (quickenEquality(opcode, numberForm, left, right) == jumpIfEqual) { \
+        ip += offset; \
+      } \
+    } while (false)
+#define REGISTER_NUMBER_EQUALITY_JUMP(jumpIfEqual, readRight, genericForm, guardRight) \
+    do { \
+      u8* opcode = OPCODE(); \
+      Value left = frame->slots[READ_BYTE()]; \
+      Value right = readRight; \
+      u16 offset = READ_SHORT(); \
+      if (NUMBER_EQUALS(opcode, genericForm, left, right, guardRight) == jumpIfEqual) { \
+        ip += offset; \
+      } \
+    } while (false)
+
+#ifdef JIT
+// Hands the frame to its machine code if there is an entry at ip. That
+// runs until it reaches an instruction it leaves to run(), or an error.
+#define ENTER_JIT() \
+    do { \
+      struct JitCode* jit = frame->closure->function->jit; \
+      if (jit != NULL && !recording && jit->entries[ip - frame->closure->function->bc] != NULL) { \
+        if (runJit(H, frame, ip) == JIT_ERROR) { \
+          return RUNTIME_ERR; \
+        } \
+        ip = frame->ip; \
+      } \
+    } while (false)
+// While a loop is being recorded every instruction is shown to the
+// recorder before it runs. Whether one is, is kept in a local so the
+// check on every instruction doesn't have to read H.
+#define RECORD_TRACE() \
+    do { \
+      if (recording) { \
+        recordInstruction(H, frame, ip); \
+        recording = H->recorder != NULL; \
+      } \
+    } while (false)
+#else
+#define ENTER_JIT() do {} while (false)
+#define RECORD_TRACE() do {} while (false)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() traceExecution(H, frame, ip)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+#define CASE(name) label_##name
+#define DISPATCH() \
+    do { \
+      TRACE_EXECUTION(); \
+      RECORD_TRACE(); \
+      goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#define INTERPRET_LOOP DISPATCH();
+
+  static void* dispatchTable[] = {
+    [BC_CONSTANT] = &&CASE(BC_CONSTANT),
+    [BC_NIL] = &&CASE(BC_NIL),
+    [BC_TRUE] = &&CASE(BC_TRUE),
+    [BC_FALSE] = &&CASE(BC_FALSE),
+    [BC_POP] = &&CASE(BC_POP),
+    [BC_ARRAY] = &&CASE(BC_ARRAY),
+    [BC_GET_SUBSCRIPT] = &&CASE(BC_GET_SUBSCRIPT),
+    [BC_SET_SUBSCRIPT] = &&CASE(BC_SET_SUBSCRIPT),
+    [BC_DEFINE_GLOBAL] = &&CASE(BC_DEFINE_GLOBAL),
+    [BC_GET_GLOBAL] = &&CASE(BC_GET_GLOBAL),
+    [BC_SET_GLOBAL] = &&CASE(BC_SET_GLOBAL),
+    [BC_GET_UPVALUE] = &&CASE(BC_GET_UPVALUE),
+    [BC_SET_UPVALUE] = &&CASE(BC_SET_UPVALUE),
+    [BC_GET_LOCAL] = &&CASE(BC_GET_LOCAL),
+    [BC_SET_LOCAL] = &&CASE(BC_SET_LOCAL),
+    [BC_INIT_PROPERTY] = &&CASE(BC_INIT_PROPERTY),
+    [BC_GET_STATIC] = &&CASE(BC_GET_STATIC),
+    [BC_PUSH_PROPERTY] = &&CASE(BC_PUSH_PROPERTY),
+    [BC_GET_PROPERTY] = &&CASE(BC_GET_PROPERTY),
+    [BC_SET_PROPERTY] = &&CASE(BC_SET_PROPERTY),
+    [BC_GET_SELF_FIELD] = &&CASE(BC_GET_SELF_FIELD),
+    [BC_SET_SELF_FIELD] = &&CASE(BC_SET_SELF_FIELD),
+    [BC_DESTRUCT_ARRAY] = &&CASE(BC_DESTRUCT_ARRAY),
+    [BC_EQUAL] = &&CASE(BC_EQUAL),
+    [BC_NOT_EQUAL] = &&CASE(BC_NOT_EQUAL),
+    [BC_GREATER] = &&CASE(BC_GREATER),
+    [BC_GREATER_EQUAL] = &&CASE(BC_GREATER_EQUAL),
+    [BC_LESSER] = &&CASE(BC_LESSER),
+    [BC_LESSER_EQUAL] = &&CASE(BC_LESSER_EQUAL),
+    [BC_CONCAT] = &&CASE(BC_CONCAT),
+    [BC_ADD] = &&CASE(BC_ADD),
+    [BC_SUBTRACT] = &&CASE(BC_SUBTRACT),
+    [BC_MULTIPLY] = &&CASE(BC_MULTIPLY),
+    [BC_DIVIDE] = &&CASE(BC_DIVIDE),
+    [BC_MODULO] = &&CASE(BC_MODULO),
+    [BC_POW] = &&CASE(BC_POW),
+    [BC_NEGATE] = &&CASE(BC_NEGATE),
+    [BC_NOT] = &&CASE(BC_NOT),
+    [BC_JUMP] = &&CASE(BC_JUMP),
+    [BC_JUMP_IF_FALSE] = &&CASE(BC_JUMP_IF_FALSE),
+    [BC_INEQUALITY_JUMP] = &&CASE(BC_INEQUALITY_JUMP),
+    [BC_SWITCH] = &&CASE(BC_SWITCH),
+    [BC_LOOP] = &&CASE(BC_LOOP),
+    [BC_FOR_PREP] = &&CASE(BC_FOR_PREP),
+    [BC_FOR_LOOP] = &&CASE(BC_FOR_LOOP),
+    [BC_FOR_IN_PREP] = &&CASE(BC_FOR_IN_PREP),
+    [BC_FOR_IN_LOOP] = &&CASE(BC_FOR_IN_LOOP),
+    [BC_CALL] = &&CASE(BC_CALL),
+    [BC_TAIL_CALL] = &&CASE(BC_TAIL_CALL),
+    [BC_INSTANCE] = &&CASE(BC_INSTANCE),
+    [BC_CLOSURE] = &&CASE(BC_CLOSURE),
+    [BC_CLOSE_UPVALUE] = &&CASE(BC_CLOSE_UPVALUE),
+    [BC_RETURN] = &&CASE(BC_RETURN),
+    [BC_ENUM] = &&CASE(BC_ENUM),
+    [BC_ENUM_VALUE] = &&CASE(BC_ENUM_VALUE),
+    [BC_STRUCT] = &&CASE(BC_STRUCT),
+    [BC_STRUCT_FIELD] = &&CASE(BC_STRUCT_FIELD),
+    [BC_METHOD] = &&CASE(BC_METHOD),
+    [BC_STATIC_METHOD] = &&CASE(BC_STATIC_METHOD),
+    [BC_INVOKE] = &&CASE(BC_INVOKE),
+    [BC_TAIL_INVOKE] = &&CASE(BC_TAIL_INVOKE),
+    [BC_CALL_STATIC] = &&CASE(BC_CALL_STATIC),
+    [BC_TAIL_CALL_STATIC] = &&CASE(BC_TAIL_CALL_STATIC),
+    [BC_JUMP_IF_NOT_CALLEE] = &&CASE(BC_JUMP_IF_NOT_CALLEE),
+    [BC_POP_JUMP_IF_FALSE] = &&CASE(BC_POP_JUMP_IF_FALSE),
+    [BC_JUMP_IF_NOT_EQUAL] = &&CASE(BC_JUMP_IF_NOT_EQUAL),
+    [BC_JUMP_IF_EQUAL] = &&CASE(BC_JUMP_IF_EQUAL),
+    [BC_JUMP_IF_NOT_GREATER] = &&CASE(BC_JUMP_IF_NOT_GREATER),
+    [BC_JUMP_IF_NOT_GREATER_EQUAL] = &&CASE(BC_JUMP_IF_NOT_GREATER_EQUAL),
+    [BC_JUMP_IF_NOT_LESSER] = &&CASE(BC_JUMP_IF_NOT_LESSER),
+    [BC_JUMP_IF_NOT_LESSER_EQUAL] = &&CASE(BC_JUMP_IF_NOT_LESSER_EQUAL),
+    [BC_ADD_LOCALS] = &&CASE(BC_ADD_LOCALS),
+    [BC_SUBTRACT_LOCALS] = &&CASE(BC_SUBTRACT_LOCALS),
+    [BC_ADD_LOCAL_CONSTANT] = &&CASE(BC_ADD_LOCAL_CONSTANT),
+    [BC_SUBTRACT_LOCAL_CONSTANT] = &&CASE(BC_SUBTRACT_LOCAL_CONSTANT),
+    [BC_INVOKE_LOCAL] = &&CASE(BC_INVOKE_LOCAL),
+    [BC_SET_LOCAL_POP] = &&CASE(BC_SET_LOCAL_POP),
+    [BC_MOVE] = &&CASE(BC_MOVE),
+    [BC_LOAD_CONSTANT] = &&CASE(BC_LOAD_CONSTANT),
+    [BC_ADD_RR] = &&CASE(BC_ADD_RR),
+    [BC_SUBTRACT_RR] = &&CASE(BC_SUBTRACT_RR),
+    [BC_MULTIPLY_RR] = &&CASE(BC_MULTIPLY_RR),
+    [BC_DIVIDE_RR] = &&CASE(BC_DIVIDE_RR),
+    [BC_ADD_RK] = &&CASE(BC_ADD_RK),
+    [BC_SUBTRACT_RK] = &&CASE(BC_SUBTRACT_RK),
+    [BC_MULTIPLY_RK] = &&CASE(BC_MULTIPLY_RK),
+    [BC_DIVIDE_RK] = &&CASE(BC_DIVIDE_RK),
+    [BC_JUMP_IF_NOT_EQUAL_RR] = &&CASE(BC_JUMP_IF_NOT_EQUAL_RR),
+    [BC_JUMP_IF_EQUAL_RR] = &&CASE(BC_JUMP_IF_EQUAL_RR),
+    [BC_JUMP_IF_NOT_GREATER_RR] = &&CASE(BC_JUMP_IF_NOT_GREATER_RR),
+    [BC_JUMP_IF_NOT_GREATER_EQUAL_RR] = &&CASE(BC_JUMP_IF_NOT_GREATER_EQUAL_RR),
+    [BC_JUMP_IF_NOT_LESSER_RR] = &&CASE(BC_JUMP_IF_NOT_LESSER_RR),
+    [BC_JUMP_IF_NOT_LESSER_EQUAL_RR] = &&CASE(BC_JUMP_IF_NOT_LESSER_EQUAL_RR),
+    [BC_JUMP_IF_NOT_EQUAL_RK] = &&CASE(BC_JUMP_IF_NOT_EQUAL_RK),
+    [BC_JUMP_IF_EQUAL_RK] = &&CASE(BC_JUMP_IF_EQUAL_RK),
+    [BC_JUMP_IF_NOT_GREATER_RK] = &&CASE(BC_JUMP_IF_NOT_GREATER_RK),
+    [BC_JUMP_IF_NOT_GREATER_EQUAL_RK] = &&CASE(BC_JUMP_IF_NOT_GREATER_EQUAL_RK),
+    [BC_JUMP_IF_NOT_LESSER_RK] = &&CASE(BC_JUMP_IF_NOT_LESSER_RK),
+    [BC_JUMP_IF_NOT_LESSER_EQUAL_RK] = &&CASE(BC_JUMP_IF_NOT_LESSER_EQUAL_RK),
+    [BC_EQUAL_NUM] = &&CASE(BC_EQUAL_NUM),
+    [BC_NOT_EQUAL_NUM] = &&CASE(BC_NOT_EQUAL_NUM),
+    [BC_JUMP_IF_NOT_EQUAL_NUM] = &&CASE(BC_JUMP_IF_NOT_EQUAL_NUM),
+    [BC_JUMP_IF_EQUAL_NUM] = &&CASE(BC_JUMP_IF_EQUAL_NUM),
+    [BC_JUMP_IF_NOT_EQUAL_NUM_RR] = &&CASE(BC_JUMP_IF_NOT_EQUAL_NUM_RR),
+    [BC_JUMP_IF_EQUAL_NUM_RR] = &&CASE(BC_JUMP_IF_EQUAL_NUM_RR),
+    [BC_JUMP_IF_NOT_EQUAL_NUM_RK] = &&CASE(BC_JUMP_IF_NOT_EQUAL_NUM_RK),
+    [BC_JUMP_IF_EQUAL_NUM_RK] = &&CASE(BC_JUMP_IF_EQUAL_NUM_RK),
+    [BC_BREAK] = &&CASE(BC_BREAK),
+  };
+#else
+#define CASE(name) case name
+#define DISPATCH() goto dispatch
+#define INTERPRET_LOOP \
+    dispatch: \
+      TRACE_EXECUTION(); \
+      RECORD_TRACE(); \
+      switch (instruction = READ_BYTE())
+#endif
+
+  struct CallFrame* frame = &H->frames[H->frameCount - 1];
+  u8* ip = frame->ip;
+  u8 instruction;
+#ifdef JIT
+  bool recording = H->recorder != NULL;
+#endif
+
+  ENTER_JIT();
+  INTERPRET_LOOP
+  {
+    CASE(BC_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      push(H, constant);
+      DISPATCH();
+    }
+    CASE(BC_NIL):   push(H, NEW_NIL); DISPATCH();
+    CASE(BC_TRUE):  push(H, NEW_BOOL(true)); DISPATCH();
+    CASE(BC_FALSE): push(H, NEW_BOOL(false)); DISPATCH();
+    CASE(BC_POP): pop(H); DISPATCH();
+    CASE(BC_ARRAY): {
+      u8 elementCount = READ_BYTE();
+      struct Array* array = newArray(H);
+      push(H, NEW_OBJ(array));
+      reserveValueArray(H, &array->values, elementCount);
+      for (u8 i = 1; i <= elementCount; i++) {
+        writeValueArray(H, &array->values, peek(H, elementCount - i + 1));
       }
-      case BC_GREATER:       BINARY_OP(NEW_BOOL, >); break;
-      case BC_GREATER_EQUAL: BINARY_OP(NEW_BOOL, >=); break;
-      case BC_LESSER:        BINARY_OP(NEW_BOOL, <); break;
-      case BC_LESSER_EQUAL:  BINARY_OP(NEW_BOOL, <=); break;
-      case BC_ADD:           BINARY_OP(NEW_NUMBER, +); break;
-      case BC_SUBTRACT:      BINARY_OP(NEW_NUMBER, -); break;
-      case BC_MULTIPLY:      BINARY_OP(NEW_NUMBER, *); break;
-      case BC_DIVIDE:        BINARY_OP(NEW_NUMBER, /); break;
-      case BC_MODULO: {
-        if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 0))) {
-          runtimeError(H, "Operands must be numbers.");
-          return RUNTIME_ERR;
-        }
-        f64 b = AS_NUMBER(pop(H));
-        f64 a = AS_NUMBER(pop(H));
-        push(H, NEW_NUMBER(fmod(a, b)));
-        break;
+      H->stackTop -= elementCount + 1;
+      push(H, NEW_OBJ(array));
+      DISPATCH();
+    }
+    CASE(BC_GET_SUBSCRIPT): {
+      if (!IS_NUMBER(peek(H, 0))) {
+        RUNTIME_ERROR("Can only use subscript operator with numbers.");
       }
-      case BC_POW: {
-        if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 0))) {
-          runtimeError(H, "Operands must be numbers.");
-          return RUNTIME_ERR;
+      s32 index = valueToIndex(peek(H, 0));
+
+      if (!IS_ARRAY(peek(H, 1))) {
+        RUNTIME_ERROR("Invalid target for subscript operator.");
+      }
+
+      struct Array* array = AS_ARRAY(peek(H, 1));
+
+      if (index < 0 || index > array->values.count) {
+        RUNTIME_ERROR("Index out of bounds. Array size is %d, but tried accessing %d",
+            array->values.count, index);
+      }
+
+      pop(H); // Index
+      pop(H); // Array
+      push(H, array->values.values[index]);
+      DISPATCH();
+    }
+    CASE(BC_SET_SUBSCRIPT): {
+      if (!IS_NUMBER(peek(H, 1))) {
+        RUNTIME_ERROR("Can only use subscript operator with numbers.");
+      }
+      s32 index = valueToIndex(peek(H, 1));
+
+      if (!IS_ARRAY(peek(H, 2))) {
+        RUNTIME_ERROR("Invalid target for subscript operator.");
+      }
+
+      struct Array* array = AS_ARRAY(peek(H, 2));
+
+      if (index < 0 || index > array->values.count) {
+        RUNTIME_ERROR("Index out of bounds. Array size is %d, but tried accessing %d",
+            array->values.count, index);
+      }
+
+      array->values.values[index] = pop(H);
+      pop(H); // Index
+      pop(H); // Array
+      push(H, array->values.values[index]);
+      DISPATCH();
+    }
+    CASE(BC_GET_GLOBAL): {
+      u16 slot = READ_SHORT();
+      Value value = H->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(H->globalNames.values[slot]));
+      }
+      push(H, value);
+      DISPATCH();
+    }
+    CASE(BC_SET_GLOBAL): {
+      u16 slot = READ_SHORT();
+      Value* value = &H->globalValues.values[slot];
+      if (IS_UNDEFINED(*value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(H->globalNames.values[slot]));
+      }
+      *value = peek(H, 0);
+      DISPATCH();
+    }
+    CASE(BC_DEFINE_GLOBAL): {
+      u16 slot = READ_SHORT();
+      Value* value = &H->globalValues.values[slot];
+      if (!IS_UNDEFINED(*value)) {
+        RUNTIME_ERROR("Redefinition of '%s'.", AS_CSTRING(H->globalNames.values[slot]));
+      }
+      *value = pop(H);
+      DISPATCH();
+    }
+    CASE(BC_GET_UPVALUE): {
+      u8 slot = READ_BYTE();
+      push(H, upvalueValue(frame->closure->upvalues[slot]));
+      DISPATCH();
+    }
+    CASE(BC_SET_UPVALUE): {
+      u8 slot = READ_BYTE();
+      // Variables that get assigned are always boxed.
+      *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(H, 0);
+      DISPATCH();
+    }
+    CASE(BC_GET_LOCAL): {
+      u8 slot = READ_BYTE();
+      push(H, frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(BC_SET_LOCAL): {
+      u8 slot = READ_BYTE();
+      frame->slots[slot] = peek(H, 0);
+      DISPATCH();
+    }
+    CASE(BC_INIT_PROPERTY): {
+      STORE_FRAME();
+      if (!setProperty(H, READ_STRING(), NULL)) {
+        return RUNTIME_ERR;
+      }
+
+      pop(H); // Value
+      DISPATCH();
+    }
+    CASE(BC_GET_STATIC): {
+      STORE_FRAME();
+      if (!getStatic(H, peek(H, 0), READ_STRING())) {
+        return RUNTIME_ERR;
+      }
+      DISPATCH();
+    }
+    CASE(BC_PUSH_PROPERTY):
+    CASE(BC_GET_PROPERTY): {
+      struct String* name = READ_STRING();
+      struct InlineCache* cache = READ_CACHE();
+      Value object = peek(H, 0);
+      if (IS_INSTANCE(object)) {
+        struct Instance* instance = AS_INSTANCE(object);
+        struct InlineCacheEntry* cached = findCacheEntry(cache, instance->strooct);
+        if (cached != NULL && cached->method != NULL) {
+          bindMethod(H, instance, cached->method, instruction == BC_GET_PROPERTY);
+          DISPATCH();
+        }
+        if (cached != NULL && cached->field < instance->fieldCount) {
+          if (instruction == BC_GET_PROPERTY) {
+            pop(H); // Instance
+          }
+          push(H, instance->fields[cached->field]);
+          DISPATCH();
         }
-        f64 b = AS_NUMBER(pop(H));
-        f64 a = AS_NUMBER(pop(H));
-        push(H, NEW_NUMBER(pow(a, b)));
-        break;
       }
-      case BC_NEGATE: {
-        if (!IS_NUMBER(peek(H, 0))) {
-          runtimeError(H, "Operand must be a number.");
+
+      STORE_FRAME();
+      if (!getProperty(H, object, name, instruction == BC_GET_PROPERTY, cache)) {
+        return RUNTIME_ERR;
+      }
+      DISPATCH();
+    }
+    CASE(BC_SET_PROPERTY): {
+      struct String* name = READ_STRING();
+      struct InlineCache* cache = READ_CACHE();
+      Value object = peek(H, 1);
+      struct Instance* instance = IS_INSTANCE(object) ? AS_INSTANCE(object) : NULL;
+      struct InlineCacheEntry* cached = instance != NULL
+          ? findCacheEntry(cache, instance->strooct)
+          : NULL;
+      if (cached != NULL && cached->field < instance->fieldCount) {
+        instance->fields[cached->field] = peek(H, 0);
+      } else {
+        STORE_FRAME();
+        if (!setProperty(H, name, cache)) {
           return RUNTIME_ERR;
         }
-        push(H, NEW_NUMBER(-AS_NUMBER(pop(H))));
-        break;
       }
-      case BC_NOT: {
-        push(H, NEW_BOOL(isFalsey(pop(H))));
-        break;
+
+      // Removing the instance while keeping the rhs value on top.
+      Value value = pop(H);
+      pop(H);
+      push(H, value);
+      DISPATCH();
+    }
+    CASE(BC_GET_SELF_FIELD): {
+      struct Instance* instance = AS_INSTANCE(frame->slots[0]);
+      u8 field = READ_BYTE();
+      if (field >= instance->fieldCount) {
+        RUNTIME_ERROR("Undefined property '%s'.", fieldName(instance->strooct, field)->chars);
       }
-      case BC_JUMP: {
-        u16 offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+      push(H, instance->fields[field]);
+      DISPATCH();
+    }
+    CASE(BC_SET_SELF_FIELD): {
+      struct Instance* instance = AS_INSTANCE(frame->slots[0]);
+      u8 field = READ_BYTE();
+      if (field >= instance->fieldCount) {
+        RUNTIME_ERROR("Undefined property '%s'.", fieldName(instance->strooct, field)->chars);
       }
-      case BC_JUMP_IF_FALSE: {
-        u16 offset = READ_SHORT();
-        if (isFalsey(peek(H, 0))) {
-          frame->ip += offset;
-        }
-        break;
+      instance->fields[field] = peek(H, 0);
+      DISPATCH();
+    }
+    CASE(BC_DESTRUCT_ARRAY): {
+      u8 index = READ_BYTE();
+
+      if (!IS_ARRAY(peek(H, 0))) {
+        RUNTIME_ERROR("Can only destruct arrays");
+      }
+      struct Array* array = AS_ARRAY(peek(H, 0));
+
+      push(H, array->values.values[index]);
+      DISPATCH();
+    }
+    CASE(BC_EQUAL): {
+      Value b = pop(H);
+      Value a = pop(H);
+      push(H, NEW_BOOL(quickenEquality(OPCODE(), BC_EQUAL_NUM, a, b)));
+      DISPATCH();
+    }
+    CASE(BC_NOT_EQUAL): {
+      Value b = pop(H);
+      Value a = pop(H);
+      push(H, NEW_BOOL(!quickenEquality(OPCODE(), BC_NOT_EQUAL_NUM, a, b)));
+      DISPATCH();
+    }
+    CASE(BC_EQUAL_NUM): {
+      Value b = pop(H);
+      Value a = pop(H);
+      push(H, NEW_BOOL(NUMBER_EQUALS(OPCODE(), BC_EQUAL, a, b, true)));
+      DISPATCH();
+    }
+    CASE(BC_NOT_EQUAL_NUM): {
+      Value b = pop(H);
+      Value a = pop(H);
+      push(H, NEW_BOOL(!NUMBER_EQUALS(OPCODE(), BC_NOT_EQUAL, a, b, true)));
+      DISPATCH();
+    }
+    CASE(BC_CONCAT): {
+      if (!IS_STRING(peek(H, 0)) || !IS_STRING(peek(H, 1))) {
+        RUNTIME_ERROR("Operands must be strings.");
+      }
+      concatenate(H);
+      DISPATCH();
+    }
+    CASE(BC_GREATER):       COMPARISON_OP(>); DISPATCH();
+    CASE(BC_GREATER_EQUAL): COMPARISON_OP(>=); DISPATCH();
+    CASE(BC_LESSER):        COMPARISON_OP(<); DISPATCH();
+    CASE(BC_LESSER_EQUAL):  COMPARISON_OP(<=); DISPATCH();
+    CASE(BC_ADD):           ARITHMETIC_OP(addInts, +); DISPATCH();
+    CASE(BC_SUBTRACT):      ARITHMETIC_OP(subtractInts, -); DISPATCH();
+    CASE(BC_MULTIPLY):      ARITHMETIC_OP(multiplyInts, *); DISPATCH();
+    CASE(BC_DIVIDE):        ARITHMETIC_OP(divideInts, /); DISPATCH();
+    CASE(BC_MODULO): {
+      if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 0))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      Value b = pop(H);
+      Value a = pop(H);
+      push(H, moduloNumbers(a, b));
+      DISPATCH();
+    }
+    CASE(BC_POW): {
+      if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 0))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      f64 b = AS_NUMBER(pop(H));
+      f64 a = AS_NUMBER(pop(H));
+      push(H, NEW_NUMBER(pow(a, b)));
+      DISPATCH();
+    }
+    CASE(BC_NEGATE): {
+      if (!IS_NUMBER(peek(H, 0))) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      push(H, negateNumber(pop(H)));
+      DISPATCH();
+    }
+    CASE(BC_NOT): {
+      push(H, NEW_BOOL(isFalsey(pop(H))));
+      DISPATCH();
+    }
+    CASE(BC_JUMP): {
+      u16 offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_FALSE): {
+      u16 offset = READ_SHORT();
+      if (isFalsey(peek(H, 0))) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_INEQUALITY_JUMP): {
+      u16 offset = READ_SHORT();
+      Value b = pop(H);
+      Value a = peek(H, 0);
+      if (!valuesEqual(a, b)) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_SWITCH): {
+      s32 low = (s16)READ_SHORT();
+      s32 count = READ_BYTE();
+      ip += switchEntry(peek(H, 0), low, count) * 2;
+      u16 offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(BC_LOOP): {
+      u16 offset = READ_SHORT();
+#ifdef JIT
+      STORE_FRAME();
+      if (jitLoop(H, frame, offset) == JIT_ERROR) {
+        return RUNTIME_ERR;
+      }
+      recording = H->recorder != NULL;
+      ip = frame->ip;
+#else
+      ip -= offset;
+#endif
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_FOR_PREP): {
+      Value* counter = &frame->slots[READ_BYTE()];
+      u16 offset = READ_SHORT();
+      STORE_FRAME();
+      if (!checkForRange(H, counter)) {
+        return RUNTIME_ERR;
+      }
+      if (!forContinues(counter)) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_FOR_LOOP): {
+      Value* counter = &frame->slots[READ_BYTE()];
+      u16 offset = READ_SHORT();
+      Value next;
+      NUMBER_BINARY(counter[0], addInts, +, counter[2], next);
+      counter[0] = next;
+      if (!forContinues(counter)) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_FOR_IN_PREP): {
+      Value* collection = &frame->slots[READ_BYTE()];
+      STORE_FRAME();
+      if (!checkIterable(H, collection)) {
+        return RUNTIME_ERR;
+      }
+      DISPATCH();
+    }
+    CASE(BC_FOR_IN_LOOP): {
+      Value* collection = &frame->slots[READ_BYTE()];
+      u16 offset = READ_SHORT();
+      if (!iterate(H, collection)) {
+        ip += offset;
       }
-      case BC_INEQUALITY_JUMP: {
-        u16 offset = READ_SHORT();
-        Value b = pop(H);
-        Value a = peek(H, 0);
-        if (!valuesEqual(a, b)) {
-          frame->ip += offset;
+      DISPATCH();
+    }
+    CASE(BC_CALL): {
+      s32 argCount = READ_BYTE();
+      Value callee = peek(H, argCount);
+      STORE_FRAME();
+      if (IS_CFUNCTION(callee)) {
+        // No frame gets pushed, so there's none to load or enter.
+        if (!callNative(H, AS_CFUNCTION(callee), argCount)) {
+          return RUNTIME_ERR;
         }
-        break;
+        DISPATCH();
       }
-      case BC_LOOP: {
-        u16 offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      if (!callValue(H, callee, argCount)) {
+        return RUNTIME_ERR;
       }
-      case BC_CALL: {
-        s32 argCount = READ_BYTE();
-        if (!callValue(H, peek(H, argCount), argCount)) {
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_TAIL_INVOKE):
+    CASE(BC_TAIL_CALL_STATIC):
+    CASE(BC_TAIL_CALL): {
+      s32 argCount;
+      struct Closure* closure = NULL;
+      if (instruction == BC_TAIL_INVOKE) {
+        struct String* name = READ_STRING();
+        argCount = READ_BYTE();
+        struct InlineCache* cache = READ_CACHE();
+        closure = tailInvokeTarget(peek(H, argCount), name, cache);
+        if (closure == NULL || closure->function->arity != argCount) {
+          STORE_FRAME();
+          if (!invoke(H, name, argCount, cache)) {
+            return RUNTIME_ERR;
+          }
+          LOAD_FRAME();
+          ENTER_JIT();
+          DISPATCH();
+        }
+      } else if (instruction == BC_TAIL_CALL_STATIC) {
+        struct String* name = READ_STRING();
+        argCount = READ_BYTE();
+        struct InlineCache* cache = READ_CACHE();
+        STORE_FRAME();
+        if (!getStaticCallee(H, name, argCount, cache)) {
           return RUNTIME_ERR;
         }
-        frame = &H->frames[H->frameCount - 1];
-        break;
+      } else {
+        argCount = READ_BYTE();
+      }
+      // A method BC_TAIL_INVOKE found already has its receiver in place.
+      Value* callee = H->stackTop - argCount - 1;
+      Value receiver = *callee;
+      if (closure == NULL) {
+        if (IS_CLOSURE(*callee)) {
+          closure = AS_CLOSURE(*callee);
+        } else if (IS_BOUND_METHOD(*callee)) {
+          closure = AS_BOUND_METHOD(*callee)->method;
+          receiver = AS_BOUND_METHOD(*callee)->receiver;
+        }
       }
-      case BC_INSTANCE: {
-        if (!IS_STRUCT(peek(H, 0))) {
-          runtimeError(H, "Can only use struct initialization on structs.");
+
+      if (closure == NULL || closure->function->arity != argCount) {
+        // Natives and arity errors take the normal path, a native's result
+        // is then returned by the BC_RETURN that follows.
+        STORE_FRAME();
+        if (!callValue(H, *callee, argCount)) {
           return RUNTIME_ERR;
         }
-        struct Struct* strooct = AS_STRUCT(peek(H, 0));
-        Value instance = NEW_OBJ(newInstance(H, strooct));
-        pop(H); // Struct
-        push(H, instance);
-        break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
-      case BC_CLOSURE: {
-        struct Function* function = AS_FUNCTION(READ_CONSTANT());
-        struct Closure* closure = newClosure(H, function);
-        push(H, NEW_OBJ(closure));
-        for (s32 i = 0; i < closure->upvalueCount; i++) {
-          u8 isLocal = READ_BYTE();
-          u8 index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(H, frame->slots + index);
-          } else {
+
+      // The callee takes over this frame, slide it and its arguments down.
+      *callee = receiver;
+      closeUpvalues(H, frame->slots);
+      memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+      H->stackTop = frame->slots + argCount + 1;
+      frame->closure = closure;
+      reserveFrameStack(H, closure, argCount);
+#ifdef JIT
+      countCall(H, closure->function);
+#endif
+      ip = closure->function->bc;
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_INSTANCE): {
+      if (!IS_STRUCT(peek(H, 0))) {
+        RUNTIME_ERROR("Can only use struct initialization on structs.");
+      }
+      struct Struct* strooct = AS_STRUCT(peek(H, 0));
+      Value instance = NEW_OBJ(newInstance(H, strooct));
+      pop(H); // Struct
+      push(H, instance);
+      DISPATCH();
+    }
+    CASE(BC_CLOSURE): {
+      struct Function* function = AS_FUNCTION(READ_CONSTANT());
+      struct Closure* closure = newClosure(H, function);
+      push(H, NEW_OBJ(closure));
+      for (s32 i = 0; i < closure->upvalueCount; i++) {
+        u8 capture = READ_BYTE();
+        u8 index = READ_BYTE();
+        switch (capture) {
+          case CAPTURE_UPVALUE:
             closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+            break;
+          case CAPTURE_LOCAL:
+            closure->upvalues[i] = NEW_OBJ(captureUpvalue(H, frame->slots + index));
+            break;
+          case CAPTURE_VALUE:
+            closure->upvalues[i] = frame->slots[index];
+            break;
         }
-        break;
       }
-      case BC_CLOSE_UPVALUE: {
-        closeUpvalues(H, H->stackTop - 1);
+      DISPATCH();
+    }
+    CASE(BC_CLOSE_UPVALUE): {
+      closeUpvalues(H, H->stackTop - 1);
+      pop(H);
+      DISPATCH();
+    }
+    CASE(BC_RETURN): {
+      Value result = pop(H);
+      closeUpvalues(H, frame->slots);
+      H->frameCount--;
+      if (H->frameCount == 0) {
         pop(H);
-        break;
+        return INTERPRET_OK;
       }
-      case BC_RETURN: {
-        Value result = pop(H);
-        closeUpvalues(H, frame->slots);
-        H->frameCount--;
-        if (H->frameCount == 0) {
-          pop(H);
-          return INTERPRET_OK;
-        }
 
-        H->stackTop = frame->slots;
-        push(H, result);
-        frame = &H->frames[H->frameCount - 1];
-        break;
+      H->stackTop = frame->slots;
+      push(H, result);
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_ENUM): {
+      push(H, NEW_OBJ(newEnum(H, READ_STRING())));
+      DISPATCH();
+    }
+    CASE(BC_ENUM_VALUE): {
+      struct Enum* enoom = AS_ENUM(peek(H, 0));
+      struct String* name = READ_STRING();
+      tableSet(H, &enoom->values, name, NEW_INT(READ_BYTE()));
+      DISPATCH();
+    }
+    CASE(BC_STRUCT): {
+      push(H, NEW_OBJ(newStruct(H, READ_STRING())));
+      DISPATCH();
+    }
+    CASE(BC_METHOD): {
+      struct Struct* strooct = AS_STRUCT(peek(H, 1));
+      defineMethod(H, READ_STRING(), &strooct->methods);
+      DISPATCH();
+    }
+    CASE(BC_STATIC_METHOD): {
+      struct Struct* strooct = AS_STRUCT(peek(H, 1));
+      defineMethod(H, READ_STRING(), &strooct->staticMethods);
+      DISPATCH();
+    }
+    CASE(BC_INVOKE): {
+      struct String* method = READ_STRING();
+      s32 argCount = READ_BYTE();
+      struct InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(H, method, argCount, cache)) {
+        return RUNTIME_ERR;
       }
-      case BC_ENUM: {
-        push(H, NEW_OBJ(newEnum(H, READ_STRING())));
-        break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_CALL_STATIC): {
+      struct String* name = READ_STRING();
+      s32 argCount = READ_BYTE();
+      struct InlineCache* cache = READ_CACHE();
+      STORE_FRAME();
+      if (!getStaticCallee(H, name, argCount, cache)) {
+        return RUNTIME_ERR;
       }
-      case BC_ENUM_VALUE: {
-        struct Enum* enoom = AS_ENUM(peek(H, 0));
-        struct String* name = READ_STRING();
-        f64 value = (f64)READ_BYTE();
-        tableSet(H, &enoom->values, name, NEW_NUMBER(value));
-        break;
+
+      // Only an enum's value can be something other than a closure here.
+      Value callee = peek(H, argCount);
+      bool called = IS_CLOSURE(callee)
+          ? call(H, AS_CLOSURE(callee), argCount)
+          : callValue(H, callee, argCount);
+      if (!called) {
+        return RUNTIME_ERR;
       }
-      case BC_STRUCT: {
-        push(H, NEW_OBJ(newStruct(H, READ_STRING())));
-        break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_NOT_CALLEE): {
+      s32 argCount = READ_BYTE();
+      Value callee = READ_CONSTANT();
+      u16 offset = READ_SHORT();
+      if (!isCallee(peek(H, argCount), callee)) {
+        ip += offset;
       }
-      case BC_METHOD: {
-        struct Struct* strooct = AS_STRUCT(peek(H, 1));
-        defineMethod(H, READ_STRING(), &strooct->methods);
-        break;
+      DISPATCH();
+    }
+    CASE(BC_STRUCT_FIELD): {
+      struct String* key = READ_STRING();
+      Value defaultValue = peek(H, 0);
+      struct Struct* strooct = AS_STRUCT(peek(H, 1));
+
+      // A repeated field keeps its first slot and takes the new default.
+      Value slot;
+      if (tableGet(&strooct->fields, key, &slot)) {
+        strooct->defaultFields.values[AS_INT(slot)] = defaultValue;
+      } else {
+        tableSet(H, &strooct->fields, key, NEW_INT(strooct->defaultFields.count));
+        writeValueArray(H, &strooct->defaultFields, defaultValue);
       }
-      case BC_STATIC_METHOD: {
-        struct Struct* strooct = AS_STRUCT(peek(H, 1));
-        defineMethod(H, READ_STRING(), &strooct->staticMethods);
-        break;
+      pop(H); // Default value
+      DISPATCH();
+    }
+    CASE(BC_POP_JUMP_IF_FALSE): {
+      u16 offset = READ_SHORT();
+      if (isFalsey(pop(H))) {
+        ip += offset;
       }
-      case BC_INVOKE: {
-        struct String* method = READ_STRING();
-        s32 argCount = READ_BYTE();
-        if (!invoke(H, method, argCount)) {
-          return RUNTIME_ERR;
-        }
-        frame = &H->frames[H->frameCount - 1];
-        break;
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_NOT_EQUAL): {
+      u8* opcode = OPCODE();
+      u16 offset = READ_SHORT();
+      Value b = pop(H);
+      Value a = pop(H);
+      if (!quickenEquality(opcode, BC_JUMP_IF_NOT_EQUAL_NUM, a, b)) {
+        ip += offset;
       }
-      case BC_STRUCT_FIELD: {
-        struct String* key = READ_STRING();
-        Value defaultValue = pop(H);
-        struct Struct* strooct = AS_STRUCT(peek(H, 0));
-        tableSet(H, &strooct->defaultFields, key, defaultValue);
-        break;
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_EQUAL): {
+      u8* opcode = OPCODE();
+      u16 offset = READ_SHORT();
+      Value b = pop(H);
+      Value a = pop(H);
+      if (quickenEquality(opcode, BC_JUMP_IF_EQUAL_NUM, a, b)) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_NOT_EQUAL_NUM): {
+      u8* opcode = OPCODE();
+      u16 offset = READ_SHORT();
+      Value b = pop(H);
+      Value a = pop(H);
+      if (!NUMBER_EQUALS(opcode, BC_JUMP_IF_NOT_EQUAL, a, b, true)) {
+        ip += offset;
       }
-      // This opcode is only a placeholder for a jump instruction
-      case BC_BREAK: {
-        runtimeError(H, "Invalid Opcode");
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_EQUAL_NUM): {
+      u8* opcode = OPCODE();
+      u16 offset = READ_SHORT();
+      Value b = pop(H);
+      Value a = pop(H);
+      if (NUMBER_EQUALS(opcode, BC_JUMP_IF_EQUAL, a, b, true)) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(BC_JUMP_IF_NOT_GREATER):       COMPARE_JUMP(>); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(>=); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER):        COMPARE_JUMP(<); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER_EQUAL):  COMPARE_JUMP(<=); DISPATCH();
+    CASE(BC_ADD_LOCALS):              LOCAL_BINARY_OP(addInts, +, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_SUBTRACT_LOCALS):         LOCAL_BINARY_OP(subtractInts, -, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_ADD_LOCAL_CONSTANT):      LOCAL_BINARY_OP(addInts, +, READ_CONSTANT()); DISPATCH();
+    CASE(BC_SUBTRACT_LOCAL_CONSTANT): LOCAL_BINARY_OP(subtractInts, -, READ_CONSTANT()); DISPATCH();
+    CASE(BC_INVOKE_LOCAL): {
+      Value receiver = frame->slots[READ_BYTE()];
+      struct String* method = READ_STRING();
+      s32 argCount = READ_BYTE();
+      struct InlineCache* cache = READ_CACHE();
+
+      // The arguments were pushed without the receiver, slide them up.
+      Value* args = H->stackTop - argCount;
+      memmove(args + 1, args, sizeof(Value) * argCount);
+      *args = receiver;
+      H->stackTop++;
+
+      STORE_FRAME();
+      if (!invoke(H, method, argCount, cache)) {
         return RUNTIME_ERR;
       }
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(BC_SET_LOCAL_POP): {
+      u8 slot = READ_BYTE();
+      frame->slots[slot] = pop(H);
+      DISPATCH();
+    }
+    CASE(BC_MOVE): {
+      u8 dest = READ_BYTE();
+      frame->slots[dest] = frame->slots[READ_BYTE()];
+      DISPATCH();
+    }
+    CASE(BC_LOAD_CONSTANT): {
+      u8 dest = READ_BYTE();
+      frame->slots[dest] = READ_CONSTANT();
+      DISPATCH();
+    }
+    CASE(BC_ADD_RR):      REGISTER_ARITHMETIC(addInts, +, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_SUBTRACT_RR): REGISTER_ARITHMETIC(subtractInts, -, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_MULTIPLY_RR): REGISTER_ARITHMETIC(multiplyInts, *, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_DIVIDE_RR):   REGISTER_ARITHMETIC(divideInts, /, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_ADD_RK):      REGISTER_ARITHMETIC(addInts, +, READ_CONSTANT()); DISPATCH();
+    CASE(BC_SUBTRACT_RK): REGISTER_ARITHMETIC(subtractInts, -, READ_CONSTANT()); DISPATCH();
+    CASE(BC_MULTIPLY_RK): REGISTER_ARITHMETIC(multiplyInts, *, READ_CONSTANT()); DISPATCH();
+    CASE(BC_DIVIDE_RK):   REGISTER_ARITHMETIC(divideInts, /, READ_CONSTANT()); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_EQUAL_RR):         REGISTER_EQUALITY_JUMP(false, frame->slots[READ_BYTE()], BC_JUMP_IF_NOT_EQUAL_NUM_RR); DISPATCH();
+    CASE(BC_JUMP_IF_EQUAL_RR):             REGISTER_EQUALITY_JUMP(true, frame->slots[READ_BYTE()], BC_JUMP_IF_EQUAL_NUM_RR); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_GREATER_RR):       REGISTER_COMPARE_JUMP(>, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_GREATER_EQUAL_RR): REGISTER_COMPARE_JUMP(>=, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER_RR):        REGISTER_COMPARE_JUMP(<, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER_EQUAL_RR):  REGISTER_COMPARE_JUMP(<=, frame->slots[READ_BYTE()]); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_EQUAL_RK):         REGISTER_EQUALITY_JUMP(false, READ_CONSTANT(), BC_JUMP_IF_NOT_EQUAL_NUM_RK); DISPATCH();
+    CASE(BC_JUMP_IF_EQUAL_RK):             REGISTER_EQUALITY_JUMP(true, READ_CONSTANT(), BC_JUMP_IF_EQUAL_NUM_RK); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_GREATER_RK):       REGISTER_COMPARE_JUMP(>, READ_CONSTANT()); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_GREATER_EQUAL_RK): REGISTER_COMPARE_JUMP(>=, READ_CONSTANT()); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER_RK):        REGISTER_COMPARE_JUMP(<, READ_CONSTANT()); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_LESSER_EQUAL_RK):  REGISTER_COMPARE_JUMP(<=, READ_CONSTANT()); DISPATCH();
+    CASE(BC_JUMP_IF_NOT_EQUAL_NUM_RR):
+      REGISTER_NUMBER_EQUALITY_JUMP(false, frame->slots[READ_BYTE()], BC_JUMP_IF_NOT_EQUAL_RR, true);
+      DISPATCH();
+    CASE(BC_JUMP_IF_EQUAL_NUM_RR):
+      REGISTER_NUMBER_EQUALITY_JUMP(true, frame->slots[READ_BYTE()], BC_JUMP_IF_EQUAL_RR, true);
+      DISPATCH();
+    CASE(BC_JUMP_IF_NOT_EQUAL_NUM_RK):
+      REGISTER_NUMBER_EQUALITY_JUMP(false, READ_CONSTANT(), BC_JUMP_IF_NOT_EQUAL_RK, false);
+      DISPATCH();
+    CASE(BC_JUMP_IF_EQUAL_NUM_RK):
+      REGISTER_NUMBER_EQUALITY_JUMP(true, READ_CONSTANT(), BC_JUMP_IF_EQUAL_RK, false);
+      DISPATCH();
+    // This opcode is only a placeholder for a jump instruction
+    CASE(BC_BREAK): {
+      RUNTIME_ERROR("Invalid Opcode");
     }
   }
 
+  RUNTIME_ERROR("Unknown opcode %d.", instruction);
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
-#undef BINARY_OP
+#undef READ_CACHE
+#undef NUMBER_BINARY
+#undef NUMBER_COMPARE
+#undef ARITHMETIC_OP
+#undef COMPARISON_OP
+#undef LOCAL_BINARY_OP
+#undef COMPARE_JUMP
+#undef REGISTER_ARITHMETIC
+#undef REGISTER_COMPARE_JUMP
+#undef REGISTER_EQUALITY_JUMP
+#undef REGISTER_NUMBER_EQUALITY_JUMP
+#undef NUMBER_EQUALS
+#undef OPCODE
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef ENTER_JIT
+#undef RECORD_TRACE
+#undef TRACE_EXECUTION
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
 }
 
+#ifdef JIT
+// The JIT's slow paths. Each mirrors its case in run(), reading operands
+// from the instruction at bc instead of advancing an ip.
+
+#define JIT_CONSTANT(at) (frame->closure->function->constants.values[bc[at]])
+#define JIT_SHORT(at) ((u16)((bc[at] << 8) | bc[at + 1]))
+
+static s32 jitError(struct State* H, const char* message) {
+  runtimeError(H, "%s", message);
+  return JIT_HELPER_ERROR;
+}
+
+s32 jitArithmetic(struct State* H, UNUSED struct CallFrame* frame, const u8* bc) {
+  if (!IS_NUMBER(peek(H, 0)) || !IS_NUMBER(peek(H, 1))) {
+    return jitError(H, "Operands must be numbers.");
+  }
+  Value b = pop(H);
+  Value a = pop(H);
+  switch (bc[0]) {
+    case BC_GREATER:       push(H, NEW_BOOL(COMPARE_NUMBERS(a, >, b))); break;
+    case BC_GREATER_EQUAL: push(H, NEW_BOOL(COMPARE_NUMBERS(a, >=, b))); break;
+    case BC_LESSER:        push(H, NEW_BOOL(COMPARE_NUMBERS(a, <, b))); break;
+    case BC_LESSER_EQUAL:  push(H, NEW_BOOL(COMPARE_NUMBERS(a, <=, b))); break;
+    case BC_ADD:           push(H, addNumbers(a, b)); break;
+    case BC_SUBTRACT:      push(H, subtractNumbers(a, b)); break;
+    case BC_MULTIPLY:      push(H, multiplyNumbers(a, b)); break;
+    case BC_DIVIDE:        push(H, divideNumbers(a, b)); break;
+    case BC_MODULO:        push(H, moduloNumbers(a, b)); break;
+    case BC_POW:           push(H, NEW_NUMBER(pow(AS_NUMBER(a), AS_NUMBER(b)))); break;
+  }
+  return 0;
+}
+
+s32 jitEquality(struct State* H, UNUSED struct CallFrame* frame, const u8* bc) {
+  Value b = pop(H);
+  Value a = pop(H);
+  push(H, NEW_BOOL(valuesEqual(a, b) == (bc[0] == BC_EQUAL || bc[0] == BC_EQUAL_NUM)));
+  return 0;
+}
+
+s32 jitConcat(struct State* H, UNUSED struct CallFrame* frame, UNUSED const u8* bc) {
+  if (!IS_STRING(peek(H, 0)) || !IS_STRING(peek(H, 1))) {
+    return jitError(H, "Operands must be strings.");
+  }
+  concatenate(H);
+  return 0;
+}
+
+s32 jitNegate(struct State* H, UNUSED struct CallFrame* frame, UNUSED const u8* bc) {
+  if (!IS_NUMBER(peek(H, 0))) {
+    return jitError(H, "Operand must be a number.");
+  }
+  push(H, negateNumber(pop(H)));
+  return 0;
+}
+
+s32 jitNot(struct State* H, UNUSED struct CallFrame* frame, UNUSED const u8* bc) {
+  push(H, NEW_BOOL(isFalsey(pop(H))));
+  return 0;
+}
+
+static bool compareNumbers(u8 op, Value a, Value b) {
+  switch (op) {
+    case BC_JUMP_IF_NOT_GREATER:
+    case BC_JUMP_IF_NOT_GREATER_RR:
+    case BC_JUMP_IF_NOT_GREATER_RK:
+      return COMPARE_NUMBERS(a, >, b);
+    case BC_JUMP_IF_NOT_GREATER_EQUAL:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case BC_JUMP_IF_NOT_GREATER_EQUAL_RK:
+      return COMPARE_NUMBERS(a, >=, b);
+    case BC_JUMP_IF_NOT_LESSER:
+    case BC_JUMP_IF_NOT_LESSER_RR:
+    case BC_JUMP_IF_NOT_LESSER_RK:
+      return COMPARE_NUMBERS(a, <, b);
+    default:
+      return COMPARE_NUMBERS(a, <=, b);
+  }
+}
+
+// Every compare-and-branch form jumps when the comparison fails, except
+// JUMP_IF_EQUAL.
+static s32 compareJump(struct State* H, u8 op, Value left, Value right) {
+  switch (op) {
+    case BC_JUMP_IF_EQUAL:
+    case BC_JUMP_IF_EQUAL_RR:
+    case BC_JUMP_IF_EQUAL_RK:
+    case BC_JUMP_IF_EQUAL_NUM:
+    case BC_JUMP_IF_EQUAL_NUM_RR:
+    case BC_JUMP_IF_EQUAL_NUM_RK:
+      return valuesEqual(left, right);
+    case BC_JUMP_IF_NOT_EQUAL:
+    case BC_JUMP_IF_NOT_EQUAL_RR:
+    case BC_JUMP_IF_NOT_EQUAL_RK:
+    case BC_JUMP_IF_NOT_EQUAL_NUM:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RR:
+    case BC_JUMP_IF_NOT_EQUAL_NUM_RK:
+      return !valuesEqual(left, right);
+    default:
+      if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+        return jitError(H, "Operands must be numbers.");
+      }
+      return !compareNumbers(op, left, right);
+  }
+}
+
+s32 jitCompareJump(struct State* H, UNUSED struct CallFrame* frame, const u8* bc) {
+  Value right = peek(H, 0);
+  Value left = peek(H, 1);
+  s32 result = compareJump(H, bc[0], left, right);
+  if (result != JIT_HELPER_ERROR) {
+    H->stackTop -= 2;
+  }
+  return result;
+}
+
+s32 jitLocalArithmetic(struct State* H, struct CallFrame* frame, const u8* bc) {
+  Value left = frame->slots[bc[1]];
+  Value right = bc[0] == BC_ADD_LOCALS || bc[0] == BC_SUBTRACT_LOCALS
+      ? frame->slots[bc[2]]
+      : JIT_CONSTANT(2);
+  if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+    return jitError(H, "Operands must be numbers.");
+  }
+  bool add = bc[0] == BC_ADD_LOCALS || bc[0] == BC_ADD_LOCAL_CONSTANT;
+  push(H, add ? addNumbers(left, right) : subtractNumbers(left, right));
+  return 0;
+}
+
+s32 jitRegisterArithmetic(struct State* H, struct CallFrame* frame, const u8* bc) {
+  u8 op = bc[0];
+  Value left = frame->slots[bc[2]];
+  Value right = op <= BC_DIVIDE_RR ? frame->slots[bc[3]] : JIT_CONSTANT(3);
+  if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+    return jitError(H, "Operands must be numbers.");
+  }
+  Value result;
+  switch (op) {
+    case BC_ADD_RR: case BC_ADD_RK: result = addNumbers(left, right); break;
+    case BC_SUBTRACT_RR: case BC_SUBTRACT_RK: result = subtractNumbers(left, right); break;
+    case BC_MULTIPLY_RR: case BC_MULTIPLY_RK: result = multiplyNumbers(left, right); break;
+    default: result = divideNumbers(left, right); break;
+  }
+  frame->slots[bc[1]] = result;
+  return 0;
+}
+
+s32 jitRegisterCompareJump(struct State* H, struct CallFrame* frame, const u8* bc) {
+  Value left = frame->slots[bc[1]];
+  bool constant = bc[0] >= BC_JUMP_IF_NOT_EQUAL_RK && bc[0] <= BC_JUMP_IF_NOT_LESSER_EQUAL_RK;
+  constant = constant || bc[0] == BC_JUMP_IF_NOT_EQUAL_NUM_RK || bc[0] == BC_JUMP_IF_EQUAL_NUM_RK;
+  Value right = constant ? JIT_CONSTANT(2) : frame->slots[bc[2]];
+  return compareJump(H, bc[0], left, right);
+}
+
+s32 jitForPrep(struct State* H, struct CallFrame* frame, const u8* bc) {
+  Value* counter = &frame->slots[bc[1]];
+  if (!checkForRange(H, counter)) {
+    return JIT_HELPER_ERROR;
+  }
+  return !forContinues(counter);
+}
+
+s32 jitForLoop(struct State* H, struct CallFrame* frame, const u8* bc) {
+  Value* counter = &frame->slots[bc[1]];
+  if (!IS_NUMBER(counter[0])) {
+    return jitError(H, "Operands must be numbers.");
+  }
+  counter[0] = addNumbers(counter[0], counter[2]);
+  return !forContinues(counter);
+}
+
+s32 jitForInPrep(struct State* H, struct CallFrame* frame, const u8* bc) {
+  return checkIterable(H, &frame->slots[bc[1]]) ? 0 : JIT_HELPER_ERROR;
+}
+
+s32 jitCalleeGuard(struct State* H, struct CallFrame* frame, const u8* bc) {
+  return !isCallee(peek(H, bc[1]), JIT_CONSTANT(2));
+}
+
+s32 jitForInLoop(struct State* H, struct CallFrame* frame, const u8* bc) {
+  return !iterate(H, &frame->slots[bc[1]]);
+}
+
+s32 jitGetGlobal(struct State* H, UNUSED struct CallFrame* frame, const u8* bc) {
+  u16 slot = JIT_SHORT(1);
+  Value value = H->globalValues.values[slot];
+  if (IS_UNDEFINED(value)) {
+    runtimeError(H, "Undefined variable '%s'.", AS_CSTRING(H->globalNames.values[slot]));
+    return JIT_HELPER_ERROR;
+  }
+  push(H, value);
+  return 0;
+}
+
+s32 jitSetGlobal(struct State* H, UNUSED struct CallFrame* frame, const u8* bc) {
+  u16 slot = JIT_SHORT(1);
+  Value* value = &H->globalValues.values[slot];
+  if (IS_UNDEFINED(*value)) {
+    runtimeError(H, "Undefined variable '%s'.", AS_CSTRING(H->globalNames.values[slot]));
+    return JIT_HELPER_ERROR;
+  }
+  *value = peek(H, 0);
+  return 0;
+}
+
+s32 jitGetUpvalue(struct State* H, struct CallFrame* frame, const u8* bc) {
+  push(H, upvalueValue(frame->closure->upvalues[bc[1]]));
+  return 0;
+}
+
+s32 jitSetUpvalue(struct State* H, struct CallFrame* frame, const u8* bc) {
+  *AS_UPVALUE(frame->closure->upvalues[bc[1]])->location = peek(H, 0);
+  return 0;
+}
+
+s32 jitGetProperty(struct State* H, struct CallFrame* frame, const u8* bc) {
+  struct String* name = AS_STRING(JIT_CONSTANT(1));
+  struct InlineCache* cache = &frame->closure->function->caches[JIT_SHORT(2)];
+  bool popValue = bc[0] == BC_GET_PROPERTY;
+  Value object = peek(H, 0);
+  if (IS_INSTANCE(object)) {
+    struct Instance* instance = AS_INSTANCE(object);
+    struct InlineCacheEntry* cached = findCacheEntry(cache, instance->strooct);
+    if (cached != NULL && cached->method != NULL) {
+      bindMethod(H, instance, cached->method, popValue);
+      return 0;
+    }
+    if (cached != NULL && cached->field < instance->fieldCount) {
+      if (popValue) {
+        pop(H); // Instance
+      }
+      push(H, instance->fields[cached->field]);
+      return 0;
+    }
+  }
+
+  return getProperty(H, object, name, popValue, cache) ? 0 : JIT_HELPER_ERROR;
+}
+
+s32 jitSetProperty(struct State* H, struct CallFrame* frame, const u8* bc) {
+  struct String* name = AS_STRING(JIT_CONSTANT(1));
+  struct InlineCache* cache = &frame->closure->function->caches[JIT_SHORT(2)];
+  Value object = peek(H, 1);
+  struct Instance* instance = IS_INSTANCE(object) ? AS_INSTANCE(object) : NULL;
+  struct InlineCacheEntry* cached = instance != NULL
+      ? findCacheEntry(cache, instance->strooct)
+      : NULL;
+  if (cached != NULL && cached->field < instance->fieldCount) {
+    instance->fields[cached->field] = peek(H, 0);
+  } else if (!setProperty(H, name, cache)) {
+    return JIT_HELPER_ERROR;
+  }
+
+  Value value = pop(H);
+  pop(H);
+  push(H, value);
+  return 0;
+}
+
+s32 jitGetSelfField(struct State* H, struct CallFrame* frame, const u8* bc) {
+  struct Instance* instance = AS_INSTANCE(frame->slots[0]);
+  if (bc[1] >= instance->fieldCount) {
+    runtimeError(H, "Undefined property '%s'.", fieldName(instance->strooct, bc[1])->chars);
+    return JIT_HELPER_ERROR;
+  }
+  push(H, instance->fields[bc[1]]);
+  return 0;
+}
+
+s32 jitSetSelfField(struct State* H, struct CallFrame* frame, const u8* bc) {
+  struct Instance* instance = AS_INSTANCE(frame->slots[0]);
+  if (bc[1] >= instance->fieldCount) {
+    runtimeError(H, "Undefined property '%s'.", fieldName(instance->strooct, bc[1])->chars);
+    return JIT_HELPER_ERROR;
+  }
+  instance->fields[bc[1]] = peek(H, 0);
+  return 0;
+}
+
+s32 jitGetSubscript(struct State* H, UNUSED struct CallFrame* frame, UNUSED const u8* bc) {
+  if (!IS_NUMBER(peek(H, 0))) {
+    return jitError(H, "Can only use subscript operator with numbers.");
+  }
+  s32 index = valueToIndex(peek(H, 0));
+
+  if (!IS_ARRAY(peek(H, 1))) {
+    return jitError(H, "Invalid target for subscript operator.");
+  }
+
+  struct Array* array = AS_ARRAY(peek(H, 1));
+
+  if (index < 0 || index > array->values.count) {
+    runtimeError(H, "Index out of bounds. Array size is %d, but tried accessing %d",
+        array->values.count, index);
+    return JIT_HELPER_ERROR;
+  }
+
+  pop(H); // Index
+  pop(H); // Array
+  push(H, array->values.values[index]);
+  return 0;
+}
+
+#undef JIT_CONSTANT
+#undef JIT_SHORT
+#endif
+
 enum InterpretResult interpret(struct State* H, const char* source) {
   struct Function* function = compile(H, H->parser, source);
   if (function == NULL) {
@@ -11,8 +11,14 @@ enum InterpretResult {
 
 void initState(struct State* H);
 void freeState(struct State* H);
-void bindCFunction(struct State* H, const char* name, CFunction cFunction);
+s32 globalSlot(struct State* H, struct String* name);
+void bindCFunction(
+    struct State* H, const char* name, CFunction cFunction,
+    s32 arity, s32 resultCount);
+void runtimeError(struct State* H, const char* format, ...);
 enum InterpretResult interpret(struct State* H, const char* source);
+bool foldBinary(struct State* H, u8 op, Value a, Value b, Value* result);
+bool foldUnary(u8 op, Value a, Value* result);
 void push(struct State* H, Value value);
 Value pop(struct State* H);
 
@@ -26,9 +26,11 @@ EXPECT_PATTERN = re.compile(r'// expect: ?(.*)')
 EXPECT_ERROR_PATTERN = re.compile(r'// expect error(?! line)')
 EXPECT_ERROR_LINE_PATTERN = re.compile(r'// expect error line (\d+)')
 EXPECT_RUNTIME_ERROR_PATTERN = re.compile(r'// expect (handled )?runtime error: (.+)')
+EXPECT_TRACE_PATTERN = re.compile(r'// expect trace: (.+)')
 
 ERROR_PATTERN = re.compile(r'\[line (\d+)\] Error.*')
 STACK_TRACE_PATTERN = re.compile(r'\[line #(\d+)\]')
+OMITTED_FRAMES_PATTERN = re.compile(r'^\.\.\. \d+ frames? omitted')
 
 STDIN_PATTERN = re.compile(r'// stdin: (.*)')
 SKIP_PATTERN = re.compile(r'// skip: (.*)')
@@ -47,6 +49,7 @@ class Test:
         self.compile_errors = set()
         self.runtime_error_line = 0
         self.runtime_error_message = None
+        self.stack_trace = []
         self.exit_code = 0
         self.input_bytes = None
         self.failures = []
@@ -106,6 +109,11 @@ class Test:
                         self.exit_code = 70
                     expectations += 1
 
+                match = EXPECT_TRACE_PATTERN.search(line)
+                if match:
+                    self.stack_trace.append(match.group(1))
+                    expectations += 1
+
                 match = STDIN_PATTERN.search(line)
                 if match:
                     input_lines.append(match.group(1))
@@ -177,6 +185,7 @@ class Test:
         if self.runtime_error_message:
             pass
             # self.validate_runtime_error(error_lines)
+            self.validate_stack_trace(error_lines)
         else:
             self.validate_compile_errors(error_lines)
 
@@ -224,6 +233,21 @@ class Test:
                     self.runtime_error_line, stack_line)
 
 
+    def validate_stack_trace(self, error_lines):
+        # Only checked where a test spells out the frames it expects.
+        if not self.stack_trace: return
+
+        stack_lines = [line for line in error_lines
+            if STACK_TRACE_PATTERN.search(line) or OMITTED_FRAMES_PATTERN.search(line)]
+        if stack_lines != self.stack_trace:
+            self.fail('Expected stack trace:')
+            for line in self.stack_trace:
+                self.fail(line)
+            self.fail('Got:')
+            for line in stack_lines:
+                self.fail(line)
+
+
     def validate_compile_errors(self, error_lines):
         # Validate that every compile error was expected.
         found_errors = set()